@@ -0,0 +1,98 @@
+// 响应头拼接的微基准：原来基于vsnprintf的addResponse路径 vs HeaderWriter
+//
+// 编译运行(在bench目录下)：
+//   g++ -O2 -I../src header_bench.cpp -o header_bench
+//   ./header_bench [iterations]
+
+#include <sys/types.h>
+#include <time.h>
+
+#include <cstdarg>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include "header_writer.h"
+
+static const int WRITE_BUFFER_SIZE = 1024;
+
+static char write_buffer[WRITE_BUFFER_SIZE];
+static int write_index = 0;
+
+// 和原来HttpConnection::addResponse相同的实现
+static bool addResponse(const char *format, ...) {
+    if (write_index >= WRITE_BUFFER_SIZE) {
+        return false;
+    }
+
+    va_list arg_list;
+    va_start(arg_list, format);
+    int len = vsnprintf(write_buffer + write_index, WRITE_BUFFER_SIZE - 1 - write_index, format, arg_list);
+    va_end(arg_list);
+    if (len >= (WRITE_BUFFER_SIZE - 1 - write_index)) {
+        return false;
+    }
+
+    write_index += len;
+    return true;
+}
+
+// 原来processWrite(FILE_REQUEST)生成响应头的调用序列
+static bool buildWithPrintf(off_t content_len, bool keep_alive) {
+    return addResponse("%s %d %s\r\n", "HTTP/1.1", 200, "OK") &&
+           addResponse("Content-Length: %d\r\n", (int)content_len) &&
+           addResponse("Content-Type:%s\r\n", "text/html") &&
+           addResponse("Connection: %s\r\n", keep_alive ? "keep-alive" : "close") && addResponse("%s", "\r\n");
+}
+
+static bool buildWithWriter(off_t content_len, bool keep_alive) {
+    HeaderWriter writer(write_buffer, WRITE_BUFFER_SIZE, &write_index);
+    return writer.append(STATUS_200) && writer.append(CONTENT_LENGTH) && writer.appendNumber(content_len) &&
+           writer.append(CRLF) && writer.append(CONTENT_TYPE_HTML) &&
+           writer.append(keep_alive ? CONNECTION_KEEP_ALIVE : CONNECTION_CLOSE) && writer.append(CRLF);
+}
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// 运行iterations次，返回每次的平均纳秒数
+static double run(bool (*build)(off_t, bool), long iterations, size_t *checksum) {
+    double start = now();
+    for (long i = 0; i < iterations; ++i) {
+        write_index = 0;
+        build(350 + (i & 0xffff), i & 1);
+        *checksum += write_index + write_buffer[write_index / 2];
+    }
+    return (now() - start) * 1e9 / iterations;
+}
+
+int main(int argc, char *argv[]) {
+    long iterations = argc > 1 ? atol(argv[1]) : 10000000;
+
+    // 两种方式的输出必须完全一致
+    char expected[WRITE_BUFFER_SIZE];
+    write_index = 0;
+    buildWithPrintf(123456, true);
+    int expected_len = write_index;
+    memcpy(expected, write_buffer, expected_len);
+    write_index = 0;
+    buildWithWriter(123456, true);
+    if (write_index != expected_len || memcmp(expected, write_buffer, expected_len) != 0) {
+        printf("output mismatch\n");
+        return 1;
+    }
+
+    size_t checksum = 0;
+    double printf_ns = run(buildWithPrintf, iterations, &checksum);
+    double writer_ns = run(buildWithWriter, iterations, &checksum);
+
+    printf("iterations: %ld (checksum %zu)\n", iterations, checksum);
+    printf("vsnprintf addResponse: %8.1f ns/response\n", printf_ns);
+    printf("HeaderWriter:          %8.1f ns/response\n", writer_ns);
+    printf("speedup:               %8.2fx\n", printf_ns / writer_ns);
+
+    return 0;
+}
@@ -0,0 +1,543 @@
+// 压力测试：在回环地址上启动服务器，用多线程、每个线程一个epoll的客户端通过长连接施压，
+// 统计吞吐量和延迟分布，代替原来的webbench
+//
+// 每个连接上同时有depth个请求在路上(depth > 1时是流水线)，收到一个响应就发出下一个请求。
+// 请求的文件按连接轮流选取：默认是index.html，用-s指定大小时先在网站根目录下生成这些大小的文件。
+// 延迟从请求写入发送缓冲区开始，到响应最后一个字节收到为止，记录在HDR直方图中
+//
+// 编译运行(在bench目录下，先在src目录下编译出服务器)：
+//   g++ -O2 load_bench.cpp -pthread -o load_bench
+//   ./load_bench ../src/a.out [-p port] [-c connections] [-t threads] [-P depth] [-d seconds] [-w seconds]
+//                [-s 1k,64k,1m] [-D root] [-v] [-- server options]
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+static uint64_t now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// HDR直方图：和HdrHistogram一样按数量级分桶，每个数量级内再线性细分。小于2^SUB_BITS的值精确记录，
+// 更大的值保留SUB_BITS位有效二进制位，相对误差不超过1/2^(SUB_BITS-1)，即3位有效数字。
+// 记录只是一次数组加一，各线程各自记录，结束时合并
+class Histogram {
+   public:
+    static const int SUB_BITS = 11;
+    static const int MAX_SHIFT = 30;  // 以纳秒为单位最多记录约2^41纳秒，更大的值记为最大值
+    static const int SUB_COUNT = 1 << SUB_BITS;
+    static const int HALF_COUNT = SUB_COUNT / 2;
+    static const int INDEX_NUMBER = SUB_COUNT + MAX_SHIFT * HALF_COUNT;
+
+   public:
+    Histogram() : counts_(INDEX_NUMBER, 0), total_(0), max_(0) {}
+
+    void record(uint64_t value) {
+        ++counts_[index(value)];
+        ++total_;
+        max_ = value > max_ ? value : max_;
+    }
+
+    void merge(const Histogram &other) {
+        for (int i = 0; i < INDEX_NUMBER; ++i) {
+            counts_[i] += other.counts_[i];
+        }
+        total_ += other.total_;
+        max_ = other.max_ > max_ ? other.max_ : max_;
+    }
+
+    uint64_t total() const { return total_; }
+    uint64_t max() const { return max_; }
+
+    // 第percentile百分位的值：累计个数达到总数的percentile%的桶中可能的最大值
+    uint64_t percentile(double percentile) const {
+        uint64_t target = (uint64_t)(percentile / 100 * total_ + 0.5);
+        target = target == 0 ? 1 : target;
+        uint64_t seen = 0;
+        for (int i = 0; i < INDEX_NUMBER; ++i) {
+            seen += counts_[i];
+            if (seen >= target) {
+                uint64_t highest = highestValue(i);
+                return highest < max_ ? highest : max_;
+            }
+        }
+        return max_;
+    }
+
+   private:
+    static int index(uint64_t value) {
+        if (value < (uint64_t)SUB_COUNT) {
+            return (int)value;
+        }
+        int shift = 63 - __builtin_clzll(value) - (SUB_BITS - 1);
+        if (shift > MAX_SHIFT) {
+            return INDEX_NUMBER - 1;
+        }
+        return SUB_COUNT + (shift - 1) * HALF_COUNT + (int)(value >> shift) - HALF_COUNT;
+    }
+
+    static uint64_t highestValue(int index) {
+        if (index < SUB_COUNT) {
+            return index;
+        }
+        int shift = (index - SUB_COUNT) / HALF_COUNT + 1;
+        uint64_t sub = (index - SUB_COUNT) % HALF_COUNT + HALF_COUNT;
+        return ((sub + 1) << shift) - 1;
+    }
+
+   private:
+    std::vector<uint64_t> counts_;
+    uint64_t total_;
+    uint64_t max_;
+};
+
+enum PHASE { WARMUP = 0, MEASURE, STOP };
+
+static std::atomic<int> phase(WARMUP);
+static int port = 9006;
+static int depth = 1;
+static std::vector<std::string> requests;
+
+static const int INPUT_SIZE = 65536;
+
+struct Connection {
+    int sockfd;
+    char input[INPUT_SIZE];  // 未处理的响应数据，响应体直接丢弃不保存
+    size_t input_length;
+    bool in_body;
+    uint64_t body_left;
+    std::vector<uint64_t> sent_at;  // 在路上的请求写入的时间，大小为depth的环形队列
+    unsigned head;
+    unsigned outstanding;
+    std::string output;  // 还没发出去的请求
+    size_t output_offset;
+    bool want_write;
+    unsigned next_request;
+};
+
+struct Worker {
+    pthread_t thread;
+    int connection_number;
+    int first_request;  // 连接从第几个请求开始轮流，让各连接请求的文件错开
+    Histogram histogram;
+    uint64_t completed;
+    uint64_t bytes;
+    uint64_t errors;
+};
+
+static int connectServer() {
+    int sockfd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    inet_pton(AF_INET, "127.0.0.1", &address.sin_addr);
+    if (connect(sockfd, (struct sockaddr *)&address, sizeof(address)) < 0) {
+        close(sockfd);
+        return -1;
+    }
+    int one = 1;
+    setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    fcntl(sockfd, F_SETFL, fcntl(sockfd, F_GETFL) | O_NONBLOCK);
+    return sockfd;
+}
+
+static void updateEvents(int epollfd, Connection *connection, bool want_write) {
+    if (connection->want_write == want_write) {
+        return;
+    }
+    struct epoll_event event;
+    event.data.ptr = connection;
+    event.events = EPOLLIN | (want_write ? EPOLLOUT : 0);
+    epoll_ctl(epollfd, EPOLL_CTL_MOD, connection->sockfd, &event);
+    connection->want_write = want_write;
+}
+
+// 补足depth个在路上的请求，一次send全部发出
+static bool fill(int epollfd, Connection *connection) {
+    if (phase.load(std::memory_order_relaxed) != STOP) {
+        uint64_t time = now();
+        while (connection->outstanding < (unsigned)depth) {
+            connection->output += requests[connection->next_request++ % requests.size()];
+            connection->sent_at[(connection->head + connection->outstanding) % depth] = time;
+            ++connection->outstanding;
+        }
+    }
+    while (connection->output_offset < connection->output.size()) {
+        ssize_t len = send(connection->sockfd, connection->output.data() + connection->output_offset,
+                           connection->output.size() - connection->output_offset, MSG_NOSIGNAL);
+        if (len < 0) {
+            if (errno == EAGAIN) {
+                updateEvents(epollfd, connection, true);
+                return true;
+            }
+            return false;
+        }
+        connection->output_offset += len;
+    }
+    connection->output.clear();
+    connection->output_offset = 0;
+    updateEvents(epollfd, connection, false);
+    return true;
+}
+
+// 处理读缓冲中所有完整的响应，格式错误或者不是2xx时返回false
+static bool parse(Connection *connection, Worker *worker, bool measuring) {
+    size_t pos = 0;
+    while (true) {
+        if (connection->in_body) {
+            uint64_t take = connection->input_length - pos;
+            take = take < connection->body_left ? take : connection->body_left;
+            pos += take;
+            connection->body_left -= take;
+            if (connection->body_left > 0) {
+                break;
+            }
+            connection->in_body = false;
+            if (connection->outstanding == 0) {
+                return false;
+            }
+            if (measuring) {
+                worker->histogram.record(now() - connection->sent_at[connection->head]);
+                ++worker->completed;
+            }
+            connection->head = (connection->head + 1) % depth;
+            --connection->outstanding;
+            continue;
+        }
+
+        connection->input[connection->input_length] = '\0';
+        char *header = connection->input + pos;
+        char *end = strstr(header, "\r\n\r\n");
+        if (!end) {
+            break;
+        }
+        *end = '\0';
+        if (strncmp(header, "HTTP/1.1 2", 10) != 0) {
+            return false;
+        }
+        char *length = strstr(header, "Content-Length:");
+        connection->body_left = length ? strtoull(length + 15, NULL, 10) : 0;
+        connection->in_body = true;
+        if (measuring) {
+            worker->bytes += end + 4 - header + connection->body_left;
+        }
+        pos = end + 4 - connection->input;
+    }
+    if (pos == 0 && connection->input_length == INPUT_SIZE - 1) {
+        return false;  // 响应头太长
+    }
+    memmove(connection->input, connection->input + pos, connection->input_length - pos);
+    connection->input_length -= pos;
+    return true;
+}
+
+static bool openConnection(int epollfd, Connection *connection) {
+    connection->sockfd = connectServer();
+    if (connection->sockfd < 0) {
+        return false;
+    }
+    connection->input_length = 0;
+    connection->in_body = false;
+    connection->body_left = 0;
+    connection->head = 0;
+    connection->outstanding = 0;
+    connection->output.clear();
+    connection->output_offset = 0;
+    connection->want_write = false;
+    struct epoll_event event;
+    event.data.ptr = connection;
+    event.events = EPOLLIN;
+    epoll_ctl(epollfd, EPOLL_CTL_ADD, connection->sockfd, &event);
+    return fill(epollfd, connection);
+}
+
+// 出错的连接关闭后重新连接，在路上的请求都算作错误
+static void reopenConnection(int epollfd, Connection *connection, Worker *worker) {
+    worker->errors += connection->outstanding ? connection->outstanding : 1;
+    epoll_ctl(epollfd, EPOLL_CTL_DEL, connection->sockfd, NULL);
+    close(connection->sockfd);
+    while (phase.load(std::memory_order_relaxed) != STOP && !openConnection(epollfd, connection)) {
+        ++worker->errors;
+        usleep(1000);
+    }
+}
+
+static void *run(void *arg) {
+    Worker *worker = (Worker *)arg;
+    int epollfd = epoll_create1(0);
+    std::vector<Connection *> connections(worker->connection_number);
+    for (int i = 0; i < worker->connection_number; ++i) {
+        connections[i] = new Connection();
+        connections[i]->sent_at.resize(depth);
+        connections[i]->next_request = worker->first_request + i;
+        if (!openConnection(epollfd, connections[i])) {
+            ++worker->errors;
+        }
+    }
+
+    struct epoll_event events[256];
+    while (phase.load(std::memory_order_relaxed) != STOP) {
+        int number = epoll_wait(epollfd, events, 256, 100);
+        bool measuring = phase.load(std::memory_order_relaxed) == MEASURE;
+        for (int i = 0; i < number; ++i) {
+            Connection *connection = (Connection *)events[i].data.ptr;
+            if (events[i].events & EPOLLOUT) {
+                if (!fill(epollfd, connection)) {
+                    reopenConnection(epollfd, connection, worker);
+                    continue;
+                }
+            }
+            if (!(events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP))) {
+                continue;
+            }
+            ssize_t len = recv(connection->sockfd, connection->input + connection->input_length,
+                               INPUT_SIZE - 1 - connection->input_length, 0);
+            if (len < 0 && errno == EAGAIN) {
+                continue;
+            }
+            connection->input_length += len > 0 ? len : 0;
+            if (len <= 0 || !parse(connection, worker, measuring) || !fill(epollfd, connection)) {
+                reopenConnection(epollfd, connection, worker);
+            }
+        }
+    }
+
+    for (int i = 0; i < worker->connection_number; ++i) {
+        close(connections[i]->sockfd);
+        delete connections[i];
+    }
+    close(epollfd);
+    return NULL;
+}
+
+// 解析"1k,64k,1m"这样的文件大小列表
+static bool parseSizes(const char *text, std::vector<size_t> *sizes) {
+    while (*text) {
+        char *end = NULL;
+        size_t size = strtoull(text, &end, 10);
+        if (end == text) {
+            return false;
+        }
+        if (*end == 'k' || *end == 'K') {
+            size *= 1024;
+            ++end;
+        } else if (*end == 'm' || *end == 'M') {
+            size *= 1024 * 1024;
+            ++end;
+        }
+        sizes->push_back(size);
+        if (*end == ',') {
+            ++end;
+        } else if (*end != '\0') {
+            return false;
+        }
+        text = end;
+    }
+    return !sizes->empty();
+}
+
+static bool createFile(const std::string &path, size_t size) {
+    FILE *file = fopen(path.c_str(), "w");
+    if (!file) {
+        return false;
+    }
+    std::string block(65536, 'x');
+    for (size_t written = 0; written < size; written += block.size()) {
+        fwrite(block.data(), 1, size - written < block.size() ? size - written : block.size(), file);
+    }
+    fclose(file);
+    return true;
+}
+
+static void usage(const char *name) {
+    printf("usage: %s server [-p port] [-c connections] [-t threads] [-P depth] [-d seconds] [-w seconds]\n"
+           "       [-s sizes] [-D root] [-v] [-- server options]\n"
+           "  -s  file sizes to request, e.g. 1k,64k,1m, created under the document root; index.html by default\n"
+           "  -D  document root, passed to the server with -D, ../resources by default\n"
+           "  -v  print the full percentile distribution\n",
+           name);
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        usage(argv[0]);
+        return 1;
+    }
+    const char *server = argv[1];
+    int connections = 64;
+    int threads = 4;
+    int duration = 10;
+    int warmup = 2;
+    const char *root = "../resources";
+    std::vector<size_t> sizes;
+    bool verbose = false;
+
+    int opt = 0;
+    optind = 2;
+    while ((opt = getopt(argc, argv, "p:c:t:P:d:w:s:D:v")) != -1) {
+        switch (opt) {
+            case 'p':
+                port = atoi(optarg);
+                break;
+            case 'c':
+                connections = atoi(optarg);
+                break;
+            case 't':
+                threads = atoi(optarg);
+                break;
+            case 'P':
+                depth = atoi(optarg);
+                break;
+            case 'd':
+                duration = atoi(optarg);
+                break;
+            case 'w':
+                warmup = atoi(optarg);
+                break;
+            case 's':
+                if (!parseSizes(optarg, &sizes)) {
+                    usage(argv[0]);
+                    return 1;
+                }
+                break;
+            case 'D':
+                root = optarg;
+                break;
+            case 'v':
+                verbose = true;
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    if (connections <= 0 || threads <= 0 || depth <= 0 || duration <= 0 || warmup < 0) {
+        usage(argv[0]);
+        return 1;
+    }
+    threads = threads < connections ? threads : connections;
+
+    // 生成要请求的文件，结束后删除
+    std::vector<std::string> files;
+    for (size_t i = 0; i < sizes.size(); ++i) {
+        char name[64];
+        snprintf(name, sizeof(name), "/load_bench_%zu.bin", sizes[i]);
+        if (!createFile(root + std::string(name), sizes[i])) {
+            printf("create %s%s failed\n", root, name);
+            return 1;
+        }
+        files.push_back(name);
+    }
+    if (files.empty()) {
+        files.push_back("/index.html");
+    }
+    for (size_t i = 0; i < files.size(); ++i) {
+        requests.push_back("GET " + files[i] + " HTTP/1.1\r\nHost: 127.0.0.1\r\nConnection: keep-alive\r\n\r\n");
+    }
+
+    // 根目录用-D告诉服务器，"--"之后的参数原样传给服务器
+    std::vector<char *> server_argv;
+    char port_text[16];
+    snprintf(port_text, sizeof(port_text), "%d", port);
+    server_argv.push_back((char *)server);
+    server_argv.push_back(port_text);
+    server_argv.push_back((char *)"-D");
+    server_argv.push_back((char *)root);
+    for (int i = optind; i < argc; ++i) {
+        server_argv.push_back(argv[i]);
+    }
+    server_argv.push_back(NULL);
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        freopen("/dev/null", "w", stdout);
+        execv(server, server_argv.data());
+        _exit(127);
+    }
+
+    int sockfd = -1;
+    for (int i = 0; i < 200 && (sockfd = connectServer()) < 0; ++i) {
+        usleep(10000);
+    }
+    if (sockfd < 0) {
+        printf("server did not start on port %d\n", port);
+        kill(pid, SIGKILL);
+        waitpid(pid, NULL, 0);
+        return 1;
+    }
+    close(sockfd);
+
+    std::vector<Worker> workers(threads);
+    for (int i = 0; i < threads; ++i) {
+        workers[i].connection_number = connections / threads + (i < connections % threads ? 1 : 0);
+        workers[i].first_request = i;
+        workers[i].completed = workers[i].bytes = workers[i].errors = 0;
+        pthread_create(&workers[i].thread, NULL, run, &workers[i]);
+    }
+
+    sleep(warmup);
+    uint64_t start = now();
+    phase.store(MEASURE);
+    sleep(duration);
+    phase.store(STOP);
+    double seconds = (now() - start) / 1e9;
+
+    Histogram histogram;
+    uint64_t completed = 0, bytes = 0, errors = 0;
+    for (int i = 0; i < threads; ++i) {
+        pthread_join(workers[i].thread, NULL);
+        histogram.merge(workers[i].histogram);
+        completed += workers[i].completed;
+        bytes += workers[i].bytes;
+        errors += workers[i].errors;
+    }
+
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+    for (size_t i = 0; i < sizes.size(); ++i) {
+        unlink((root + files[i]).c_str());
+    }
+
+    printf("%d connections, %d threads, pipeline depth %d, %.1fs, files:", connections, threads, depth, seconds);
+    for (size_t i = 0; i < files.size(); ++i) {
+        printf(" %s", files[i].c_str());
+    }
+    printf("\n");
+    printf("requests: %llu  errors: %llu\n", (unsigned long long)completed, (unsigned long long)errors);
+    printf("throughput: %.0f requests/s  %.2f MB/s\n", completed / seconds, bytes / seconds / 1024 / 1024);
+    if (histogram.total() == 0) {
+        return 1;
+    }
+    printf("latency(us): p50=%.1f p90=%.1f p99=%.1f p99.9=%.1f max=%.1f\n", histogram.percentile(50) / 1e3,
+           histogram.percentile(90) / 1e3, histogram.percentile(99) / 1e3, histogram.percentile(99.9) / 1e3,
+           histogram.max() / 1e3);
+    if (verbose) {
+        // 和HdrHistogram的输出一样，百分位每一行向100%逼近一半
+        printf("%12s %14s %12s\n", "value(us)", "percentile", "1/(1-p)");
+        for (double remaining = 100; remaining > 0.0005; remaining /= 2) {
+            double p = 100 - remaining;
+            printf("%12.1f %14.6f %12.1f\n", histogram.percentile(p) / 1e3, p / 100, 100 / remaining);
+        }
+        printf("%12.1f %14.6f %12s\n", histogram.max() / 1e3, 1.0, "inf");
+    }
+    return errors ? 1 : 0;
+}
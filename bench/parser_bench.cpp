@@ -0,0 +1,299 @@
+// 请求解析的微基准：原来基于parseLine + strpbrk的逐行解析 vs RequestParser(标量/SSE4.2/AVX2)
+// 语料是常见浏览器和工具发出的真实请求
+//
+// 编译运行(在bench目录下)：
+//   g++ -O2 -I../src parser_bench.cpp ../src/request_parser.cpp -o parser_bench
+//   ./parser_bench [iterations]
+
+#include <strings.h>
+#include <time.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include "request_parser.h"
+
+static const char *CORPUS[] = {
+    // Chrome
+    "GET /index.html HTTP/1.1\r\n"
+    "Host: 192.168.110.129:10000\r\n"
+    "Connection: keep-alive\r\n"
+    "Cache-Control: max-age=0\r\n"
+    "sec-ch-ua: \"Chromium\";v=\"128\", \"Not;A=Brand\";v=\"24\", \"Google Chrome\";v=\"128\"\r\n"
+    "sec-ch-ua-mobile: ?0\r\n"
+    "sec-ch-ua-platform: \"Windows\"\r\n"
+    "Upgrade-Insecure-Requests: 1\r\n"
+    "User-Agent: Mozilla/5.0 (Windows NT 10.0; Win64; x64) AppleWebKit/537.36 (KHTML, like Gecko) "
+    "Chrome/128.0.0.0 Safari/537.36\r\n"
+    "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,image/avif,image/webp,image/apng,*/*;q=0.8,"
+    "application/signed-exchange;v=b3;q=0.7\r\n"
+    "Sec-Fetch-Site: none\r\n"
+    "Sec-Fetch-Mode: navigate\r\n"
+    "Sec-Fetch-User: ?1\r\n"
+    "Sec-Fetch-Dest: document\r\n"
+    "Accept-Encoding: gzip, deflate, br, zstd\r\n"
+    "Accept-Language: zh-CN,zh;q=0.9,en;q=0.8\r\n"
+    "\r\n",
+    // Firefox
+    "GET /images/image1.jpg HTTP/1.1\r\n"
+    "Host: 192.168.110.129:10000\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Ubuntu; Linux x86_64; rv:130.0) Gecko/20100101 Firefox/130.0\r\n"
+    "Accept: image/avif,image/webp,image/png,image/svg+xml,image/*;q=0.8,*/*;q=0.5\r\n"
+    "Accept-Language: zh-CN,zh;q=0.8,zh-TW;q=0.7,zh-HK;q=0.5,en-US;q=0.3,en;q=0.2\r\n"
+    "Accept-Encoding: gzip, deflate\r\n"
+    "Connection: keep-alive\r\n"
+    "Referer: http://192.168.110.129:10000/index.html\r\n"
+    "Sec-Fetch-Dest: image\r\n"
+    "Sec-Fetch-Mode: no-cors\r\n"
+    "Sec-Fetch-Site: same-origin\r\n"
+    "Priority: u=5, i\r\n"
+    "\r\n",
+    // Safari
+    "GET /index.html HTTP/1.1\r\n"
+    "Host: 192.168.110.129:10000\r\n"
+    "Upgrade-Insecure-Requests: 1\r\n"
+    "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8\r\n"
+    "User-Agent: Mozilla/5.0 (Macintosh; Intel Mac OS X 10_15_7) AppleWebKit/605.1.15 (KHTML, like Gecko) "
+    "Version/17.6 Safari/605.1.15\r\n"
+    "Accept-Language: zh-CN,zh-Hans;q=0.9\r\n"
+    "Accept-Encoding: gzip, deflate\r\n"
+    "Connection: keep-alive\r\n"
+    "\r\n",
+    // 手机Chrome
+    "GET /favicon.ico HTTP/1.1\r\n"
+    "Host: 192.168.110.129:10000\r\n"
+    "Connection: keep-alive\r\n"
+    "User-Agent: Mozilla/5.0 (Linux; Android 10; K) AppleWebKit/537.36 (KHTML, like Gecko) "
+    "Chrome/128.0.0.0 Mobile Safari/537.36\r\n"
+    "Accept: image/avif,image/webp,image/apng,image/svg+xml,image/*,*/*;q=0.8\r\n"
+    "Referer: http://192.168.110.129:10000/index.html\r\n"
+    "Accept-Encoding: gzip, deflate\r\n"
+    "Accept-Language: zh-CN,zh;q=0.9\r\n"
+    "\r\n",
+    // curl
+    "GET /index.html HTTP/1.1\r\n"
+    "Host: 127.0.0.1:10000\r\n"
+    "User-Agent: curl/8.5.0\r\n"
+    "Accept: */*\r\n"
+    "\r\n",
+    // webbench
+    "GET /index.html HTTP/1.1\r\n"
+    "User-Agent: WebBench 1.5\r\n"
+    "Host: 192.168.110.129\r\n"
+    "Connection: close\r\n"
+    "\r\n",
+};
+static const int CORPUS_SIZE = sizeof(CORPUS) / sizeof(CORPUS[0]);
+
+static const int READ_BUFFER_SIZE = 2048;
+
+// 和原来HttpConnection中逐行解析相同的实现：parseLine找\r\n，请求行用strpbrk切分，请求头用strncasecmp比较
+struct LineParser {
+    enum LINE_STATUS { LINE_OK = 0, LINE_BAD, LINE_OPEN };
+    enum CHECK_STATE { CHECK_STATE_REQUESTLINE = 0, CHECK_STATE_HEADER };
+
+    char *buffer;
+    int read_index;
+    int checked_index;
+    int start_line;
+    CHECK_STATE check_state;
+    char *url;
+    char *version;
+    char *host;
+    bool is_link;
+    long content_length;
+
+    LINE_STATUS parseLine() {
+        for (; checked_index < read_index; ++checked_index) {
+            char temp = buffer[checked_index];
+            if (temp == '\r') {
+                if ((checked_index + 1) == read_index) {
+                    return LINE_OPEN;
+                } else if (buffer[checked_index + 1] == '\n') {
+                    buffer[checked_index++] = '\0';
+                    buffer[checked_index++] = '\0';
+                    return LINE_OK;
+                }
+                return LINE_BAD;
+            } else if (temp == '\n') {
+                if ((checked_index > 1) && (buffer[checked_index - 1] == '\r')) {
+                    buffer[checked_index - 1] = '\0';
+                    buffer[checked_index++] = '\0';
+                    return LINE_OK;
+                }
+                return LINE_BAD;
+            }
+        }
+        return LINE_OPEN;
+    }
+
+    bool parseRequestLine(char *text) {
+        url = strpbrk(text, " \t");
+        if (!url) {
+            return false;
+        }
+        *url++ = '\0';
+        if (strcasecmp(text, "GET") != 0) {
+            return false;
+        }
+        version = strpbrk(url, " \t");
+        if (!version) {
+            return false;
+        }
+        *version++ = '\0';
+        if (strcasecmp(version, "HTTP/1.1") != 0) {
+            return false;
+        }
+        if (strncasecmp(url, "http://", 7) == 0) {
+            url += 7;
+            url = strchr(url, '/');
+        }
+        if (!url || url[0] != '/') {
+            return false;
+        }
+        check_state = CHECK_STATE_HEADER;
+        return true;
+    }
+
+    // 返回true表示请求头已经结束
+    bool parseHeader(char *text) {
+        if (text[0] == '\0') {
+            return true;
+        } else if (strncasecmp(text, "Connection:", 11) == 0) {
+            text += 11;
+            text += strspn(text, " \t");
+            if (strcasecmp(text, "keep-alive") == 0) {
+                is_link = true;
+            }
+        } else if (strncasecmp(text, "Content-Length:", 15) == 0) {
+            text += 15;
+            text += strspn(text, " \t");
+            content_length = atol(text);
+        } else if (strncasecmp(text, "Host:", 5) == 0) {
+            text += 5;
+            text += strspn(text, " \t");
+            host = text;
+        }
+        return false;
+    }
+
+    bool parse(char *data, int len) {
+        buffer = data;
+        read_index = len;
+        checked_index = start_line = 0;
+        check_state = CHECK_STATE_REQUESTLINE;
+        is_link = false;
+        content_length = 0;
+        host = NULL;
+        while (parseLine() == LINE_OK) {
+            char *text = buffer + start_line;
+            start_line = checked_index;
+            if (check_state == CHECK_STATE_REQUESTLINE) {
+                if (!parseRequestLine(text)) {
+                    return false;
+                }
+            } else if (parseHeader(text)) {
+                return true;
+            }
+        }
+        return false;
+    }
+};
+
+// 用RequestParser解析，并像HttpConnection一样取出Connection、Content-Length和Host
+static bool parseWithParser(char *data, int len, RequestParser *parser, size_t *checksum) {
+    parser->reset();
+    if (parser->parse(data, len) != RequestParser::COMPLETE) {
+        return false;
+    }
+    if (parser->url().len == 0) {
+        return false;
+    }
+    for (int i = 0; i < parser->headerCount(); ++i) {
+        const HeaderToken &header = parser->header(i);
+        const char *name = data + header.name.offset;
+        if (header.name.len == 10 && strncasecmp(name, "Connection", 10) == 0) {
+            *checksum += header.value.len;
+        } else if (header.name.len == 14 && strncasecmp(name, "Content-Length", 14) == 0) {
+            *checksum += atol(data + header.value.offset);
+        } else if (header.name.len == 4 && strncasecmp(name, "Host", 4) == 0) {
+            *checksum += header.value.offset;
+        }
+    }
+    return true;
+}
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char *argv[]) {
+    long iterations = argc > 1 ? atol(argv[1]) : 2000000;
+
+    int lengths[CORPUS_SIZE];
+    size_t total_bytes = 0;
+    for (int i = 0; i < CORPUS_SIZE; ++i) {
+        lengths[i] = strlen(CORPUS[i]);
+        total_bytes += lengths[i];
+    }
+
+    // 逐行解析会修改缓冲区，每次都从语料复制一份，RequestParser也同样复制以保证公平
+    static char buffer[READ_BUFFER_SIZE];
+    size_t checksum = 0;
+
+    // 先检查每个请求逐字节到达时RequestParser都能正确续解析
+    RequestParser parser;
+    for (int i = 0; i < CORPUS_SIZE; ++i) {
+        memcpy(buffer, CORPUS[i], lengths[i]);
+        parser.reset();
+        RequestParser::RESULT result = RequestParser::INCOMPLETE;
+        for (int len = 1; len <= lengths[i] && result == RequestParser::INCOMPLETE; ++len) {
+            result = parser.parse(buffer, len);
+        }
+        if (result != RequestParser::COMPLETE || parser.headerEnd() != lengths[i]) {
+            printf("corpus %d: incremental parse failed\n", i);
+            return 1;
+        }
+    }
+
+    LineParser line_parser;
+    double start = now();
+    for (long n = 0; n < iterations; ++n) {
+        int i = n % CORPUS_SIZE;
+        memcpy(buffer, CORPUS[i], lengths[i]);
+        if (!line_parser.parse(buffer, lengths[i])) {
+            printf("line parser failed on corpus %d\n", i);
+            return 1;
+        }
+        checksum += line_parser.checked_index + line_parser.is_link;
+    }
+    double line_ns = (now() - start) * 1e9 / iterations;
+
+    printf("iterations: %ld, corpus: %d requests, %zu bytes on average\n", iterations, CORPUS_SIZE,
+           total_bytes / CORPUS_SIZE);
+    printf("parseLine + strpbrk:    %8.1f ns/request\n", line_ns);
+
+    RequestParser::ENGINE best = RequestParser::engine();
+    for (int engine = RequestParser::SCALAR; engine <= best; ++engine) {
+        RequestParser::setEngine((RequestParser::ENGINE)engine);
+        start = now();
+        for (long n = 0; n < iterations; ++n) {
+            int i = n % CORPUS_SIZE;
+            memcpy(buffer, CORPUS[i], lengths[i]);
+            if (!parseWithParser(buffer, lengths[i], &parser, &checksum)) {
+                printf("request parser failed on corpus %d\n", i);
+                return 1;
+            }
+        }
+        double parser_ns = (now() - start) * 1e9 / iterations;
+        printf("RequestParser %-8s  %8.1f ns/request  %6.2fx  %5.2f GB/s\n",
+               RequestParser::engineName((RequestParser::ENGINE)engine), parser_ns, line_ns / parser_ns,
+               total_bytes / CORPUS_SIZE / parser_ns);
+    }
+    printf("checksum %zu\n", checksum);
+
+    return 0;
+}
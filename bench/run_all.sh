@@ -0,0 +1,42 @@
+#!/bin/sh
+# 基准测试套件：编译服务器和bench目录下的所有基准，依次运行微基准(请求解析、响应头拼接、线程池提交任务)
+# 和几组压力测试，部署前和上一次的输出对比，发现性能回退
+#
+# 用法(在任意目录下)：
+#   sh bench/run_all.sh [输出目录]
+# 编译产物放在输出目录中，默认是/tmp/webserver_bench。压力测试请求网站根目录下的文件，
+# 根目录通过环境变量BENCH_ROOT指定，默认是../resources，load_bench用-D把它传给服务器
+
+set -e
+cd "$(dirname "$0")"
+out=${1:-/tmp/webserver_bench}
+root=${BENCH_ROOT:-../resources}
+mkdir -p "$out"
+
+echo "== build"
+g++ -O2 ../src/*.cpp -pthread -lz -lbrotlienc -o "$out/server"
+g++ -O2 -I../src parser_bench.cpp ../src/request_parser.cpp -o "$out/parser_bench"
+g++ -O2 -I../src header_bench.cpp -o "$out/header_bench"
+g++ -O2 -I../src threadpool_bench.cpp ../src/locker.cpp ../src/log.cpp -pthread -o "$out/threadpool_bench"
+g++ -O2 load_bench.cpp -pthread -o "$out/load_bench"
+g++ -O2 -I../src ../test/timer_wheel_test.cpp ../src/timer_wheel.cpp -o "$out/timer_wheel_test"
+g++ -O2 ../test/content_length_test.cpp -o "$out/content_length_test"
+
+echo "== timer wheel"
+"$out/timer_wheel_test"
+echo "== Content-Length"
+"$out/content_length_test" "$out/server"
+
+echo "== parseLine vs RequestParser"
+"$out/parser_bench"
+echo "== processWrite headers: vsnprintf vs HeaderWriter"
+"$out/header_bench"
+echo "== ThreadPool::addTask"
+"$out/threadpool_bench"
+
+echo "== load: single reactor + thread pool, index.html"
+"$out/load_bench" "$out/server" -D "$root" -c 64 -d 10
+echo "== load: 4 sub reactors, index.html, pipeline depth 16"
+"$out/load_bench" "$out/server" -D "$root" -c 64 -P 16 -d 10 -- -r 4
+echo "== load: 4 sharded sub reactors, file cache, 1k/64k/1m files"
+"$out/load_bench" "$out/server" -D "$root" -c 64 -s 1k,64k,1m -d 10 -- -r 4 -s -c 64
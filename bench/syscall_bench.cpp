@@ -0,0 +1,228 @@
+// 每个请求的系统调用次数：epoll后端 vs io_uring后端
+//
+// 分别用两种I/O后端启动服务器(一个子reactor，文件缓存中缓存完整响应，排除文件I/O的影响)，
+// 通过LD_PRELOAD加载syscall_count.so统计服务器的系统调用。预热之后，若干条长连接各自依次发送请求，
+// 每个连接同一时刻只有一个请求在路上，统计这段时间内每个请求平均的系统调用次数
+//
+// 编译运行(在bench目录下，先在src目录下编译出服务器)：
+//   g++ -O2 -shared -fPIC syscall_count.cpp -o syscall_count.so -ldl
+//   g++ -O2 syscall_bench.cpp -pthread -o syscall_bench
+//   ./syscall_bench ../src/a.out [port] [connections] [requests_per_connection]
+
+#include <arpa/inet.h>
+#include <limits.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <string>
+#include <vector>
+
+static int port = 9006;
+static const char *request = "GET /index.html HTTP/1.1\r\nHost: bench\r\n\r\n";
+
+struct Client {
+    int requests;
+    int sockfd;
+    bool ok;
+};
+
+static int connectServer() {
+    int sockfd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    inet_pton(AF_INET, "127.0.0.1", &address.sin_addr);
+    if (connect(sockfd, (struct sockaddr *)&address, sizeof(address)) < 0) {
+        close(sockfd);
+        return -1;
+    }
+    int one = 1;
+    setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return sockfd;
+}
+
+// 读完一个响应：响应头之后按Content-Length读响应体
+static bool readResponse(int sockfd) {
+    char buffer[16384];
+    size_t used = 0;
+    while (true) {
+        ssize_t len = recv(sockfd, buffer + used, sizeof(buffer) - used - 1, 0);
+        if (len <= 0) {
+            return false;
+        }
+        used += len;
+        buffer[used] = '\0';
+        char *end = strstr(buffer, "\r\n\r\n");
+        if (!end) {
+            continue;
+        }
+        char *length = strstr(buffer, "Content-Length:");
+        size_t body = length ? strtoul(length + 15, NULL, 10) : 0;
+        size_t total = end + 4 - buffer + body;
+        while (used < total) {
+            len = recv(sockfd, buffer, total - used < sizeof(buffer) ? total - used : sizeof(buffer), 0);
+            if (len <= 0) {
+                return false;
+            }
+            used += len;
+        }
+        return true;
+    }
+}
+
+// 连接保持打开，等统计完之后再关闭，关闭连接的系统调用不计入
+static void *run(void *arg) {
+    Client *client = (Client *)arg;
+    client->ok = false;
+    client->sockfd = connectServer();
+    if (client->sockfd < 0) {
+        return NULL;
+    }
+    for (int i = 0; i < client->requests; ++i) {
+        if (send(client->sockfd, request, strlen(request), 0) < 0 || !readResponse(client->sockfd)) {
+            return NULL;
+        }
+    }
+    client->ok = true;
+    return NULL;
+}
+
+static bool runClients(int connections, int requests, std::vector<int> *sockets) {
+    std::vector<Client> clients(connections);
+    std::vector<pthread_t> threads(connections);
+    for (int i = 0; i < connections; ++i) {
+        clients[i].requests = requests;
+        pthread_create(&threads[i], NULL, run, &clients[i]);
+    }
+    bool ok = true;
+    for (int i = 0; i < connections; ++i) {
+        pthread_join(threads[i], NULL);
+        ok = ok && clients[i].ok;
+        if (clients[i].sockfd >= 0) {
+            sockets->push_back(clients[i].sockfd);
+        }
+    }
+    return ok;
+}
+
+static void closeAll(std::vector<int> *sockets) {
+    for (size_t i = 0; i < sockets->size(); ++i) {
+        close((*sockets)[i]);
+    }
+    sockets->clear();
+}
+
+// 启动服务器并统计一种后端，返回每种调用的次数(第二个快照减去第一个)
+static bool measure(const char *server, const char *preload, const char *backend, int connections, int requests,
+                    std::map<std::string, unsigned long> *counts) {
+    char output[64];
+    snprintf(output, sizeof(output), "/tmp/syscall_count.%d", getpid());
+    unlink(output);
+
+    char port_text[16];
+    snprintf(port_text, sizeof(port_text), "%d", port);
+    pid_t pid = fork();
+    if (pid == 0) {
+        setenv("LD_PRELOAD", preload, 1);
+        setenv("SYSCALL_COUNT_OUTPUT", output, 1);
+        freopen("/dev/null", "w", stdout);
+        execl(server, server, port_text, "-r", "1", "-s", "-c", "16", "-R", "-e", backend, (char *)NULL);
+        _exit(127);
+    }
+
+    int sockfd = -1;
+    for (int i = 0; i < 200 && (sockfd = connectServer()) < 0; ++i) {
+        usleep(10000);
+    }
+    if (sockfd < 0) {
+        kill(pid, SIGKILL);
+        waitpid(pid, NULL, 0);
+        return false;
+    }
+    close(sockfd);
+
+    // 预热文件缓存和缓冲区池
+    std::vector<int> sockets;
+    bool ok = runClients(connections, 10, &sockets);
+    closeAll(&sockets);
+    usleep(100000);
+
+    kill(pid, SIGUSR2);
+    usleep(100000);
+    ok = runClients(connections, requests, &sockets) && ok;
+    kill(pid, SIGUSR2);
+    usleep(100000);
+    closeAll(&sockets);
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+
+    FILE *file = fopen(output, "r");
+    if (!file) {
+        return false;
+    }
+    int snapshot = 0;
+    char name[64];
+    unsigned long count = 0;
+    while (fscanf(file, "%d %63s %lu", &snapshot, name, &count) == 3) {
+        if (snapshot == 0) {
+            (*counts)[name] -= count;
+        } else if (snapshot == 1) {
+            (*counts)[name] += count;
+        }
+    }
+    fclose(file);
+    unlink(output);
+    return ok;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        printf("usage: %s server [port] [connections] [requests_per_connection]\n", argv[0]);
+        return 1;
+    }
+    const char *server = argv[1];
+    port = argc > 2 ? atoi(argv[2]) : port;
+    int connections = argc > 3 ? atoi(argv[3]) : 32;
+    int requests = argc > 4 ? atoi(argv[4]) : 2000;
+
+    char preload[PATH_MAX];
+    if (!realpath("syscall_count.so", preload)) {
+        printf("syscall_count.so not found, build it first\n");
+        return 1;
+    }
+
+    const char *backends[] = {"epoll", "uring"};
+    std::map<std::string, unsigned long> counts[2];
+    for (int i = 0; i < 2; ++i) {
+        if (!measure(server, preload, backends[i], connections, requests, &counts[i])) {
+            printf("%s: benchmark failed\n", backends[i]);
+            return 1;
+        }
+    }
+
+    double total_requests = (double)connections * requests;
+    printf("%d connections x %d requests, syscalls per request:\n", connections, requests);
+    printf("%-20s %10s %10s\n", "", backends[0], backends[1]);
+    double totals[2] = {0, 0};
+    for (std::map<std::string, unsigned long>::iterator it = counts[0].begin(); it != counts[0].end(); ++it) {
+        double epoll_count = it->second / total_requests;
+        double uring_count = counts[1][it->first] / total_requests;
+        totals[0] += epoll_count;
+        totals[1] += uring_count;
+        if (it->second || counts[1][it->first]) {
+            printf("%-20s %10.3f %10.3f\n", it->first.c_str(), epoll_count, uring_count);
+        }
+    }
+    printf("%-20s %10.3f %10.3f\n", "total", totals[0], totals[1]);
+    return 0;
+}
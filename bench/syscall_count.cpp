@@ -0,0 +1,232 @@
+// 统计服务器进程的系统调用次数，由syscall_bench通过LD_PRELOAD加载到服务器中。
+// 拦截服务器直接调用的libc包装函数，它们每调用一次就是一次系统调用；io_uring没有libc包装函数，
+// 服务器通过syscall()调用，按调用号单独统计。收到SIGUSR2时记录一次所有计数的快照，
+// 进程退出时把快照写到$SYSCALL_COUNT_OUTPUT，每行是"快照序号 名字 次数"
+//
+// 编译(在bench目录下)：
+//   g++ -O2 -shared -fPIC syscall_count.cpp -o syscall_count.so -ldl
+//
+// 不包含声明这些函数的头文件，避免和glibc的声明(异常说明、fortify)冲突，参数类型在这里自己写
+
+#include <dlfcn.h>
+#include <signal.h>
+#include <sys/types.h>
+
+#include <atomic>
+#include <cstdarg>
+#include <cstdio>
+#include <cstdlib>
+
+struct epoll_event;
+struct iovec;
+struct msghdr;
+struct sockaddr;
+struct stat;
+
+// 所有被统计的调用，io_uring_setup/enter/register是syscall()的调用号
+#define SYSCALLS(X)                                                                                               \
+    X(accept4) X(recv) X(send) X(sendmsg) X(writev) X(read) X(write) X(epoll_wait) X(epoll_ctl) X(close)         \
+    X(shutdown) X(setsockopt) X(open) X(stat) X(fstat) X(mmap) X(munmap) X(sendfile) X(splice) X(io_uring_setup) \
+    X(io_uring_enter) X(io_uring_register) X(syscall)
+
+enum {
+#define ID(name) ID_##name,
+    SYSCALLS(ID)
+#undef ID
+    SYSCALL_NUMBER
+};
+
+static const char *names[] = {
+#define NAME(name) #name,
+    SYSCALLS(NAME)
+#undef NAME
+};
+
+static const int MAX_SNAPSHOT = 16;
+
+static std::atomic<unsigned long> counts[SYSCALL_NUMBER];
+static unsigned long snapshots[MAX_SNAPSHOT][SYSCALL_NUMBER];
+static std::atomic<int> snapshot_number(0);
+
+static void count(int id) { counts[id].fetch_add(1, std::memory_order_relaxed); }
+
+static void snapshot(int sig) {
+    int index = snapshot_number.load();
+    if (index >= MAX_SNAPSHOT) {
+        return;
+    }
+    for (int i = 0; i < SYSCALL_NUMBER; ++i) {
+        snapshots[index][i] = counts[i].load(std::memory_order_relaxed);
+    }
+    snapshot_number.store(index + 1);
+}
+
+__attribute__((constructor)) static void setup() {
+    struct sigaction action;
+    sigemptyset(&action.sa_mask);
+    action.sa_flags = SA_RESTART;
+    action.sa_handler = snapshot;
+    sigaction(SIGUSR2, &action, NULL);
+}
+
+__attribute__((destructor)) static void report() {
+    const char *path = getenv("SYSCALL_COUNT_OUTPUT");
+    FILE *file = path ? fopen(path, "w") : stderr;
+    if (!file) {
+        return;
+    }
+    for (int s = 0; s < snapshot_number.load(); ++s) {
+        for (int i = 0; i < SYSCALL_NUMBER; ++i) {
+            fprintf(file, "%d %s %lu\n", s, names[i], snapshots[s][i]);
+        }
+    }
+    if (file != stderr) {
+        fclose(file);
+    }
+}
+
+// 在被拦截的函数中取得libc中的原函数real
+#define REAL(name) static __typeof__(&name) real = (__typeof__(&name))dlsym(RTLD_NEXT, #name)
+
+extern "C" {
+
+int accept4(int fd, struct sockaddr *addr, unsigned int *len, int flags) {
+    REAL(accept4);
+    count(ID_accept4);
+    return real(fd, addr, len, flags);
+}
+
+ssize_t recv(int fd, void *buf, size_t len, int flags) {
+    REAL(recv);
+    count(ID_recv);
+    return real(fd, buf, len, flags);
+}
+
+ssize_t send(int fd, const void *buf, size_t len, int flags) {
+    REAL(send);
+    count(ID_send);
+    return real(fd, buf, len, flags);
+}
+
+ssize_t sendmsg(int fd, const struct msghdr *msg, int flags) {
+    REAL(sendmsg);
+    count(ID_sendmsg);
+    return real(fd, msg, flags);
+}
+
+ssize_t writev(int fd, const struct iovec *iov, int count_) {
+    REAL(writev);
+    count(ID_writev);
+    return real(fd, iov, count_);
+}
+
+ssize_t read(int fd, void *buf, size_t len) {
+    REAL(read);
+    count(ID_read);
+    return real(fd, buf, len);
+}
+
+ssize_t write(int fd, const void *buf, size_t len) {
+    REAL(write);
+    count(ID_write);
+    return real(fd, buf, len);
+}
+
+int epoll_wait(int epfd, struct epoll_event *events, int maxevents, int timeout) {
+    REAL(epoll_wait);
+    count(ID_epoll_wait);
+    return real(epfd, events, maxevents, timeout);
+}
+
+int epoll_ctl(int epfd, int op, int fd, struct epoll_event *event) {
+    REAL(epoll_ctl);
+    count(ID_epoll_ctl);
+    return real(epfd, op, fd, event);
+}
+
+int close(int fd) {
+    REAL(close);
+    count(ID_close);
+    return real(fd);
+}
+
+int shutdown(int fd, int how) {
+    REAL(shutdown);
+    count(ID_shutdown);
+    return real(fd, how);
+}
+
+int setsockopt(int fd, int level, int name, const void *value, unsigned int len) {
+    REAL(setsockopt);
+    count(ID_setsockopt);
+    return real(fd, level, name, value, len);
+}
+
+int open(const char *path, int flags, ...) {
+    REAL(open);
+    va_list args;
+    va_start(args, flags);
+    int mode = va_arg(args, int);
+    va_end(args);
+    count(ID_open);
+    return real(path, flags, mode);
+}
+
+int stat(const char *path, struct stat *buf) {
+    REAL(stat);
+    count(ID_stat);
+    return real(path, buf);
+}
+
+int fstat(int fd, struct stat *buf) {
+    REAL(fstat);
+    count(ID_fstat);
+    return real(fd, buf);
+}
+
+void *mmap(void *addr, size_t len, int prot, int flags, int fd, off_t offset) {
+    REAL(mmap);
+    count(ID_mmap);
+    return real(addr, len, prot, flags, fd, offset);
+}
+
+int munmap(void *addr, size_t len) {
+    REAL(munmap);
+    count(ID_munmap);
+    return real(addr, len);
+}
+
+ssize_t sendfile(int out_fd, int in_fd, off_t *offset, size_t len) {
+    REAL(sendfile);
+    count(ID_sendfile);
+    return real(out_fd, in_fd, offset, len);
+}
+
+ssize_t splice(int fd_in, long long *off_in, int fd_out, long long *off_out, size_t len, unsigned int flags) {
+    REAL(splice);
+    count(ID_splice);
+    return real(fd_in, off_in, fd_out, off_out, len, flags);
+}
+
+long syscall(long number, ...) {
+    REAL(syscall);
+    va_list args;
+    va_start(args, number);
+    long a[6];
+    for (int i = 0; i < 6; ++i) {
+        a[i] = va_arg(args, long);
+    }
+    va_end(args);
+    // 5.1之后新加的系统调用在各个架构上调用号相同
+    if (number == 425) {
+        count(ID_io_uring_setup);
+    } else if (number == 426) {
+        count(ID_io_uring_enter);
+    } else if (number == 427) {
+        count(ID_io_uring_register);
+    } else {
+        count(ID_syscall);
+    }
+    return real(number, a[0], a[1], a[2], a[3], a[4], a[5]);
+}
+}
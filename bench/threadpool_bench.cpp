@@ -0,0 +1,120 @@
+// 线程池请求队列的基准：LockedQueue(std::list + 互斥锁 + 信号量) vs LockFreeQueue(无锁环形队列 + 自旋后阻塞)
+// vs WorkStealingPool(每个线程一个队列，空闲时窃取)
+// 分别用1、8、32个工作线程，由producers个线程(模拟reactor)不断提交很小的任务，统计每秒完成的任务数
+//
+// 编译运行(在bench目录下)：
+//   g++ -O2 -I../src threadpool_bench.cpp ../src/locker.cpp ../src/log.cpp -pthread -o threadpool_bench
+//   ./threadpool_bench [tasks] [producers] [work_ns]
+
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+
+#include "threadpool.h"
+#include "work_stealing_pool.h"
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static std::atomic<long> completed(0);
+static int work_ns = 200;
+
+// 模拟一次请求处理：忙等work_ns纳秒
+struct Task {
+    Task() : worker_(-1) {}
+
+    int worker() const { return worker_; }
+    void setWorker(int id) { worker_ = id; }
+
+    int worker_;
+
+    void process() {
+        if (work_ns > 0) {
+            double end = now() + work_ns / 1e9;
+            while (now() < end) {
+            }
+        }
+        completed.fetch_add(1, std::memory_order_relaxed);
+    }
+};
+
+static const int TASK_NUMBER = 1024;
+static Task tasks[TASK_NUMBER];
+
+struct ProducerContext {
+    Executor<Task> *pool;
+    long count;  // 这个线程要提交的任务数
+};
+
+static void *produce(void *arg) {
+    ProducerContext *context = (ProducerContext *)arg;
+    for (long i = 0; i < context->count; ++i) {
+        // 队列满时让出CPU后重试
+        while (!context->pool->addTask(tasks + (i % TASK_NUMBER))) {
+            sched_yield();
+        }
+    }
+    return NULL;
+}
+
+// 返回每秒完成的任务数
+static double run(Executor<Task> *pool, long task_number, int producers) {
+    completed.store(0);
+    ProducerContext *contexts = new ProducerContext[producers];
+    pthread_t *threads = new pthread_t[producers];
+
+    double start = now();
+    for (int i = 0; i < producers; ++i) {
+        contexts[i].pool = pool;
+        contexts[i].count = task_number / producers;
+        pthread_create(threads + i, NULL, produce, contexts + i);
+    }
+    for (int i = 0; i < producers; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+    long expected = task_number / producers * producers;
+    while (completed.load() < expected) {
+        sched_yield();
+    }
+    double elapsed = now() - start;
+
+    delete[] contexts;
+    delete[] threads;
+    return expected / elapsed;
+}
+
+int main(int argc, char *argv[]) {
+    long task_number = argc > 1 ? atol(argv[1]) : 2000000;
+    int producers = argc > 2 ? atoi(argv[2]) : 1;
+    work_ns = argc > 3 ? atoi(argv[3]) : 200;
+
+    printf("tasks: %ld, producers: %d, work: %d ns/task\n", task_number, producers, work_ns);
+    printf("%8s %18s %18s %18s\n", "workers", "locked (tasks/s)", "lockfree (tasks/s)", "steal (tasks/s)");
+
+    const int WORKERS[] = {1, 8, 32};
+    for (int i = 0; i < 3; ++i) {
+        // 线程池的线程是分离的，不会退出，每组测试之后空闲的线程阻塞在各自的信号量上
+        Executor<Task> *locked = new ThreadPool<Task, LockedQueue<Task> >(WORKERS[i], 10000);
+        double locked_rate = run(locked, task_number, producers);
+        Executor<Task> *lockfree = new ThreadPool<Task, LockFreeQueue<Task> >(WORKERS[i], 10000);
+        double lockfree_rate = run(lockfree, task_number, producers);
+        WorkStealingPool<Task> *stealing = new WorkStealingPool<Task>(WORKERS[i], 10000);
+        double stealing_rate = run(stealing, task_number, producers);
+        uint64_t steals = 0;
+        for (int j = 0; j < WORKERS[i]; ++j) {
+            steals += stealing->steals(j);
+        }
+        printf("%8d %18.0f %18.0f %18.0f  (lockfree %.2fx, steal %.2fx, %llu steals)\n", WORKERS[i], locked_rate,
+               lockfree_rate, stealing_rate, lockfree_rate / locked_rate, stealing_rate / locked_rate,
+               (unsigned long long)steals);
+    }
+
+    return 0;
+}
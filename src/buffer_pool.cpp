@@ -0,0 +1,103 @@
+#include "buffer_pool.h"
+
+#include <cstdlib>
+#include <cstring>
+
+BufferPool::BufferPool(size_t max_buffer_size, size_t idle_limit)
+    : max_buffer_size_(max_buffer_size), leased_bytes_(0), idle_bytes_(0) {
+    for (int i = 0; i < CLASS_NUMBER; ++i) {
+        size_t size = MIN_BUFFER_SIZE << i;
+        free_lists_[i].head = NULL;
+        free_lists_[i].count = 0;
+        free_lists_[i].limit = idle_limit / size > 0 ? idle_limit / size : 1;
+    }
+}
+
+BufferPool::~BufferPool() {
+    for (int i = 0; i < CLASS_NUMBER; ++i) {
+        char *buffer = free_lists_[i].head;
+        while (buffer) {
+            char *next = NULL;
+            memcpy(&next, buffer, sizeof(next));
+            free(buffer);
+            buffer = next;
+        }
+    }
+}
+
+int BufferPool::sizeClass(size_t size) {
+    for (int i = 0; i < CLASS_NUMBER; ++i) {
+        if (size <= (MIN_BUFFER_SIZE << i)) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// 优先从对应一级的空闲链表中取，链表为空时才向系统申请
+char *BufferPool::acquire(size_t size, size_t *capacity) {
+    int index = sizeClass(size);
+    if (index < 0 || (MIN_BUFFER_SIZE << index) > max_buffer_size_) {
+        return NULL;
+    }
+    size_t class_size = MIN_BUFFER_SIZE << index;
+
+    FreeList &list = free_lists_[index];
+    list.locker.lock();
+    char *buffer = list.head;
+    if (buffer) {
+        memcpy(&list.head, buffer, sizeof(list.head));
+        --list.count;
+    }
+    list.locker.unlock();
+
+    if (buffer) {
+        idle_bytes_ -= class_size;
+    } else {
+        buffer = (char *)malloc(class_size);
+        if (!buffer) {
+            return NULL;
+        }
+    }
+
+    leased_bytes_ += class_size;
+    *capacity = class_size;
+    return buffer;
+}
+
+// 空闲链表已满时直接释放给系统
+void BufferPool::release(char *buffer, size_t capacity) {
+    if (!buffer) {
+        return;
+    }
+    leased_bytes_ -= capacity;
+
+    FreeList &list = free_lists_[sizeClass(capacity)];
+    list.locker.lock();
+    if (list.count < list.limit) {
+        memcpy(buffer, &list.head, sizeof(list.head));
+        list.head = buffer;
+        ++list.count;
+        buffer = NULL;
+    }
+    list.locker.unlock();
+
+    if (buffer) {
+        free(buffer);
+    } else {
+        idle_bytes_ += capacity;
+    }
+}
+
+char *BufferPool::grow(char *buffer, size_t used, size_t *capacity) {
+    size_t new_capacity = 0;
+    char *new_buffer = acquire(*capacity * 2, &new_capacity);
+    if (!new_buffer) {
+        return NULL;
+    }
+
+    memcpy(new_buffer, buffer, used);
+    release(buffer, *capacity);
+    *capacity = new_capacity;
+    return new_buffer;
+}
@@ -0,0 +1,54 @@
+#ifndef BUFFERPOOL_H
+#define BUFFERPOOL_H
+
+#include <atomic>
+#include <cstddef>
+
+#include "locker.h"
+
+// 连接缓冲区池，所有连接共享。缓冲区按大小分成若干级(1KB起，每级翻倍)，每一级一个空闲链表，
+// 连接需要缓冲区时从池中租用，空闲时归还，归还的缓冲区留给之后的连接复用。
+// 每一级空闲的缓冲区总量有上限，超出的直接释放，这样占用的内存跟着活跃的连接数走，而不是fd的范围
+class BufferPool {
+   public:
+    static const size_t MIN_BUFFER_SIZE = 1024;  // 最小一级缓冲区的大小
+    static const int CLASS_NUMBER = 11;          // 大小的级数，最大一级为1MB
+
+   public:
+    // max_buffer_size是一个缓冲区最多能扩大到的大小，idle_limit是每一级最多保留的空闲字节数
+    BufferPool(size_t max_buffer_size, size_t idle_limit = 4 * 1024 * 1024);
+    ~BufferPool();
+
+   public:
+    // 租用至少size字节的缓冲区，实际大小写入capacity。超过上限或者内存不足时返回NULL
+    char *acquire(size_t size, size_t *capacity);
+    // 归还缓冲区，capacity为租用时得到的大小
+    void release(char *buffer, size_t capacity);
+    // 把缓冲区扩大一级并复制前used字节，成功时归还原来的缓冲区。已经达到上限或者内存不足时
+    // 返回NULL，原来的缓冲区保持不变
+    char *grow(char *buffer, size_t used, size_t *capacity);
+
+    size_t maxBufferSize() const { return max_buffer_size_; }
+    size_t leasedBytes() const { return leased_bytes_.load(std::memory_order_relaxed); }  // 正在被连接使用的字节数
+    size_t idleBytes() const { return idle_bytes_.load(std::memory_order_relaxed); }      // 池中空闲的字节数
+
+   private:
+    // 一级缓冲区的空闲链表，链表指针存放在空闲缓冲区的开头
+    struct FreeList {
+        Locker locker;  // 保护head和count
+        char *head;
+        size_t count;
+        size_t limit;  // 最多保留的空闲缓冲区数
+    };
+
+    static int sizeClass(size_t size);  // 能容纳size字节的最小一级，超过最大一级时返回-1
+
+   private:
+    size_t max_buffer_size_;
+    FreeList free_lists_[CLASS_NUMBER];
+
+    std::atomic<size_t> leased_bytes_;
+    std::atomic<size_t> idle_bytes_;
+};
+
+#endif
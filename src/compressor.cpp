@@ -0,0 +1,315 @@
+#include "compressor.h"
+
+#include <brotli/encode.h>
+#include <fcntl.h>
+#include <strings.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+
+#include "log.h"
+
+// 最多排队的压缩任务数，超过时丢弃新的任务，下一次请求时再提交
+static const size_t MAX_JOBS = 256;
+
+// 小于这个大小的文件压缩后节省的字节抵不上Content-Encoding等响应头
+static const off_t MIN_FILE_SIZE = 256;
+
+// 每个缓存项除压缩内容之外占用的容量
+static const size_t ENTRY_OVERHEAD = 128;
+
+// 压缩只在后台做一次，结果被反复使用，所以用较高的压缩级别；brotli的最高级别11比9慢一个数量级，收益只有几个百分点
+static const int GZIP_LEVEL = 9;
+static const int BROTLI_QUALITY_LEVEL = 9;
+
+static size_t charge(const std::string &key, const std::string &data) { return key.size() + data.size() + ENTRY_OVERHEAD; }
+
+Compressor::Compressor(size_t capacity, size_t max_file_size)
+    : capacity_(capacity), max_file_size_(max_file_size), size_(0), stop_(false), hits_(0), misses_(0), compressions_(0) {
+    if (dynamic() && pthread_create(&thread_, NULL, worker, this) != 0) {
+        throw std::exception();
+    }
+}
+
+Compressor::~Compressor() {
+    if (dynamic()) {
+        locker_.lock();
+        stop_ = true;
+        locker_.unlock();
+        job_count_.post();
+        pthread_join(thread_, NULL);
+    }
+
+    locker_.lock();
+    while (!lru_.empty()) {
+        remove(lru_.front());
+    }
+    locker_.unlock();
+}
+
+std::string Compressor::key(const char *path, ENCODING encoding) {
+    std::string key(path);
+    key += '\0';
+    key += (char)('0' + encoding);
+    return key;
+}
+
+// 取得压缩缓存并增加引用计数。文件已经变化的缓存项直接移出缓存，由调用者重新提交压缩
+Compressor::Entry *Compressor::acquire(const char *path, ENCODING encoding, const struct stat &state) {
+    locker_.lock();
+    std::unordered_map<std::string, Entry *>::iterator iter = entries_.find(key(path, encoding));
+    if (iter != entries_.end()) {
+        Entry *entry = iter->second;
+        if (entry->mtime_ == state.st_mtime && entry->file_size_ == state.st_size && entry->inode_ == state.st_ino) {
+            lru_.splice(lru_.begin(), lru_, entry->lru_iter_);
+            if (!entry->useful_) {
+                locker_.unlock();
+                return NULL;
+            }
+            entry->ref_count_.fetch_add(1, std::memory_order_relaxed);
+            locker_.unlock();
+            hits_.fetch_add(1, std::memory_order_relaxed);
+            return entry;
+        }
+        remove(entry);
+    }
+    locker_.unlock();
+    misses_.fetch_add(1, std::memory_order_relaxed);
+    return NULL;
+}
+
+// 释放acquire得到的引用，最后一个引用释放时销毁缓存项
+void Compressor::release(Entry *entry) {
+    if (entry->ref_count_.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        delete entry;
+    }
+}
+
+// 提交压缩任务，只有压缩线程会读文件和压缩，调用者立即返回
+void Compressor::compress(const char *path, ENCODING encoding, const struct stat &state) {
+    if (!dynamic() || state.st_size < MIN_FILE_SIZE || (size_t)state.st_size > max_file_size_) {
+        return;
+    }
+
+    std::string job_key = key(path, encoding);
+    locker_.lock();
+    std::unordered_map<std::string, Entry *>::iterator iter = entries_.find(job_key);
+    bool cached = iter != entries_.end() && iter->second->mtime_ == state.st_mtime &&
+                  iter->second->file_size_ == state.st_size && iter->second->inode_ == state.st_ino;
+    if (cached || jobs_.size() >= MAX_JOBS || !pending_.insert(job_key).second) {
+        locker_.unlock();
+        return;
+    }
+    Job job;
+    job.path = path;
+    job.encoding = encoding;
+    job.state = state;
+    jobs_.push_back(job);
+    locker_.unlock();
+    job_count_.post();
+}
+
+void *Compressor::worker(void *arg) {
+    Compressor *compressor = (Compressor *)arg;
+    compressor->run();
+
+    return compressor;
+}
+
+// 压缩线程的主循环，依次处理排队的任务
+void Compressor::run() {
+    while (true) {
+        job_count_.wait();
+        locker_.lock();
+        if (stop_) {
+            locker_.unlock();
+            return;
+        }
+        Job job = jobs_.front();
+        jobs_.pop_front();
+        locker_.unlock();
+
+        Entry *entry = build(job);
+        if (entry) {
+            insert(entry);
+            compressions_.fetch_add(1, std::memory_order_relaxed);
+        }
+        locker_.lock();
+        pending_.erase(key(job.path.c_str(), job.encoding));
+        locker_.unlock();
+    }
+}
+
+// 读取文件并压缩。文件在排队期间被修改了时放弃，下一次请求会按新的版本重新提交
+Compressor::Entry *Compressor::build(const Job &job) {
+    int fd = open(job.path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return NULL;
+    }
+    struct stat state;
+    std::string input;
+    if (fstat(fd, &state) == 0 && state.st_mtime == job.state.st_mtime && state.st_size == job.state.st_size &&
+        state.st_ino == job.state.st_ino) {
+        input.resize(state.st_size);
+        size_t offset = 0;
+        while (offset < input.size()) {
+            ssize_t len = pread(fd, &input[offset], input.size() - offset, offset);
+            if (len <= 0) {
+                if (len < 0 && errno == EINTR) {
+                    continue;
+                }
+                break;
+            }
+            offset += len;
+        }
+        input.resize(offset == input.size() ? offset : 0);
+    }
+    close(fd);
+    if (input.empty()) {
+        return NULL;
+    }
+
+    std::string output;
+    bool ok = false;
+    if (job.encoding == GZIP) {
+        z_stream stream;
+        memset(&stream, 0, sizeof(stream));
+        // windowBits加16生成gzip格式而不是zlib格式
+        if (deflateInit2(&stream, GZIP_LEVEL, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) == Z_OK) {
+            output.resize(deflateBound(&stream, input.size()));
+            stream.next_in = (Bytef *)input.data();
+            stream.avail_in = input.size();
+            stream.next_out = (Bytef *)&output[0];
+            stream.avail_out = output.size();
+            ok = deflate(&stream, Z_FINISH) == Z_STREAM_END;
+            output.resize(stream.total_out);
+            deflateEnd(&stream);
+        }
+    } else if (job.encoding == BROTLI) {
+        size_t len = BrotliEncoderMaxCompressedSize(input.size());
+        output.resize(len);
+        ok = len > 0 && BrotliEncoderCompress(BROTLI_QUALITY_LEVEL, BROTLI_DEFAULT_WINDOW, BROTLI_MODE_TEXT,
+                                              input.size(), (const uint8_t *)input.data(), &len,
+                                              (uint8_t *)&output[0]) == BROTLI_TRUE;
+        output.resize(len);
+    }
+    if (!ok) {
+        LOG_WARN("failed to compress %s as %s", job.path.c_str(), name(job.encoding));
+        return NULL;
+    }
+
+    Entry *entry = new Entry;
+    entry->key_ = key(job.path.c_str(), job.encoding);
+    entry->mtime_ = state.st_mtime;
+    entry->file_size_ = state.st_size;
+    entry->inode_ = state.st_ino;
+    // 压缩后没有变小(比如内容已经是压缩过的)，只记下结果，之后直接发送原文件
+    entry->useful_ = output.size() < input.size();
+    if (entry->useful_) {
+        entry->data_.swap(output);
+    }
+    entry->ref_count_.store(1, std::memory_order_relaxed);
+    LOG_DEBUG("compressed %s as %s: %zu -> %zu bytes", job.path.c_str(), name(job.encoding), input.size(),
+              entry->data_.size());
+    return entry;
+}
+
+// 把压缩好的缓存项放进缓存，容量不足时从LRU链表尾部淘汰
+void Compressor::insert(Entry *entry) {
+    locker_.lock();
+    std::unordered_map<std::string, Entry *>::iterator iter = entries_.find(entry->key_);
+    if (iter != entries_.end()) {
+        remove(iter->second);
+    }
+
+    size_t entry_charge = charge(entry->key_, entry->data_);
+    if (entry_charge > capacity_) {
+        locker_.unlock();
+        release(entry);
+        return;
+    }
+    while (size_ + entry_charge > capacity_ && !lru_.empty()) {
+        remove(lru_.back());
+    }
+
+    entries_[entry->key_] = entry;
+    lru_.push_front(entry);
+    entry->lru_iter_ = lru_.begin();
+    size_ += entry_charge;
+    locker_.unlock();
+}
+
+// 把缓存项移出缓存并释放缓存持有的引用，正在发送它的响应仍然持有引用
+void Compressor::remove(Entry *entry) {
+    entries_.erase(entry->key_);
+    lru_.erase(entry->lru_iter_);
+    size_ -= charge(entry->key_, entry->data_);
+    release(entry);
+}
+
+size_t Compressor::size() const {
+    locker_.lock();
+    size_t size = size_;
+    locker_.unlock();
+    return size;
+}
+
+// 逗号分隔的编码列表，每一项可以带q值，q=0表示不接受。*代表没有单独列出的所有编码
+int Compressor::parseAcceptEncoding(const char *value) {
+    int accepted = 0;
+    int listed = 0;
+    bool any = false;
+    const char *p = value;
+    while (*p) {
+        while (*p == ' ' || *p == '\t' || *p == ',') {
+            ++p;
+        }
+        const char *token = p;
+        while (*p && *p != ',' && *p != ';' && *p != ' ' && *p != '\t') {
+            ++p;
+        }
+        size_t len = p - token;
+
+        // 参数中只关心q值
+        bool acceptable = true;
+        while (*p && *p != ',') {
+            if ((*p == 'q' || *p == 'Q') && p[1] == '=') {
+                acceptable = strtod(p + 2, NULL) > 0;
+            }
+            ++p;
+        }
+
+        int bit = 0;
+        if ((len == 2 && strncasecmp(token, "br", 2) == 0)) {
+            bit = 1 << BROTLI;
+        } else if ((len == 4 && strncasecmp(token, "gzip", 4) == 0) || (len == 6 && strncasecmp(token, "x-gzip", 6) == 0)) {
+            bit = 1 << GZIP;
+        } else if (len == 1 && *token == '*') {
+            any = acceptable;
+            continue;
+        }
+        listed |= bit;
+        accepted = acceptable ? accepted | bit : accepted & ~bit;
+    }
+    if (any) {
+        accepted |= ((1 << BROTLI) | (1 << GZIP)) & ~listed;
+    }
+    return accepted;
+}
+
+const char *Compressor::name(ENCODING encoding) {
+    switch (encoding) {
+        case BROTLI:
+            return "br";
+        case GZIP:
+            return "gzip";
+        default:
+            return "identity";
+    }
+}
+
+const char *Compressor::extension(ENCODING encoding) { return encoding == BROTLI ? ".br" : ".gz"; }
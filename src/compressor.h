@@ -0,0 +1,105 @@
+#ifndef COMPRESSOR_H
+#define COMPRESSOR_H
+
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include <atomic>
+#include <deque>
+#include <list>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+
+#include "locker.h"
+
+// 响应体的内容编码。客户端接受压缩时优先发送和文件放在一起的预压缩文件(index.html.br、index.html.gz)；
+// 没有时(on-the-fly模式)由后台线程压缩一次，结果按文件版本(修改时间、大小、inode)缓存，之后的请求直接发送缓存。
+// 请求所在的线程从不等待压缩：缓存未命中时提交压缩任务，这一次仍然发送原文件
+class Compressor {
+   public:
+    // 内容编码，按优先级从高到低排列
+    enum ENCODING {
+        IDENTITY = 0,  // 不压缩
+        BROTLI,        // br
+        GZIP           // gzip
+    };
+    static const int ENCODING_COUNT = 3;
+
+    // 一个压缩好的文件
+    class Entry {
+       public:
+        const char *data() const { return data_.data(); }  // 压缩后的内容
+        size_t size() const { return data_.size(); }
+
+       private:
+        friend class Compressor;
+
+        std::string key_;                        // 文件的完整路径 + 编码
+        time_t mtime_;                           // 压缩时的文件版本
+        off_t file_size_;
+        ino_t inode_;
+        bool useful_;                            // 压缩后是否比原文件小，不是的话只记下结果，不再重复压缩
+        std::string data_;
+        std::atomic<int> ref_count_;             // 引用计数，缓存本身也持有一个引用
+        std::list<Entry *>::iterator lru_iter_;  // 在LRU链表中的位置
+    };
+
+   public:
+    // capacity是压缩缓存的总容量，为0时只使用预压缩文件。大于max_file_size的文件不在运行中压缩
+    Compressor(size_t capacity, size_t max_file_size = 8 * 1024 * 1024);
+    ~Compressor();
+
+   public:
+    // 取得path以encoding压缩的缓存，state是文件当前的状态，版本不一致或者未命中时返回NULL
+    Entry *acquire(const char *path, ENCODING encoding, const struct stat &state);
+    void release(Entry *entry);  // 释放acquire得到的引用
+    // 提交后台压缩任务，同一个文件已经在排队或者队列已满时忽略
+    void compress(const char *path, ENCODING encoding, const struct stat &state);
+    bool dynamic() const { return capacity_ > 0; }  // 是否在运行中压缩
+
+    static int parseAcceptEncoding(const char *value);  // Accept-Encoding中客户端接受的编码，第i位表示ENCODING i
+    static const char *name(ENCODING encoding);         // Content-Encoding中的名字
+    static const char *extension(ENCODING encoding);    // 预压缩文件的扩展名
+
+    uint64_t hits() const { return hits_.load(std::memory_order_relaxed); }
+    uint64_t misses() const { return misses_.load(std::memory_order_relaxed); }
+    uint64_t compressions() const { return compressions_.load(std::memory_order_relaxed); }
+    size_t size() const;  // 压缩缓存占用的容量
+
+   private:
+    // 一个压缩任务
+    struct Job {
+        std::string path;
+        ENCODING encoding;
+        struct stat state;
+    };
+
+    static void *worker(void *arg);
+    void run();  // 压缩线程的主循环
+    Entry *build(const Job &job);
+    void insert(Entry *entry);
+    void remove(Entry *entry);  // 调用者需持有locker_
+    static std::string key(const char *path, ENCODING encoding);
+
+   private:
+    size_t capacity_;       // 压缩缓存的总容量
+    size_t max_file_size_;  // 在运行中压缩的文件大小上限
+    size_t size_;           // 已经占用的容量
+
+    std::unordered_map<std::string, Entry *> entries_;  // 键(路径 + 编码)到缓存项
+    std::list<Entry *> lru_;                            // 最近使用的缓存项在前面
+    std::deque<Job> jobs_;                              // 等待压缩的任务
+    std::unordered_set<std::string> pending_;           // 正在排队或者压缩的任务的键，避免重复提交
+    mutable Locker locker_;                             // 保护上面的所有成员
+    Semaphore job_count_;                               // jobs_中的任务数
+
+    pthread_t thread_;
+    bool stop_;
+
+    std::atomic<uint64_t> hits_;          // 命中次数
+    std::atomic<uint64_t> misses_;        // 未命中次数
+    std::atomic<uint64_t> compressions_;  // 完成的压缩次数
+};
+
+#endif
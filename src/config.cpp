@@ -0,0 +1,296 @@
+#include "config.h"
+
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#include <cerrno>
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include "http_connection.h"
+#include "mime_types.h"
+
+// 默认值，和没有配置系统时的硬编码值相同
+static const char *DEFAULTS[][2] = {
+    {"port", "0"},
+    {"bind", "0.0.0.0"},
+    {"doc_root", "/home/robin/webserver/resources"},
+    {"reactors", "0"},
+    {"dispatch", "rr"},
+    {"sharded", "false"},
+    {"threads", "8"},
+    {"max_threads", "0"},
+    {"queue_wait_target_ms", "10"},
+    {"overload", "pause"},
+    {"queue", "lockfree"},
+    {"queue_depth", "10000"},
+    {"affinity", ""},
+    {"cache_mb", "0"},
+    {"cache_responses", "false"},
+    {"compress", "off"},
+    {"compress_cache_mb", "16"},
+    {"max_age", "0"},
+    {"mime_types", ""},
+    {"buffer_kb", "16"},
+    {"io_budget_kb", "256"},
+    {"file_strategy", "mmap"},
+    {"idle_timeout", "60"},
+    {"header_timeout", "30"},
+    {"write_timeout", "60"},
+    {"io_backend", "epoll"},
+    {"handoff", ""},
+    {"report_interval", "0"},
+    {"log_level", "info"},
+    {"error_log", ""},
+    {"access_log", ""},
+    {"max_fd", "65536"},
+    {"max_events", "10000"},
+};
+
+// 运行中可以修改的配置项：由收到SIGHUP的线程直接替换，工作线程下一次读取时生效
+static const char *LIVE_KEYS[] = {"doc_root",  "idle_timeout", "header_timeout", "write_timeout",
+                                  "log_level", "error_log",    "access_log"};
+
+static bool parseInt(const std::string &value, int min, int max, int *out) {
+    char *end = NULL;
+    errno = 0;
+    long number = strtol(value.c_str(), &end, 10);
+    if (value.empty() || *end != '\0' || errno != 0 || number < min || number > max) {
+        return false;
+    }
+    *out = (int)number;
+    return true;
+}
+
+static bool parseBool(const std::string &value, bool *out) {
+    if (value == "true" || value == "on" || value == "yes" || value == "1") {
+        *out = true;
+    } else if (value == "false" || value == "off" || value == "no" || value == "0") {
+        *out = false;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+// value是choices中的一个时才赋给out，choices以NULL结尾
+static bool parseChoice(const std::string &value, const char *const *choices, std::string *out) {
+    for (; *choices; ++choices) {
+        if (value == *choices) {
+            *out = value;
+            return true;
+        }
+    }
+    return false;
+}
+
+// 去掉首尾的空白字符
+static std::string trim(const std::string &text) {
+    size_t begin = text.find_first_not_of(" \t\r\n");
+    if (begin == std::string::npos) {
+        return "";
+    }
+    return text.substr(begin, text.find_last_not_of(" \t\r\n") - begin + 1);
+}
+
+Config::Config() {
+    for (size_t i = 0; i < sizeof(DEFAULTS) / sizeof(DEFAULTS[0]); ++i) {
+        set(DEFAULTS[i][0], DEFAULTS[i][1], NULL);
+    }
+    set("backlog", std::to_string(SOMAXCONN), NULL);
+}
+
+bool Config::load(const char *path, std::string *error) {
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        *error = std::string(path) + ": " + strerror(errno);
+        return false;
+    }
+
+    char line[1024];
+    bool ok = true;
+    for (int number = 1; ok && fgets(line, sizeof(line), file); ++number) {
+        // 行首或者空白之后的#开始是注释，值中间的#(比如路径中的)不算
+        char *comment = line;
+        while ((comment = strchr(comment, '#')) && comment != line && comment[-1] != ' ' && comment[-1] != '\t') {
+            ++comment;
+        }
+        if (comment) {
+            *comment = '\0';
+        }
+        std::string text = trim(line);
+        if (text.empty()) {
+            continue;
+        }
+        size_t equal = text.find('=');
+        std::string message;
+        if (equal == std::string::npos) {
+            message = "expected key = value";
+        } else if (set(trim(text.substr(0, equal)), trim(text.substr(equal + 1)), &message)) {
+            continue;
+        }
+        *error = std::string(path) + ":" + std::to_string(number) + ": " + message;
+        ok = false;
+    }
+    fclose(file);
+    return ok;
+}
+
+bool Config::set(const std::string &key, const std::string &value, std::string *error) {
+    static const char *const dispatches[] = {"rr", "least", NULL};
+    static const char *const queues[] = {"lockfree", "locked", "steal", NULL};
+    static const char *const strategies[] = {"mmap", "sendfile", "splice", NULL};
+    static const char *const backends[] = {"epoll", "uring", NULL};
+    static const char *const overloads[] = {"pause", "reject", NULL};
+    static const char *const compressions[] = {"off", "static", "on", NULL};
+
+    bool ok = true;
+    if (key == "port") {
+        ok = parseInt(value, 0, 65535, &port);
+    } else if (key == "bind") {
+        struct in_addr address;
+        ok = inet_pton(AF_INET, value.c_str(), &address) == 1;
+        bind = ok ? value : bind;
+    } else if (key == "doc_root") {
+        // 请求的完整路径是doc_root + url，要给url留出空间
+        ok = !value.empty() && value.size() < HttpConnection::FILENAME_LEN / 2;
+        doc_root = ok ? value : doc_root;
+    } else if (key == "backlog") {
+        ok = parseInt(value, 1, INT_MAX, &backlog);
+    } else if (key == "reactors") {
+        ok = parseInt(value, 0, 1024, &reactors);
+    } else if (key == "dispatch") {
+        ok = parseChoice(value, dispatches, &dispatch);
+    } else if (key == "sharded") {
+        ok = parseBool(value, &sharded);
+    } else if (key == "threads") {
+        ok = parseInt(value, 1, 1024, &threads);
+    } else if (key == "max_threads") {
+        ok = parseInt(value, 0, 1024, &max_threads);
+    } else if (key == "queue_wait_target_ms") {
+        ok = parseInt(value, 1, 60 * 1000, &queue_wait_target_ms);
+    } else if (key == "overload") {
+        ok = parseChoice(value, overloads, &overload);
+    } else if (key == "queue") {
+        ok = parseChoice(value, queues, &queue);
+    } else if (key == "queue_depth") {
+        ok = parseInt(value, 1, 1 << 24, &queue_depth);
+    } else if (key == "affinity") {
+        affinity = value;
+    } else if (key == "cache_mb") {
+        ok = parseInt(value, 0, 1 << 20, &cache_mb);
+    } else if (key == "cache_responses") {
+        ok = parseBool(value, &cache_responses);
+    } else if (key == "compress") {
+        ok = parseChoice(value, compressions, &compress);
+    } else if (key == "compress_cache_mb") {
+        ok = parseInt(value, 0, 1 << 20, &compress_cache_mb);
+    } else if (key == "max_age") {
+        ok = parseInt(value, 0, INT_MAX, &max_age);
+    } else if (key == "mime_types") {
+        // 错误信息指出是哪一项
+        if (!MimeTypes::parse(value, error)) {
+            return false;
+        }
+        mime_types = value;
+    } else if (key == "buffer_kb") {
+        ok = parseInt(value, HttpConnection::READ_BUFFER_SIZE / 1024, 1024, &buffer_kb);
+    } else if (key == "io_budget_kb") {
+        ok = parseInt(value, 0, 1 << 20, &io_budget_kb);
+    } else if (key == "file_strategy") {
+        ok = parseChoice(value, strategies, &file_strategy);
+    } else if (key == "idle_timeout") {
+        ok = parseInt(value, 0, INT_MAX / 1000, &idle_timeout);
+    } else if (key == "header_timeout") {
+        ok = parseInt(value, 0, INT_MAX / 1000, &header_timeout);
+    } else if (key == "write_timeout") {
+        ok = parseInt(value, 0, INT_MAX / 1000, &write_timeout);
+    } else if (key == "timeouts") {
+        // 命令行-T的写法：空闲,请求头,写
+        size_t first = value.find(',');
+        size_t second = first == std::string::npos ? first : value.find(',', first + 1);
+        ok = second != std::string::npos;
+        if (ok) {
+            return set("idle_timeout", value.substr(0, first), error) &&
+                   set("header_timeout", value.substr(first + 1, second - first - 1), error) &&
+                   set("write_timeout", value.substr(second + 1), error);
+        }
+    } else if (key == "io_backend") {
+        ok = parseChoice(value, backends, &io_backend);
+    } else if (key == "handoff") {
+        handoff = value;
+    } else if (key == "report_interval") {
+        ok = parseInt(value, 0, INT_MAX, &report_interval);
+    } else if (key == "log_level") {
+        ok = Log::parseLevel(value.c_str(), &log_level);
+    } else if (key == "error_log") {
+        error_log = value;
+    } else if (key == "access_log") {
+        access_log = value;
+    } else if (key == "max_fd") {
+        ok = parseInt(value, 1024, 1 << 24, &max_fd);
+    } else if (key == "max_events") {
+        ok = parseInt(value, 1, 1 << 20, &max_events);
+    } else {
+        if (error) {
+            *error = "unknown option " + key;
+        }
+        return false;
+    }
+
+    if (!ok) {
+        if (error) {
+            *error = "invalid value for " + key + ": " + value;
+        }
+        return false;
+    }
+    values_[key] = value;
+    return true;
+}
+
+bool Config::validate(std::string *error) const {
+    if (port == 0) {
+        *error = "port is required";
+    } else if (sharded && reactors == 0) {
+        *error = "sharded requires reactors > 0";
+    } else if (cache_responses && cache_mb == 0) {
+        *error = "cache_responses requires cache_mb > 0";
+    } else if (compress == "on" && compress_cache_mb == 0) {
+        *error = "compress on requires compress_cache_mb > 0";
+    } else if (queue != "lockfree" && reactors > 0) {
+        *error = "queue " + queue + " requires reactors = 0";
+    } else if (max_threads > threads && queue == "steal") {
+        *error = "max_threads requires queue = lockfree or locked";
+    } else if (!affinity.empty() && queue != "steal") {
+        *error = "affinity requires queue = steal";
+    } else if (io_backend == "uring" && (reactors == 0 || file_strategy != "mmap")) {
+        *error = "io_backend uring requires reactors > 0 and file_strategy = mmap";
+    } else {
+        return true;
+    }
+    return false;
+}
+
+std::string Config::get(const std::string &key) const {
+    std::map<std::string, std::string>::const_iterator it = values_.find(key);
+    return it == values_.end() ? "" : it->second;
+}
+
+void Config::changed(const Config &other, std::vector<std::string> *keys) const {
+    for (std::map<std::string, std::string>::const_iterator it = values_.begin(); it != values_.end(); ++it) {
+        if (other.get(it->first) != it->second) {
+            keys->push_back(it->first);
+        }
+    }
+}
+
+bool Config::live(const std::string &key) {
+    for (size_t i = 0; i < sizeof(LIVE_KEYS) / sizeof(LIVE_KEYS[0]); ++i) {
+        if (key == LIVE_KEYS[i]) {
+            return true;
+        }
+    }
+    return false;
+}
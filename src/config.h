@@ -0,0 +1,65 @@
+#ifndef CONFIG_H
+#define CONFIG_H
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "log.h"
+
+// 服务器配置。每一项先取默认值，再被配置文件覆盖，最后被命令行覆盖。配置文件每行一项"key = value"，
+// 行首或者空白之后的#开始是注释。set时检查每一项的取值，validate检查配置项之间的约束(比如sharded需要reactors > 0)。
+// 收到SIGHUP时重新读取配置文件，其中live()的配置项在运行中生效，其他的要重启之后才生效
+class Config {
+   public:
+    Config();  // 所有配置项取默认值
+
+   public:
+    bool load(const char *path, std::string *error);                                 // 读取配置文件
+    bool set(const std::string &key, const std::string &value, std::string *error);  // 设置一项，值不合法时返回false
+    bool validate(std::string *error) const;                                         // 检查配置项之间的约束
+    std::string get(const std::string &key) const;                                   // 配置项的原始值
+    void changed(const Config &other, std::vector<std::string> *keys) const;  // 取值和other不同的配置项
+    static bool live(const std::string &key);                                 // 这一项能否在运行中修改
+
+   public:
+    int port;                   // 监听的端口，必须指定
+    std::string bind;           // 监听的IPv4地址
+    std::string doc_root;       // 网站的根目录
+    int backlog;                // listen的backlog
+    int reactors;               // 子reactor的数量，0为单reactor + 线程池
+    std::string dispatch;       // 新连接的分发策略：rr，least
+    bool sharded;               // 分片监听
+    int threads;                // 线程池的线程数量，线程数可以伸缩时是下限
+    int max_threads;            // 线程池的线程数上限，不大于threads时线程数固定
+    int queue_wait_target_ms;   // 估算的队列等待时间超过它时线程池增加线程
+    std::string overload;       // 请求队列满时：pause暂停读取这个连接，reject回复503
+    std::string queue;          // 线程池的请求队列：lockfree，locked，steal
+    int queue_depth;            // 请求队列的容量，工作窃取线程池中是每个线程的队列容量
+    std::string affinity;       // 工作窃取线程池的线程绑定的CPU，空表示不绑定
+    int cache_mb;               // 文件缓存的容量，0不使用缓存
+    bool cache_responses;       // 为小文件缓存完整的HTTP响应
+    std::string compress;       // 内容编码：off，static只用预压缩文件，on还在后台压缩并缓存
+    int compress_cache_mb;      // 压缩缓存的容量
+    int max_age;                // 文件响应的Cache-Control: max-age秒数，0为no-cache
+    std::string mime_types;     // 增加或者覆盖的扩展名到类型的映射："扩展名=类型,扩展名=类型"
+    int buffer_kb;              // 读缓冲最多扩大到多少KB
+    int io_budget_kb;           // 一次事件中一个连接最多读或写多少KB，0表示不限制
+    std::string file_strategy;  // 静态文件响应体的发送方式：mmap，sendfile，splice
+    int idle_timeout;           // 空闲、读请求头、写响应的超时秒数，0表示不限制
+    int header_timeout;
+    int write_timeout;
+    std::string io_backend;   // 子reactor的I/O后端：epoll，uring
+    std::string handoff;      // 热重启使用的Unix域socket，空表示不使用
+    int report_interval;      // 打印统计的间隔秒数，0不打印
+    Log::LEVEL log_level;     // 日志级别
+    std::string error_log;    // 错误日志文件，空表示标准输出
+    std::string access_log;   // 访问日志文件，空表示不记录
+    int max_fd;               // 最大的文件描述符，以fd为下标的连接数组的大小
+    int max_events;           // 一次epoll_wait最多返回的事件数
+
+   private:
+    std::map<std::string, std::string> values_;  // 每一项的原始值，用来比较两份配置
+};
+
+#endif
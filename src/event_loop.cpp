@@ -0,0 +1,262 @@
+#include "event_loop.h"
+
+#include <sys/eventfd.h>
+
+#include "log.h"
+
+extern void addfd(int epollfd, int fd, bool one_shot);
+extern void removefd(int epollfd, int fd);
+
+int EventLoop::max_fd_ = 65536;
+int EventLoop::max_events_ = 10000;
+EventLoop::OVERLOAD_POLICY EventLoop::overload_policy_ = EventLoop::PAUSE;
+
+EventLoop::EventLoop(HttpConnection *users, Executor<HttpConnection> *pool)
+    : users_(users),
+      pool_(pool),
+      epollfd_(-1),
+      wakeup_fd_(-1),
+      listenfd_(-1),
+      loops_(NULL),
+      loop_count_(0),
+      next_loop_(0),
+      dispatch_(ROUND_ROBIN),
+      connection_count_(0),
+      accept_count_(0),
+      timeout_count_(0),
+      draining_(false),
+      drain_started_(false) {
+    epollfd_ = epoll_create(5);
+    if (epollfd_ < 0) {
+        throw std::exception();
+    }
+
+    wakeup_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (wakeup_fd_ < 0) {
+        close(epollfd_);
+        throw std::exception();
+    }
+    addfd(epollfd_, wakeup_fd_, false);
+}
+
+EventLoop::~EventLoop() {
+    close(wakeup_fd_);
+    close(epollfd_);
+}
+
+// 让这个loop负责监听listenfd，接受的新连接按policy分发到loops中
+void EventLoop::addListener(int listenfd, EventLoop **loops, int loop_count, DISPATCH_POLICY policy) {
+    listenfd_ = listenfd;
+    loops_ = loops;
+    loop_count_ = loop_count;
+    dispatch_ = policy;
+    addfd(epollfd_, listenfd_, false);
+}
+
+// 其他线程向本loop投递新连接，唤醒本loop后由本loop线程注册到自己的epoll中
+void EventLoop::queueConnection(int connfd, const sockaddr_in &addr) {
+    pending_locker_.lock();
+    pending_.push_back(std::make_pair(connfd, addr));
+    pending_locker_.unlock();
+
+    uint64_t one = 1;
+    ::write(wakeup_fd_, &one, sizeof(one));
+}
+
+// 连接关闭时由HttpConnection调用，在本loop线程中执行
+void EventLoop::connectionClosed(int sockfd) { connection_count_.fetch_sub(1, std::memory_order_relaxed); }
+
+bool EventLoop::start() { return pthread_create(&thread_, NULL, worker, this) == 0; }
+
+bool EventLoop::join() { return pthread_join(thread_, NULL) == 0; }
+
+// 只用原子变量和write，在信号处理函数中调用也是安全的
+void EventLoop::drain() {
+    draining_.store(true, std::memory_order_relaxed);
+
+    uint64_t one = 1;
+    ::write(wakeup_fd_, &one, sizeof(one));
+}
+
+void *EventLoop::worker(void *arg) {
+    EventLoop *loop = (EventLoop *)arg;
+    loop->loop();
+
+    return loop;
+}
+
+void EventLoop::loop() {
+    std::vector<epoll_event> events(max_events_);
+
+    while (true) {
+        if (draining_.load(std::memory_order_relaxed)) {
+            if (!drain_started_) {
+                startDrain();
+            }
+            if (connection_count_.load(std::memory_order_relaxed) == 0) {
+                break;
+            }
+        }
+
+        // 有连接时最多等到时间轮的下一个tick，有暂缓的连接时每毫秒重试一次
+        submitDeferred();
+        int timeout = timers_.timeout(TimerWheel::now());
+        if (!deferred_.empty() && timeout != 0) {
+            timeout = 1;
+        }
+        int number = epoll_wait(epollfd_, events.data(), max_events_, timeout);
+
+        if ((number < 0) && (errno != EINTR)) {
+            LOG_ERROR("epoll failure");
+            break;
+        }
+
+        for (int i = 0; i < number; i++) {
+            int sockfd = events[i].data.fd;
+            if (sockfd == listenfd_) {
+                handleAccept();
+            } else if (sockfd == wakeup_fd_) {
+                handlePending();
+            } else if (events[i].events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+                users_[sockfd].closeConnection();
+            } else if (events[i].events & EPOLLIN) {
+                if (!users_[sockfd].read()) {
+                    users_[sockfd].closeConnection();
+                } else if (users_[sockfd].idle()) {
+                    // 没有读到数据，read已经让连接回到空闲状态
+                } else if (pool_) {
+                    submit(sockfd);
+                } else {
+                    // 没有线程池，在本loop线程中直接解析请求并生成响应
+                    users_[sockfd].process();
+                }
+            } else if (events[i].events & EPOLLOUT) {
+                if (!users_[sockfd].write()) {
+                    users_[sockfd].closeConnection();
+                }
+            }
+        }
+
+        timers_.advance(TimerWheel::now(), handleTimeout, this);
+    }
+}
+
+// 已经有暂缓的连接时新的请求排在它们后面，不插队
+void EventLoop::submit(int sockfd) {
+    users_[sockfd].queued();
+    if (deferred_.empty() && pool_->addTask(users_ + sockfd)) {
+        return;
+    }
+    Metrics::add(Metrics::OVERLOADED);
+    if (overload_policy_ == PAUSE) {
+        deferred_.push_back(sockfd);
+    } else if (!users_[sockfd].reject()) {
+        users_[sockfd].closeConnection();
+    }
+}
+
+// 暂缓的连接在处理期间没有超时，也不会收到事件(EPOLLONESHOT没有重新注册)，不会在等待时被关闭
+void EventLoop::submitDeferred() {
+    while (!deferred_.empty() && pool_->addTask(users_ + deferred_.front())) {
+        deferred_.pop_front();
+    }
+}
+
+// 时间轮中的连接超时了：空闲太久、请求头迟迟没有接收完整，或者对方长时间不接收响应
+void EventLoop::handleTimeout(TimerNode *node, void *arg) {
+    EventLoop *loop = (EventLoop *)arg;
+    loop->timeout_count_.fetch_add(1, std::memory_order_relaxed);
+    ((HttpConnection *)node->data)->closeConnection();
+}
+
+// 关闭监听socket，新的连接请求被拒绝(热重启时由接管的新进程accept)，再关闭所有空闲的连接。
+// 还有请求在处理的连接之后会在响应中带上Connection: close，发送完毕后关闭
+void EventLoop::startDrain() {
+    drain_started_ = true;
+    // 已经投递过来的新连接先注册，和其他连接一样处理
+    handlePending();
+    if (listenfd_ != -1) {
+        removefd(epollfd_, listenfd_);
+        listenfd_ = -1;
+    }
+    timers_.forEach(closeIdle, this);
+}
+
+void EventLoop::closeIdle(TimerNode *node, void *arg) {
+    ((HttpConnection *)node->data)->closeIfIdle();
+}
+
+// 循环accept直到EAGAIN，一次唤醒接受已完成握手的连接，最多ACCEPT_BATCH个：监听socket是水平触发的，
+// 连接建立得很快时剩下的等这一轮其他连接的事件处理完再接受。accept4直接得到非阻塞的fd，省去fcntl
+void EventLoop::handleAccept() {
+    for (int i = 0; i < ACCEPT_BATCH; ++i) {
+        struct sockaddr_in client_address;
+        socklen_t client_addrlength = sizeof(client_address);
+        int connfd = accept4(listenfd_, (struct sockaddr *)&client_address, &client_addrlength,
+                             SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+        if (connfd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                LOG_ERROR("accept failed, errno is: %d", errno);
+            }
+            return;
+        }
+
+        accept_count_.fetch_add(1, std::memory_order_relaxed);
+        Metrics::add(Metrics::ACCEPTS);
+        if (connfd >= max_fd_ || HttpConnection::user_count_ >= max_fd_) {
+            close(connfd);
+            continue;
+        }
+
+        EventLoop *target = nextLoop();
+        if (target == this) {
+            addConnection(connfd, client_address);
+        } else {
+            target->queueConnection(connfd, client_address);
+        }
+    }
+}
+
+// 把其他线程投递过来的新连接注册到本loop中
+void EventLoop::handlePending() {
+    uint64_t count = 0;
+    ::read(wakeup_fd_, &count, sizeof(count));
+
+    std::vector<std::pair<int, sockaddr_in> > pending;
+    pending_locker_.lock();
+    pending.swap(pending_);
+    pending_locker_.unlock();
+
+    for (size_t i = 0; i < pending.size(); ++i) {
+        addConnection(pending[i].first, pending[i].second);
+    }
+}
+
+void EventLoop::addConnection(int connfd, const sockaddr_in &addr) {
+    connection_count_.fetch_add(1, std::memory_order_relaxed);
+    users_[connfd].init(connfd, addr, this);
+    if (drain_started_) {
+        users_[connfd].closeIfIdle();
+    }
+}
+
+// 按分发策略选出接收新连接的loop
+EventLoop *EventLoop::nextLoop() {
+    if (dispatch_ == LEAST_LOADED) {
+        EventLoop *target = loops_[0];
+        for (int i = 1; i < loop_count_; ++i) {
+            if (loops_[i]->load() < target->load()) {
+                target = loops_[i];
+            }
+        }
+        return target;
+    }
+
+    EventLoop *target = loops_[next_loop_];
+    next_loop_ = (next_loop_ + 1) % loop_count_;
+    return target;
+}
@@ -0,0 +1,103 @@
+#ifndef EVENTLOOP_H
+#define EVENTLOOP_H
+
+#include <netinet/in.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+
+#include <atomic>
+#include <deque>
+#include <utility>
+#include <vector>
+
+#include "http_connection.h"
+#include "locker.h"
+#include "threadpool.h"
+#include "timer_wheel.h"
+
+// 事件循环类，one loop per thread。每个EventLoop拥有自己的epoll实例以及注册在上面的连接，
+// 连接的所有读写都只在所属的loop线程中进行
+class EventLoop {
+   public:
+    // 新连接分发给各个loop的策略
+    enum DISPATCH_POLICY {
+        ROUND_ROBIN = 0,  // 轮流分发
+        LEAST_LOADED      // 分发给当前连接数最少的loop
+    };
+
+    // 线程池的请求队列满时的处理策略
+    enum OVERLOAD_POLICY {
+        PAUSE = 0,  // 暂停读取这个连接，等队列有空位时按顺序重新提交，后续数据积压在socket中，由TCP流量控制反压客户端
+        REJECT      // 不解析请求，直接回复503，发送后关闭连接
+    };
+
+   public:
+    // pool不为空时，读完数据后把请求交给线程池处理(reactor + 线程池)；为空时在loop线程中直接处理
+    EventLoop(HttpConnection *users, Executor<HttpConnection> *pool = NULL);
+    virtual ~EventLoop();
+
+   public:
+    // 让这个loop负责监听listenfd，接受的新连接按policy分发到loops中
+    void addListener(int listenfd, EventLoop **loops, int loop_count, DISPATCH_POLICY policy);
+    void queueConnection(int connfd, const sockaddr_in &addr);  // 其他线程向本loop投递新连接
+    virtual void connectionClosed(int sockfd);                  // 连接关闭时由HttpConnection调用
+    TimerWheel *timers() { return &timers_; }                   // 本loop上的连接的定时器，只能在loop线程中使用
+    virtual void loop();                                        // 在当前线程中运行事件循环，排空后返回
+    bool start();                                               // 创建一个线程运行事件循环
+    bool join();                                                // 等待start创建的线程结束
+    // 开始排空：不再接受新连接，关闭空闲的长连接，正在处理的请求响应之后关闭连接，连接全部关闭后loop返回。
+    // 可以在任何线程以及信号处理函数中调用
+    void drain();
+    bool draining() const { return draining_.load(std::memory_order_relaxed); }
+    bool pooled() const { return pool_ != NULL; }  // 请求是否交给线程池处理
+    void submit(int sockfd);  // 把读到请求的连接交给线程池，只能在loop线程中调用
+
+    int epollfd() const { return epollfd_; }
+    int load() const { return connection_count_.load(std::memory_order_relaxed); }
+    uint64_t acceptCount() const { return accept_count_.load(std::memory_order_relaxed); }
+    uint64_t timeoutCount() const { return timeout_count_.load(std::memory_order_relaxed); }
+
+   public:
+    static int max_fd_;      // 以fd为下标的连接数组的大小，不小于它的新连接直接关闭，由main根据配置设置
+    static int max_events_;  // 一次epoll_wait最多返回的事件数
+    static const int ACCEPT_BATCH = 256;  // 一次唤醒最多accept的连接数，剩下的留给下一轮epoll_wait
+    static OVERLOAD_POLICY overload_policy_;  // 线程池过载时的处理策略
+
+   protected:
+    static void *worker(void *arg);
+    static void handleTimeout(TimerNode *node, void *arg);
+    static void closeIdle(TimerNode *node, void *arg);
+    void startDrain();
+    void handleAccept();
+    void handlePending();
+    void submitDeferred();    // 重新提交过载时暂缓的连接
+    virtual void addConnection(int connfd, const sockaddr_in &addr);
+    EventLoop *nextLoop();
+
+   protected:
+    HttpConnection *users_;             // 以fd为下标的连接数组，所有loop共享，fd不会同时属于两个loop
+    Executor<HttpConnection> *pool_;  // 处理请求的线程池，可以为空
+    int epollfd_;                       // 本loop独占的epoll实例
+    int wakeup_fd_;                     // eventfd，用于其他线程唤醒本loop
+    pthread_t thread_;
+
+    int listenfd_;              // 本loop负责监听的socket，没有则为-1
+    EventLoop **loops_;         // 新连接可分发的loop
+    int loop_count_;            // loops_的大小
+    int next_loop_;             // 轮询分发时下一个loop的下标
+    DISPATCH_POLICY dispatch_;  // 分发策略
+    std::deque<int> deferred_;  // 过载时暂缓提交给线程池的连接，按到达的顺序
+
+    Locker pending_locker_;                              // 保护pending_
+    std::vector<std::pair<int, sockaddr_in> > pending_;  // 其他线程投递过来、还未注册的新连接
+    std::atomic<int> connection_count_;                  // 本loop上的连接数
+    std::atomic<uint64_t> accept_count_;                 // 本loop的listenfd上累计accept的连接数
+
+    TimerWheel timers_;                    // 本loop上所有连接的空闲、读请求头和写响应超时
+    std::atomic<uint64_t> timeout_count_;  // 因为超时关闭的连接数
+
+    std::atomic<bool> draining_;  // 是否要求排空
+    bool drain_started_;          // loop线程是否已经开始排空
+};
+
+#endif
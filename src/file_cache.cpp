@@ -0,0 +1,362 @@
+#include "file_cache.h"
+
+#include <fcntl.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <vector>
+
+#include "log.h"
+
+// 每个缓存项至少占用的容量，只缓存了文件描述符的大文件按这个大小计算，从而限制打开的文件数
+static const size_t ENTRY_MIN_CHARGE = 4096;
+
+// 为完整响应中的响应头预留的容量
+static const size_t RESPONSE_HEADER_CHARGE = 256;
+
+// 缓存的文件被修改、改变属性(包括链接数，被删除或被rename覆盖时会触发)、删除或移动时失效
+static const uint32_t WATCH_EVENTS = IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_DELETE_SELF | IN_MOVE_SELF;
+
+// 预先生成的完整HTTP响应，还没有生成时返回NULL
+const char *FileCache::Entry::response(bool keep_alive, size_t *len) const {
+    char *buffer = responses_[keep_alive].load(std::memory_order_acquire);
+    if (!buffer) {
+        return NULL;
+    }
+    memcpy(len, buffer, sizeof(size_t));
+    return buffer + sizeof(size_t);
+}
+
+// 安装由header和文件内容拼成的完整响应，只对内容缓存在内存中的文件有效
+const char *FileCache::Entry::setResponse(bool keep_alive, const char *header, size_t header_len, size_t *len) {
+    size_t file_size = state_.st_size;
+    size_t response_len = header_len + file_size;
+    char *buffer = (char *)malloc(sizeof(size_t) + response_len);
+    if (!buffer) {
+        return NULL;
+    }
+    memcpy(buffer, &response_len, sizeof(size_t));
+    memcpy(buffer + sizeof(size_t), header, header_len);
+    memcpy(buffer + sizeof(size_t) + header_len, data_, file_size);
+
+    char *expected = NULL;
+    if (!responses_[keep_alive].compare_exchange_strong(expected, buffer, std::memory_order_acq_rel)) {
+        // 其他线程已经安装了，使用它的
+        free(buffer);
+    }
+    return response(keep_alive, len);
+}
+
+FileCache::FileCache(size_t capacity, size_t small_file_limit, bool cache_responses)
+    : capacity_(capacity),
+      small_file_limit_(small_file_limit),
+      cache_responses_(cache_responses),
+      size_(0),
+      inotify_fd_(-1),
+      hits_(0),
+      misses_(0),
+      evictions_(0),
+      invalidations_(0) {
+    inotify_fd_ = inotify_init1(IN_CLOEXEC);
+    if (inotify_fd_ < 0) {
+        throw std::exception();
+    }
+
+    if (pthread_create(&thread_, NULL, worker, this) != 0) {
+        close(inotify_fd_);
+        throw std::exception();
+    }
+}
+
+FileCache::~FileCache() {
+    pthread_cancel(thread_);
+    pthread_join(thread_, NULL);
+
+    locker_.lock();
+    while (!lru_.empty()) {
+        remove(lru_.front());
+    }
+    locker_.unlock();
+    close(inotify_fd_);
+}
+
+// 取得path对应的缓存项并增加引用计数，未命中时加载
+FileCache::Entry *FileCache::acquire(const char *path, bool map) {
+    locker_.lock();
+    std::unordered_map<std::string, Entry *>::iterator iter = entries_.find(path);
+    if (iter != entries_.end()) {
+        Entry *entry = iter->second;
+        // 命中，移到LRU链表头部
+        lru_.splice(lru_.begin(), lru_, entry->lru_iter_);
+        entry->ref_count_.fetch_add(1, std::memory_order_relaxed);
+        // 之前以不映射的方式缓存的大文件，现在需要映射
+        if (map && !entry->data_) {
+            locker_.unlock();
+            release(entry);
+        } else {
+            locker_.unlock();
+            hits_.fetch_add(1, std::memory_order_relaxed);
+            return entry;
+        }
+    } else {
+        locker_.unlock();
+    }
+
+    misses_.fetch_add(1, std::memory_order_relaxed);
+    Entry *entry = load(path, map);
+    if (!entry) {
+        return NULL;
+    }
+    if (!insert(entry)) {
+        // 加载期间文件发生了变化，这次不使用缓存
+        release(entry);
+        return NULL;
+    }
+
+    // watch之前的修改不会产生事件，放进缓存之后再和文件当前的状态比较一次
+    struct stat state;
+    const struct stat &loaded = entry->state_;
+    if (stat(path, &state) < 0 || state.st_ino != loaded.st_ino || state.st_dev != loaded.st_dev ||
+        state.st_size != loaded.st_size || state.st_mtim.tv_sec != loaded.st_mtim.tv_sec ||
+        state.st_mtim.tv_nsec != loaded.st_mtim.tv_nsec) {
+        locker_.lock();
+        if (entry->cached_) {
+            invalidations_.fetch_add(1, std::memory_order_relaxed);
+            remove(entry);
+        }
+        locker_.unlock();
+        release(entry);
+        return NULL;
+    }
+    return entry;
+}
+
+// 释放acquire得到的引用，最后一个引用释放时销毁缓存项
+void FileCache::release(Entry *entry) {
+    if (entry->ref_count_.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        destroy(entry);
+    }
+}
+
+void *FileCache::worker(void *arg) {
+    FileCache *cache = (FileCache *)arg;
+    cache->watch();
+
+    return cache;
+}
+
+// inotify线程的主循环，文件发生变化时让对应的缓存项失效
+void FileCache::watch() {
+    char buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    while (true) {
+        ssize_t len = read(inotify_fd_, buffer, sizeof(buffer));
+        if (len <= 0) {
+            if (len < 0 && errno == EINTR) {
+                continue;
+            }
+            LOG_ERROR("inotify failure");
+            return;
+        }
+
+        // 持有锁期间不响应取消，避免线程带着锁退出
+        int cancel_state = 0;
+        pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &cancel_state);
+        locker_.lock();
+        std::vector<Entry *> changed;
+        for (char *ptr = buffer; ptr < buffer + len;) {
+            const struct inotify_event *event = (const struct inotify_event *)ptr;
+            ptr += sizeof(struct inotify_event) + event->len;
+
+            if (!(event->mask & WATCH_EVENTS)) {
+                continue;
+            }
+            // remove会修改watches_，先取出这个watch上的所有缓存项
+            changed.clear();
+            std::pair<std::unordered_multimap<int, Entry *>::iterator, std::unordered_multimap<int, Entry *>::iterator>
+                range = watches_.equal_range(event->wd);
+            for (std::unordered_multimap<int, Entry *>::iterator iter = range.first; iter != range.second; ++iter) {
+                changed.push_back(iter->second);
+            }
+            for (size_t i = 0; i < changed.size(); ++i) {
+                if (changed[i]->cached_) {
+                    invalidations_.fetch_add(1, std::memory_order_relaxed);
+                    remove(changed[i]);
+                } else {
+                    // 还在加载，或者太大没有放进缓存
+                    changed[i]->stale_ = true;
+                }
+            }
+        }
+        locker_.unlock();
+        pthread_setcancelstate(cancel_state, NULL);
+    }
+}
+
+// 加载文件，返回的缓存项已经带有调用者的引用
+FileCache::Entry *FileCache::load(const char *path, bool map) {
+    Entry *entry = new Entry;
+    entry->path_ = path;
+    entry->type_ = MimeTypes::lookup(path);
+    entry->fd_ = -1;
+    entry->data_ = NULL;
+    entry->mapped_ = false;
+    entry->watch_ = -1;
+    entry->cached_ = false;
+    entry->stale_ = false;
+    for (int i = 0; i < Entry::MAX_VARIANTS; ++i) {
+        entry->missing_until_[i].store(0, std::memory_order_relaxed);
+    }
+    entry->responses_[0].store(NULL, std::memory_order_relaxed);
+    entry->responses_[1].store(NULL, std::memory_order_relaxed);
+    // 一个引用属于缓存本身，一个属于调用者
+    entry->ref_count_.store(2, std::memory_order_relaxed);
+
+    // 先注册watch再读取文件，读取过程中发生的修改会把缓存项标记为过期。watch和watches_中的登记在同一次加锁中
+    // 完成：同一个inode的watch描述符是共享的，remove不会删除刚刚被这里取得的watch
+    locker_.lock();
+    entry->watch_ = inotify_add_watch(inotify_fd_, path, WATCH_EVENTS);
+    if (entry->watch_ >= 0) {
+        watches_.insert(std::make_pair(entry->watch_, entry));
+    }
+    locker_.unlock();
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (entry->watch_ < 0 || fd < 0 || fstat(fd, &entry->state_) < 0 || !S_ISREG(entry->state_.st_mode) ||
+        !(entry->state_.st_mode & S_IROTH)) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        destroy(entry);
+        return NULL;
+    }
+
+    size_t file_size = entry->state_.st_size;
+    if (file_size <= small_file_limit_) {
+        // 小文件直接把内容读进内存，不再占用文件描述符
+        entry->data_ = (char *)malloc(file_size + 1);
+        size_t offset = 0;
+        while (entry->data_ && offset < file_size) {
+            ssize_t len = pread(fd, entry->data_ + offset, file_size - offset, offset);
+            if (len <= 0) {
+                if (len < 0 && errno == EINTR) {
+                    continue;
+                }
+                break;
+            }
+            offset += len;
+        }
+        close(fd);
+        if (!entry->data_ || offset != file_size) {
+            destroy(entry);
+            return NULL;
+        }
+    } else {
+        entry->fd_ = fd;
+        if (map) {
+            void *address = mmap(0, file_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (address == MAP_FAILED) {
+                destroy(entry);
+                return NULL;
+            }
+            entry->data_ = (char *)address;
+            entry->mapped_ = true;
+        }
+    }
+
+    entry->charge_ = entry->data_ ? file_size : 0;
+    if (cache_responses_ && !entry->mapped_) {
+        // 两种完整响应各自包含一份文件内容
+        entry->charge_ += 2 * (file_size + RESPONSE_HEADER_CHARGE);
+    }
+    if (entry->charge_ < ENTRY_MIN_CHARGE) {
+        entry->charge_ = ENTRY_MIN_CHARGE;
+    }
+    return entry;
+}
+
+// 把新加载的缓存项放进缓存，容量不足时从LRU链表尾部淘汰。加载期间文件发生了变化时返回false
+bool FileCache::insert(Entry *entry) {
+    locker_.lock();
+    if (entry->stale_) {
+        locker_.unlock();
+        return false;
+    }
+    std::unordered_map<std::string, Entry *>::iterator iter = entries_.find(entry->path_);
+    if (iter != entries_.end()) {
+        // 其他线程同时加载了同一个文件，用新的替换旧的
+        remove(iter->second);
+    }
+
+    if (entry->charge_ > capacity_) {
+        // 比整个缓存还大，只给调用者使用，不放进缓存
+        locker_.unlock();
+        entry->ref_count_.fetch_sub(1, std::memory_order_relaxed);
+        return true;
+    }
+
+    while (size_ + entry->charge_ > capacity_ && !lru_.empty()) {
+        evictions_.fetch_add(1, std::memory_order_relaxed);
+        remove(lru_.back());
+    }
+
+    entries_[entry->path_] = entry;
+    lru_.push_front(entry);
+    entry->lru_iter_ = lru_.begin();
+    entry->cached_ = true;
+    size_ += entry->charge_;
+    locker_.unlock();
+    return true;
+}
+
+// 把缓存项移出缓存并释放缓存持有的引用，调用者需持有locker_
+void FileCache::remove(Entry *entry) {
+    entries_.erase(entry->path_);
+    lru_.erase(entry->lru_iter_);
+    entry->cached_ = false;
+    size_ -= entry->charge_;
+    unwatch(entry);
+
+    release(entry);
+}
+
+// 取消缓存项在watches_中的登记，这个watch上没有其他缓存项(包括正在加载的)时删除watch，调用者需持有locker_
+void FileCache::unwatch(Entry *entry) {
+    std::pair<std::unordered_multimap<int, Entry *>::iterator, std::unordered_multimap<int, Entry *>::iterator>
+        range = watches_.equal_range(entry->watch_);
+    for (std::unordered_multimap<int, Entry *>::iterator iter = range.first; iter != range.second; ++iter) {
+        if (iter->second == entry) {
+            watches_.erase(iter);
+            break;
+        }
+    }
+    if (watches_.find(entry->watch_) == watches_.end()) {
+        inotify_rm_watch(inotify_fd_, entry->watch_);
+    }
+    entry->watch_ = -1;
+}
+
+// 销毁缓存项，只在引用计数归零或者加载失败时调用
+void FileCache::destroy(Entry *entry) {
+    if (entry->mapped_) {
+        munmap(entry->data_, entry->state_.st_size);
+    } else {
+        free(entry->data_);
+    }
+    if (entry->fd_ != -1) {
+        close(entry->fd_);
+    }
+    free(entry->responses_[0].load(std::memory_order_relaxed));
+    free(entry->responses_[1].load(std::memory_order_relaxed));
+    if (entry->watch_ != -1) {
+        // 没有放进缓存的缓存项(加载失败、过期或者太大)
+        locker_.lock();
+        unwatch(entry);
+        locker_.unlock();
+    }
+    delete entry;
+}
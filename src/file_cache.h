@@ -0,0 +1,115 @@
+#ifndef FILECACHE_H
+#define FILECACHE_H
+
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include <atomic>
+#include <list>
+#include <string>
+#include <unordered_map>
+
+#include "locker.h"
+#include "mime_types.h"
+
+// 静态文件缓存，所有连接共享。以文件的完整路径为键，小文件直接缓存内容，大文件缓存打开的文件描述符
+// (mmap策略下还缓存映射)，避免每个请求都stat、open、mmap、munmap。缓存项带引用计数，
+// 正在发送的响应持有引用，淘汰或失效的缓存项在最后一个引用释放时才真正销毁。
+// 后台线程通过inotify监听被缓存的文件，文件被修改、删除或替换时立即让对应的缓存项失效。
+class FileCache {
+   public:
+    // 一个被缓存的文件
+    class Entry {
+       public:
+        static const int MAX_VARIANTS = 4;  // 变体编号的上限
+
+        const struct stat &state() const { return state_; }  // 缓存时的文件状态
+        const char *data() const { return data_; }           // 文件内容，没有缓存内容时为NULL
+        int fd() const { return fd_; }                        // 打开的文件，小文件为-1
+        const MimeTypes::Type *type() const { return type_; }  // 按扩展名确定的类型，加载时查找一次
+
+        // 预先生成的完整HTTP响应(响应头 + 文件内容)，keep_alive区分Connection头的两种取值，
+        // 还没有生成时返回NULL
+        const char *response(bool keep_alive, size_t *len) const;
+        // 安装由header和文件内容拼成的完整响应，多个线程同时安装时只保留一个，返回最终生效的响应
+        const char *setResponse(bool keep_alive, const char *header, size_t header_len, size_t *len);
+
+        // 由调用者编号的变体(比如预压缩文件)不存在的记录，属于这个版本的文件，文件变化时随缓存项一起失效。
+        // 变体可能在之后才出现，记录到until(毫秒)为止
+        bool variantMissing(int variant, uint64_t now) const {
+            return missing_until_[variant].load(std::memory_order_relaxed) > now;
+        }
+        void setVariantMissing(int variant, uint64_t until) {
+            missing_until_[variant].store(until, std::memory_order_relaxed);
+        }
+
+       private:
+        friend class FileCache;
+
+        std::string path_;                       // 文件的完整路径
+        struct stat state_;                      // 文件状态
+        const MimeTypes::Type *type_;            // 文件的类型
+        int fd_;                                 // 打开的文件描述符，小文件读入内存后就关闭了
+        char *data_;                             // 小文件的内容或者大文件的映射
+        bool mapped_;                            // data_是否为mmap得到的映射
+        size_t charge_;                          // 占用的缓存容量
+        int watch_;                              // inotify的watch描述符
+        bool cached_;                            // 是否在缓存中(entries_和lru_)，由locker_保护
+        bool stale_;                             // 加载期间文件发生了变化，不能放进缓存，由locker_保护
+        std::atomic<int> ref_count_;             // 引用计数，缓存本身也持有一个引用
+        std::atomic<char *> responses_[2];       // 完整响应，下标为是否keep-alive，开头存放响应的长度
+        std::atomic<uint64_t> missing_until_[MAX_VARIANTS];  // 各变体不存在的记录的有效期
+        std::list<Entry *>::iterator lru_iter_;  // 在LRU链表中的位置
+    };
+
+   public:
+    // capacity是缓存的总容量，不超过small_file_limit字节的文件把内容读进内存。
+    // cache_responses为true时，小文件还会缓存完整的HTTP响应，一次write就能发送
+    FileCache(size_t capacity, size_t small_file_limit = 64 * 1024, bool cache_responses = false);
+    ~FileCache();
+
+   public:
+    // 取得path对应的缓存项并增加引用计数，未命中时加载。map为true时大文件也建立共享的映射。
+    // 文件不存在、不是其他用户可读的普通文件或者加载失败时返回NULL，由调用者走不缓存的路径
+    Entry *acquire(const char *path, bool map);
+    void release(Entry *entry);  // 释放acquire得到的引用
+
+    bool cacheResponses() const { return cache_responses_; }
+
+    uint64_t hits() const { return hits_.load(std::memory_order_relaxed); }
+    uint64_t misses() const { return misses_.load(std::memory_order_relaxed); }
+    uint64_t evictions() const { return evictions_.load(std::memory_order_relaxed); }
+    uint64_t invalidations() const { return invalidations_.load(std::memory_order_relaxed); }
+
+   private:
+    static void *worker(void *arg);
+    void watch();  // inotify线程的主循环
+    Entry *load(const char *path, bool map);
+    bool insert(Entry *entry);
+    void remove(Entry *entry);   // 调用者需持有locker_
+    void unwatch(Entry *entry);  // 调用者需持有locker_
+    void destroy(Entry *entry);
+
+   private:
+    size_t capacity_;          // 缓存的总容量
+    size_t small_file_limit_;  // 内容直接缓存在内存中的文件大小上限
+    bool cache_responses_;     // 是否为小文件缓存完整的HTTP响应
+    size_t size_;              // 已经占用的容量
+
+    std::unordered_map<std::string, Entry *> entries_;  // 路径到缓存项
+    // inotify的watch描述符到缓存项，包括正在加载的。同一个inode(包括硬链接)的缓存项共享watch，
+    // 最后一个缓存项移除时才删除watch
+    std::unordered_multimap<int, Entry *> watches_;
+    std::list<Entry *> lru_;                            // 最近使用的缓存项在前面
+    Locker locker_;                                     // 保护上面的所有成员
+
+    int inotify_fd_;
+    pthread_t thread_;
+
+    std::atomic<uint64_t> hits_;           // 命中次数
+    std::atomic<uint64_t> misses_;         // 未命中次数
+    std::atomic<uint64_t> evictions_;      // 因为容量不足被淘汰的缓存项数
+    std::atomic<uint64_t> invalidations_;  // 因为文件变化而失效的缓存项数
+};
+
+#endif
@@ -0,0 +1,104 @@
+#ifndef HEADERWRITER_H
+#define HEADERWRITER_H
+
+#include <cstdint>
+#include <cstring>
+
+// 编译期确定长度的响应头片段，由字符串字面量构造，不需要在运行时strlen或者格式化
+struct HeaderFragment {
+    const char *data;
+    size_t len;
+
+    template <size_t N>
+    constexpr HeaderFragment(const char (&literal)[N]) : data(literal), len(N - 1) {}
+    // 运行时生成、生命期足够长的片段，比如配置中的Content-Type
+    constexpr HeaderFragment(const char *text, size_t length) : data(text), len(length) {}
+};
+
+// 常用的状态行和响应头
+constexpr HeaderFragment STATUS_200("HTTP/1.1 200 OK\r\n");
+constexpr HeaderFragment STATUS_206("HTTP/1.1 206 Partial Content\r\n");
+constexpr HeaderFragment STATUS_304("HTTP/1.1 304 Not Modified\r\n");
+constexpr HeaderFragment STATUS_400("HTTP/1.1 400 Bad Request\r\n");
+constexpr HeaderFragment STATUS_403("HTTP/1.1 403 Forbidden\r\n");
+constexpr HeaderFragment STATUS_404("HTTP/1.1 404 Not Found\r\n");
+constexpr HeaderFragment STATUS_416("HTTP/1.1 416 Range Not Satisfiable\r\n");
+constexpr HeaderFragment STATUS_500("HTTP/1.1 500 Internal Error\r\n");
+constexpr HeaderFragment STATUS_503("HTTP/1.1 503 Service Unavailable\r\n");
+constexpr HeaderFragment HTTP_VERSION("HTTP/1.1 ");
+constexpr HeaderFragment CONTENT_LENGTH("Content-Length: ");
+constexpr HeaderFragment CONTENT_TYPE_HTML("Content-Type:text/html\r\n");
+constexpr HeaderFragment CONTENT_TYPE_MULTIPART("Content-Type: multipart/byteranges; boundary=");
+constexpr HeaderFragment CONTENT_TYPE_METRICS("Content-Type:text/plain; version=0.0.4\r\n");
+constexpr HeaderFragment CONNECTION_KEEP_ALIVE("Connection: keep-alive\r\n");
+constexpr HeaderFragment CONNECTION_CLOSE("Connection: close\r\n");
+constexpr HeaderFragment CONTENT_RANGE("Content-Range: bytes ");
+constexpr HeaderFragment ACCEPT_RANGES("Accept-Ranges: bytes\r\n");
+constexpr HeaderFragment LAST_MODIFIED("Last-Modified: ");
+constexpr HeaderFragment ETAG("ETag: ");
+constexpr HeaderFragment CACHE_CONTROL_MAX_AGE("Cache-Control: max-age=");
+constexpr HeaderFragment CACHE_CONTROL_NO_CACHE("Cache-Control: no-cache\r\n");
+constexpr HeaderFragment CONTENT_ENCODING_BR("Content-Encoding: br\r\n");
+constexpr HeaderFragment CONTENT_ENCODING_GZIP("Content-Encoding: gzip\r\n");
+constexpr HeaderFragment VARY_ACCEPT_ENCODING("Vary: Accept-Encoding\r\n");
+constexpr HeaderFragment RETRY_AFTER("Retry-After: 1\r\n");
+constexpr HeaderFragment CRLF("\r\n");
+
+// 响应头写入器，用memcpy把片段追加到缓冲区buffer的*index处，并推进*index。
+// 剩余空间不够时不写入任何内容并返回false，缓冲区中已有的内容保持完整
+class HeaderWriter {
+   public:
+    HeaderWriter(char *buffer, int size, int *index) : buffer_(buffer), size_(size), index_(index) {}
+
+    bool append(const HeaderFragment &fragment) { return append(fragment.data, fragment.len); }
+
+    bool append(const char *data, size_t len) {
+        if (len > (size_t)(size_ - *index_)) {
+            return false;
+        }
+        memcpy(buffer_ + *index_, data, len);
+        *index_ += len;
+        return true;
+    }
+
+    // 追加十进制整数，每次查表转换两位数字
+    bool appendNumber(uint64_t value) {
+        char digits[20];
+        int len = formatNumber(value, digits);
+        return append(digits, len);
+    }
+
+    // 把value转换成十进制写入out，返回位数，out至少要有20字节
+    static int formatNumber(uint64_t value, char *out) {
+        static const char DIGIT_PAIRS[] =
+            "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+            "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+            "8081828384858687888990919293949596979899";
+
+        char temp[20];
+        int pos = 20;
+        while (value >= 100) {
+            int pair = (value % 100) * 2;
+            value /= 100;
+            temp[--pos] = DIGIT_PAIRS[pair + 1];
+            temp[--pos] = DIGIT_PAIRS[pair];
+        }
+        if (value >= 10) {
+            int pair = value * 2;
+            temp[--pos] = DIGIT_PAIRS[pair + 1];
+            temp[--pos] = DIGIT_PAIRS[pair];
+        } else {
+            temp[--pos] = '0' + value;
+        }
+
+        memcpy(out, temp + pos, 20 - pos);
+        return 20 - pos;
+    }
+
+   private:
+    char *buffer_;  // 缓冲区
+    int size_;      // 缓冲区的大小
+    int *index_;    // 缓冲区中已经写入的字节数
+};
+
+#endif
@@ -1,18 +1,24 @@
 #include "http_connection.h"
 
+#include "event_loop.h"
+#include "log.h"
+
 // 定义HTTP响应的一些状态信息
 const char *ok_200_title = "OK";
+const char *partial_206_title = "Partial Content";
+const char *not_modified_304_title = "Not Modified";
 const char *error_400_title = "Bad Request";
 const char *error_400_form = "Your request has bad syntax or is inherently impossible to satisfy.\n";
 const char *error_403_title = "Forbidden";
 const char *error_403_form = "You do not have permission to get file from this server.\n";
 const char *error_404_title = "Not Found";
 const char *error_404_form = "The requested file was not found on this server.\n";
+const char *error_416_title = "Range Not Satisfiable";
+const char *error_416_form = "The requested range is not satisfiable.\n";
 const char *error_500_title = "Internal Error";
 const char *error_500_form = "There was an unusual problem serving the requested file.\n";
-
-// 网站的根目录
-const char *doc_root = "/home/robin/webserver/resources";
+const char *error_503_title = "Service Unavailable";
+const char *error_503_form = "The server is overloaded, please try again later.\n";
 
 int setnonblocking(int fd) {
     int old_option = fcntl(fd, F_GETFL);
@@ -22,18 +28,18 @@ int setnonblocking(int fd) {
     return old_option;
 }
 
-// 向epoll中添加需要监听的文件描述符
+// 向epoll中添加需要监听的文件描述符，fd需要已经是非阻塞的(accept4/socket时指定SOCK_NONBLOCK)。
+// 连接的socket(one_shot)从注册起就是边沿触发 + EPOLLONESHOT，和modifyfd一致：一次事件只交给一个线程处理，
+// 处理完用modifyfd重新注册时内核会重新检查就绪状态，所以读写可以在EAGAIN之前停下，剩下的数据不会丢掉事件。
+// 监听socket和eventfd是水平触发的，一次唤醒没有处理完的下一轮epoll_wait还会返回
 void addfd(int epollfd, int fd, bool one_shot) {
     epoll_event event;
     event.data.fd = fd;
     event.events = EPOLLIN | EPOLLRDHUP;
     if (one_shot) {
-        // 防止同一个通信被不同的线程处理
-        event.events |= EPOLLONESHOT;
+        event.events |= EPOLLET | EPOLLONESHOT;
     }
     epoll_ctl(epollfd, EPOLL_CTL_ADD, fd, &event);
-    // 设置文件描述符非阻塞
-    setnonblocking(fd);
 }
 
 // 从epoll中移除监听的文件描述符
@@ -51,80 +57,337 @@ void modifyfd(int epollfd, int fd, int ev) {
 }
 
 // 所有的客户数
-int HttpConnection::user_count_ = 0;
-// 所有socket上的事件都被注册到同一个epoll内核事件中，所以设置成静态的
-int HttpConnection::epollfd_ = -1;
+std::atomic<int> HttpConnection::user_count_(0);
+// 静态文件响应体的发送策略
+HttpConnection::FILE_STRATEGY HttpConnection::file_strategy_ = HttpConnection::MMAP;
+// 静态文件缓存，为空表示不使用缓存
+FileCache *HttpConnection::file_cache_ = NULL;
+// 响应体的压缩，为空表示不压缩
+Compressor *HttpConnection::compressor_ = NULL;
+// 读写缓冲区池，由main创建
+BufferPool *HttpConnection::buffer_pool_ = NULL;
+
+ObjectPool<HttpConnection::Exchange> *HttpConnection::exchange_pool_ = NULL;
+// 读写的I/O后端，由main根据命令行和内核是否支持io_uring选定
+HttpConnection::IO_BACKEND HttpConnection::io_backend_ = HttpConnection::EPOLL;
+// 文件响应的Cache-Control: max-age，由main根据配置设置
+int HttpConnection::max_age_ = 0;
+
+size_t HttpConnection::io_budget_ = 256 * 1024;
+// 空闲、读请求头和写响应的超时，由main根据配置设置
+std::atomic<int> HttpConnection::idle_timeout_(60 * 1000);
+std::atomic<int> HttpConnection::header_timeout_(30 * 1000);
+std::atomic<int> HttpConnection::write_timeout_(60 * 1000);
+// 网站的根目录，由main根据配置设置
+std::atomic<const char *> HttpConnection::doc_root_("/home/robin/webserver/resources");
+
+// 工作线程可能还在使用原来的字符串，所以不释放它。只有重新加载配置时才会调用，泄漏的内存可以忽略
+void HttpConnection::setDocRoot(const char *doc_root) { doc_root_.store(strdup(doc_root), std::memory_order_release); }
+
+// 超时为0时不限制
+static uint64_t deadlineAfter(const std::atomic<int> &timeout_ms) {
+    int timeout = timeout_ms.load(std::memory_order_relaxed);
+    return timeout > 0 ? TimerWheel::now() + timeout : TimerNode::NO_DEADLINE;
+}
 
-// 初始化连接,外部调用初始化套接字地址
-void HttpConnection::init(int sockfd, const sockaddr_in &addr) {
+// 初始化连接,外部调用初始化套接字地址，epoll后端下连接注册到loop的epoll中，io_uring后端由loop提交recv
+void HttpConnection::init(int sockfd, const sockaddr_in &addr, EventLoop *loop) {
     sockfd_ = sockfd;
     address_ = addr;
+    loop_ = loop;
+    epollfd_ = loop->epollfd();
+    worker_ = -1;
 
     // 端口复用
     int reuse = 1;
     setsockopt(sockfd_, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
-    addfd(epollfd_, sockfd, true);
+    if (io_backend_ == EPOLL) {
+        addfd(epollfd_, sockfd, true);
+    }
+    io_wait_ = WAIT_READ;
     user_count_++;
-    init();
+    Metrics::add(Metrics::CONNECTIONS_OPENED);
+
+    // 新连接必须在请求头超时之内发来第一个请求
+    request_deadline_ = deadlineAfter(header_timeout_);
+    idle_ = true;
+    fresh_ = true;
+    timer_.data = this;
+    timer_.deadline.store(request_deadline_, std::memory_order_relaxed);
+    loop_->timers()->add(&timer_);
 }
 
+HttpConnection::Exchange::Exchange()
+    : read_buffer(NULL),
+      read_capacity(0),
+      write_buffer(NULL),
+      file_address(0),
+      body_count(0),
+      cache_entry(NULL),
+      compressed(NULL),
+      file_fd(-1),
+      pipe_bytes(0),
+      range_count(0),
+      streaming(false),
+      stream_address(NULL),
+      multipart(NULL),
+      stream_part(0),
+      stream_remaining(0),
+      window_address(NULL),
+      window_size(0) {
+    pipe_fd[0] = pipe_fd[1] = -1;
+}
+
+HttpConnection::Exchange::~Exchange() {
+    if (pipe_fd[0] != -1) {
+        close(pipe_fd[0]);
+        close(pipe_fd[1]);
+    }
+}
+
+// 租用的Exchange可能是别的连接用过的，只有缓冲区和响应体的资源在归还时已经释放，其余状态在这里重置
 void HttpConnection::init() {
-    bytes_to_send_ = 0;
-    bytes_have_send_ = 0;
+    ex_->read_index = 0;
+    initRequest();
+    initResponses();
+}
 
-    check_state_ = CHECK_STATE_REQUESTLINE;  // 初始状态为检查请求行
-    is_link_ = false;                        // 默认不保持链接  Connection : keep-alive保持连接
+// 重置请求的解析状态，读缓冲中可能还有后面的流水线请求，不能清空
+void HttpConnection::initRequest() {
+    ex_->check_state = CHECK_STATE_REQUESTLINE;  // 初始状态为检查请求行
+    ex_->is_link = true;                         // HTTP/1.1默认保持链接  Connection: close关闭连接
 
-    method_ = GET;  // 默认请求方式为GET
-    url_ = 0;
-    version_ = 0;
-    content_length_ = 0;
-    host_ = 0;
-    start_line_ = 0;
-    checked_index_ = 0;
-    read_index_ = 0;
-    write_index_ = 0;
+    ex_->method = GET;  // 默认请求方式为GET
+    ex_->url = 0;
+    ex_->version = 0;
+    ex_->content_length = 0;
+    ex_->host = 0;
+    ex_->range = NULL;
+    ex_->if_range = NULL;
+    ex_->if_none_match = NULL;
+    ex_->if_modified_since = NULL;
+    ex_->accept_encoding = 0;
+    ex_->checked_index = 0;
+    ex_->parser.reset();
+}
 
-    bzero(read_buffer_, READ_BUFFER_SIZE);
-    bzero(write_buffer_, READ_BUFFER_SIZE);
-    bzero(real_file_, FILENAME_LEN);
+void HttpConnection::initResponses() {
+    ex_->bytes_to_send = 0;
+    ex_->bytes_have_send = 0;
+    ex_->write_index = 0;
+    ex_->io_vec_count = 0;
+    ex_->io_vec_index = 0;
+    ex_->body_count = 0;
+    ex_->response_count = 0;
+    ex_->keep_alive = false;
+    ex_->range_count = 0;
+    ex_->streaming = false;
+    ex_->stream_address = NULL;
+    ex_->multipart = NULL;
+    ex_->stream_part = 0;
+    ex_->stream_remaining = 0;
 }
 
-// 关闭连接
+// 关闭连接。socket最后才关闭：fd关闭后可能立即被其他loop accept到，复用这个对象。
+// io_uring中还没有完成的recv/sendmsg持有socket的引用，close不会让它们结束，先shutdown让它们立即完成
 void HttpConnection::closeConnection() {
     if (sockfd_ != -1) {
-        removefd(epollfd_, sockfd_);
+        int sockfd = sockfd_;
+        loop_->timers()->remove(&timer_);
         sockfd_ = -1;
         user_count_--;  // 关闭一个连接，将客户总数量-1
+        Metrics::add(Metrics::CONNECTIONS_CLOSED);
+        loop_->connectionClosed(sockfd);
+        if (ex_) {
+            unmap();
+            releaseExchange();
+        }
+        if (io_backend_ == URING) {
+            shutdown(sockfd, SHUT_RDWR);
+            close(sockfd);
+        } else {
+            removefd(epollfd_, sockfd);
+        }
     }
 }
 
-// 由线程池中的工作线程调用，这是处理HTTP请求的入口函数
-void HttpConnection::process() {
-    // 解析HTTP请求
-    HTTP_CODE read_ret = processRead();
-    if (read_ret == NO_REQUEST) {
+// 由loop线程在排空时调用。空闲的连接没有正在处理的请求，但socket中可能已经有还没读取的新请求，
+// 这样的连接留给随后的EPOLLIN处理，响应之后关闭。刚建立的连接的第一个请求很可能还在路上，
+// 不立即关闭，只把超时缩短到DRAIN_GRACE_MS
+bool HttpConnection::closeIfIdle() {
+    char data;
+    if (!idle_ || recv(sockfd_, &data, 1, MSG_PEEK | MSG_DONTWAIT) > 0) {
+        return false;
+    }
+    if (fresh_) {
+        uint64_t deadline = TimerWheel::now() + DRAIN_GRACE_MS;
+        if (timer_.deadline.load(std::memory_order_relaxed) > deadline) {
+            // 时间轮只能推后节点的超时时刻，提前需要重新加入
+            loop_->timers()->remove(&timer_);
+            timer_.deadline.store(deadline, std::memory_order_relaxed);
+            loop_->timers()->add(&timer_);
+        }
+        return false;
+    }
+    closeConnection();
+    return true;
+}
+
+// 由loop线程在线程池队列满时调用。不解析请求，丢掉读缓冲中的数据，回复503后关闭连接。
+// 返回false时由loop关闭连接
+bool HttpConnection::reject() {
+    queued_at_ = 0;
+    ex_->is_link = false;
+    if (!processWrite(SERVICE_UNAVAILABLE)) {
+        return false;
+    }
+    if (Log::accessEnabled()) {
+        logAccess(ex_->bytes_to_send, 0);
+    }
+    ex_->read_index = 0;
+    initRequest();
+    armTimer(deadlineAfter(write_timeout_));
+    waitWrite();
+    return true;
+}
+
+// 在工作线程中不能直接关闭连接(连接的定时器只能由loop线程操作)。关闭socket的读写两端后重新注册，
+// loop线程收到EPOLLHUP时再关闭连接。io_uring后端在loop线程中处理请求，由loop直接关闭
+void HttpConnection::abortConnection() {
+    if (io_backend_ == URING) {
+        io_wait_ = WAIT_CLOSE;
+        return;
+    }
+    shutdown(sockfd_, SHUT_RDWR);
+    modifyfd(epollfd_, sockfd_, EPOLLIN);
+}
+
+void HttpConnection::waitRead() {
+    if (io_backend_ == URING) {
+        io_wait_ = WAIT_READ;
+    } else {
         modifyfd(epollfd_, sockfd_, EPOLLIN);
+    }
+}
+
+void HttpConnection::waitWrite() {
+    if (io_backend_ == URING) {
+        io_wait_ = WAIT_WRITE;
+    } else {
+        modifyfd(epollfd_, sockfd_, EPOLLOUT);
+    }
+}
+
+// 由loop线程在把连接交给process之前调用：处理期间不会超时，process结束时重新设置超时时刻。
+// 新的时刻可能比定时器所在的槽位早(比如请求头超时短于空闲超时)，而工作线程不能操作时间轮，
+// 所以先把节点重新加入时间轮，时间轮每个tick检查一次，直到armTimer设置了新的时刻
+void HttpConnection::suspendTimer() {
+    loop_->timers()->remove(&timer_);
+    timer_.deadline.store(TimerNode::REARM_PENDING, std::memory_order_relaxed);
+    loop_->timers()->add(&timer_);
+}
+
+// 设置超时时刻，可以在工作线程中调用，随后的modifyfd把连接交还给loop线程。超时时刻至少留出一个tick，
+// 保证loop线程不会在modifyfd之前就因为超时关闭连接
+void HttpConnection::armTimer(uint64_t deadline) {
+    uint64_t earliest = TimerWheel::now() + TimerWheel::TICK_MS;
+    timer_.deadline.store(deadline > earliest ? deadline : earliest, std::memory_order_release);
+}
+
+// 由线程池中的工作线程调用，这是处理HTTP请求的入口函数。客户端可能不等响应就连续发送多个请求
+// (HTTP/1.1流水线)，依次处理读缓冲中所有完整的请求，它们的响应排队后一起发送
+void HttpConnection::process() {
+    if (queued_at_) {
+        Metrics::record(Metrics::QUEUE_WAIT, Metrics::now() - queued_at_);
+        queued_at_ = 0;
+    }
+
+    while (ex_->response_count < MAX_PIPELINE && ex_->write_index + MAX_RESPONSE_HEADER <= WRITE_BUFFER_SIZE) {
+        // 解析HTTP请求
+        uint64_t start = Log::accessEnabled() ? Metrics::now() : 0;
+        HTTP_CODE read_ret = processRead();
+        if (read_ret == NO_REQUEST) {
+            break;
+        }
+        if (loop_->draining()) {
+            // 服务器正在排空，这个响应之后关闭连接
+            ex_->is_link = false;
+        }
+
+        // 生成响应
+        off_t queued_bytes = ex_->bytes_to_send;
+        bool write_ret = processWrite(read_ret);
+        if (!write_ret) {
+            abortConnection();
+            return;
+        }
+        if (Log::accessEnabled()) {
+            logAccess(ex_->bytes_to_send - queued_bytes, Metrics::now() - start);
+        }
+        consumeRequest();
+
+        // 之后要关闭连接，或者响应体要流式发送时，这个响应只能是这一批中的最后一个
+        if (!ex_->keep_alive || ex_->streaming) {
+            break;
+        }
+    }
+
+    if (ex_->response_count == 0) {
+        if ((size_t)ex_->read_index == ex_->read_capacity) {
+            // 读缓冲已经扩大到上限，仍然装不下一个完整的请求
+            abortConnection();
+            return;
+        }
+        if (ex_->read_index == 0 && loop_->draining()) {
+            abortConnection();
+            return;
+        } else if (ex_->read_index == 0) {
+            // 没有读到数据，连接仍然空闲。epoll后端的read在loop线程中就处理了这种情况，不会交给process
+            releaseExchange();
+            armTimer(deadlineAfter(idle_timeout_));
+        } else if (request_deadline_ > TimerWheel::now()) {
+            armTimer(request_deadline_);
+        } else {
+            // 请求头超时了还没有接收完整(比如slowloris攻击)
+            abortConnection();
+            return;
+        }
+        waitRead();
         return;
     }
+    armTimer(deadlineAfter(write_timeout_));
+    waitWrite();
+}
 
-    // 生成响应
-    bool write_ret = processWrite(read_ret);
-    if (!write_ret) {
-        closeConnection();
+// 一个请求处理完毕，把读缓冲中它后面的流水线请求移到开头，并重置解析状态
+void HttpConnection::consumeRequest() {
+    int64_t consumed = (int64_t)ex_->checked_index + ex_->content_length;
+    if (!ex_->is_link || consumed > ex_->read_index) {
+        // 要关闭连接了，后面的数据都不再处理；解析出错的请求也可能没有完整读入
+        consumed = ex_->read_index;
     }
-    modifyfd(epollfd_, sockfd_, EPOLLOUT);
+    ex_->read_index -= consumed;
+    memmove(ex_->read_buffer, ex_->read_buffer + consumed, ex_->read_index);
+    initRequest();
 }
 
-// 循环读取客户数据，直到无数据可读或者对方关闭连接
+// 循环读取客户数据，直到无数据可读、对方关闭连接或者这一次读满了io_budget_字节。读缓冲在第一次读时
+// 从缓冲区池租用，写满时扩大一级，已经达到上限时剩下的数据先留在socket中，处理完缓冲中的请求后再读。
+// 缓冲为空时读到的是一个新请求的开头，从这时开始计算请求头超时
 bool HttpConnection::read() {
-    if (read_index_ >= READ_BUFFER_SIZE) {
+    if (!ex_ && !acquireExchange()) {
         return false;
     }
+    idle_ = false;
+    fresh_ = false;
     int bytes_read = 0;
+    size_t budget = io_budget_;
     while (true) {
-        // 从read_buffer_ + read_index_索引出开始保存数据，大小是READ_BUFFER_SIZE - read_index_
-        bytes_read = recv(sockfd_, read_buffer_ + read_index_, READ_BUFFER_SIZE - read_index_, 0);
+        if ((size_t)ex_->read_index == ex_->read_capacity && !growReadBuffer()) {
+            break;
+        }
+        // 从read_buffer + read_index索引出开始保存数据，大小是read_capacity - read_index
+        bytes_read = recv(sockfd_, ex_->read_buffer + ex_->read_index, ex_->read_capacity - ex_->read_index, 0);
         if (bytes_read == -1) {
             if (errno == EAGAIN || errno == EWOULDBLOCK) {
                 // 没有数据
@@ -134,26 +397,176 @@ bool HttpConnection::read() {
         } else if (bytes_read == 0) {  // 对方关闭连接
             return false;
         }
-        read_index_ += bytes_read;
+        if (ex_->read_index == 0) {
+            request_deadline_ = deadlineAfter(header_timeout_);
+        }
+        ex_->read_index += bytes_read;
+        if (io_budget_ && (size_t)bytes_read >= budget) {
+            // 剩下的数据等process之后重新注册EPOLLIN时再读，先轮到其他就绪的连接。和receive一样，
+            // 停下时读缓冲满了只能说明已经扩大到上限，process据此判断请求太大
+            if ((size_t)ex_->read_index == ex_->read_capacity) {
+                growReadBuffer();
+            }
+            Metrics::add(Metrics::BUDGET_YIELDS);
+            break;
+        }
+        budget -= bytes_read;
     }
 
+    if (ex_->read_index == 0) {
+        // 没有读到数据(比如对方发送之前就被唤醒)，连接仍然空闲。在loop线程中和finishWrite一样回到空闲状态，
+        // 不交给process，排空时能看到它是空闲的；已经开始排空时直接关闭
+        if (loop_->draining()) {
+            return false;
+        }
+        releaseExchange();
+        timer_.deadline.store(deadlineAfter(idle_timeout_), std::memory_order_relaxed);
+        idle_ = true;
+        waitRead();
+        return true;
+    }
+    suspendTimer();
     return true;
 }
 
-// 写HTTP响应
-bool HttpConnection::write() {
-    int temp = 0;
+// io_uring后端：recv已经把数据从socket中取到了内核提供的缓冲区里，追加到读缓冲。读缓冲扩大到上限
+// 仍然装不下时只能关闭连接，不能像read那样把剩下的数据留在socket中
+bool HttpConnection::receive(const char *data, size_t len) {
+    if (!ex_ && !acquireExchange()) {
+        return false;
+    }
+    idle_ = false;
+    fresh_ = false;
+    if (ex_->read_index == 0) {
+        request_deadline_ = deadlineAfter(header_timeout_);
+    }
+    while (len > 0) {
+        if ((size_t)ex_->read_index == ex_->read_capacity && !growReadBuffer()) {
+            return false;
+        }
+        size_t bytes = ex_->read_capacity - ex_->read_index < len ? ex_->read_capacity - ex_->read_index : len;
+        memcpy(ex_->read_buffer + ex_->read_index, data, bytes);
+        ex_->read_index += bytes;
+        data += bytes;
+        len -= bytes;
+    }
+    if ((size_t)ex_->read_index == ex_->read_capacity) {
+        // 和read一样，读缓冲满了只说明已经扩大到上限，process据此判断请求太大
+        growReadBuffer();
+    }
+
+    // 链接在sendmsg之后的recv可能在响应还没发送完时就完成了，这时保留写超时
+    if (io_wait_ != WAIT_WRITE) {
+        suspendTimer();
+    }
+    return true;
+}
+
+// 把读缓冲扩大一级，指向读缓冲的url等也搬到新的缓冲区中
+bool HttpConnection::growReadBuffer() {
+    int url_offset = ex_->url ? ex_->url - ex_->read_buffer : -1;
+    int version_offset = ex_->version ? ex_->version - ex_->read_buffer : -1;
+    int host_offset = ex_->host ? ex_->host - ex_->read_buffer : -1;
+    int range_offset = ex_->range ? ex_->range - ex_->read_buffer : -1;
+    int if_range_offset = ex_->if_range ? ex_->if_range - ex_->read_buffer : -1;
+    int if_none_match_offset = ex_->if_none_match ? ex_->if_none_match - ex_->read_buffer : -1;
+    int if_modified_since_offset = ex_->if_modified_since ? ex_->if_modified_since - ex_->read_buffer : -1;
+
+    char *buffer = buffer_pool_->grow(ex_->read_buffer, ex_->read_index, &ex_->read_capacity);
+    if (!buffer) {
+        return false;
+    }
+    ex_->read_buffer = buffer;
+
+    ex_->url = url_offset >= 0 ? ex_->read_buffer + url_offset : NULL;
+    ex_->version = version_offset >= 0 ? ex_->read_buffer + version_offset : NULL;
+    ex_->host = host_offset >= 0 ? ex_->read_buffer + host_offset : NULL;
+    ex_->range = range_offset >= 0 ? ex_->read_buffer + range_offset : NULL;
+    ex_->if_range = if_range_offset >= 0 ? ex_->read_buffer + if_range_offset : NULL;
+    ex_->if_none_match = if_none_match_offset >= 0 ? ex_->read_buffer + if_none_match_offset : NULL;
+    ex_->if_modified_since = if_modified_since_offset >= 0 ? ex_->read_buffer + if_modified_since_offset : NULL;
+    return true;
+}
+
+// 空闲的连接读到数据时租用Exchange和读缓冲，写缓冲等到生成响应时再租用
+bool HttpConnection::acquireExchange() {
+    ex_ = exchange_pool_->acquire();
+    if (!ex_) {
+        return false;
+    }
+    ex_->read_buffer = buffer_pool_->acquire(READ_BUFFER_SIZE, &ex_->read_capacity);
+    if (!ex_->read_buffer) {
+        exchange_pool_->release(ex_);
+        ex_ = NULL;
+        return false;
+    }
+    init();
+    return true;
+}
+
+// 连接变为空闲或者关闭时调用，响应体的资源已经由unmap释放。管道中还有没发出的数据时关闭管道，
+// 干净的管道留在Exchange中给下一个连接
+void HttpConnection::releaseExchange() {
+    buffer_pool_->release(ex_->read_buffer, ex_->read_capacity);
+    ex_->read_buffer = NULL;
+    ex_->read_capacity = 0;
+    buffer_pool_->release(ex_->write_buffer, WRITE_BUFFER_SIZE);
+    ex_->write_buffer = NULL;
+    if (ex_->pipe_bytes > 0) {
+        close(ex_->pipe_fd[0]);
+        close(ex_->pipe_fd[1]);
+        ex_->pipe_fd[0] = ex_->pipe_fd[1] = -1;
+        ex_->pipe_bytes = 0;
+    }
+    exchange_pool_->release(ex_);
+    ex_ = NULL;
+}
 
-    if (bytes_to_send_ == 0) {
+// 写HTTP响应，这一批排队的所有响应用sendmsg聚集写一起发送
+bool HttpConnection::write() {
+    StageTimer timer(Metrics::WRITE);
+    if (ex_->bytes_to_send == 0) {
         // 将要发送的字节为0，这一次响应结束。
+        timer_.deadline.store(deadlineAfter(idle_timeout_), std::memory_order_relaxed);
+        idle_ = true;
+        unmap();
+        releaseExchange();
         modifyfd(epollfd_, sockfd_, EPOLLIN);
-        init();
         return true;
     }
 
-    while (1) {
-        // 分散写
-        temp = writev(sockfd_, io_vec_, io_vec_count_);
+    // 每次可写时刷新写超时：只要对方还在接收，大文件的发送时间不受限制
+    timer_.deadline.store(deadlineAfter(write_timeout_), std::memory_order_relaxed);
+
+    off_t budget = io_budget_;
+    while (true) {
+        ssize_t temp = 0;
+        bool vectored = ex_->io_vec_index < ex_->io_vec_count;
+        if (vectored) {
+            // 后面还有流式发送的响应体时带上MSG_MORE，让内核把响应头和随后的文件数据合并成满的TCP段
+            struct msghdr msg;
+            memset(&msg, 0, sizeof(msg));
+            msg.msg_iov = ex_->io_vec + ex_->io_vec_index;
+            msg.msg_iovlen = ex_->io_vec_count - ex_->io_vec_index;
+            temp = sendmsg(sockfd_, &msg, streamPending() ? MSG_MORE : 0);
+        } else if (!streamPending()) {
+            break;
+        } else if (ex_->file_fd != -1 && file_strategy_ != MMAP && (ex_->stream_remaining > 0 || ex_->pipe_bytes > 0)) {
+            // 零拷贝策略，这个范围的内容直接从文件发往socket
+            temp = writeFile();
+            if (temp == 0) {  // 文件在发送过程中被截断
+                unmap();
+                return false;
+            }
+        } else {
+            // io_vec中的数据都发送完了，准备流式发送的响应体的下一段
+            if (!nextChunk()) {
+                unmap();
+                return false;
+            }
+            continue;
+        }
+
         if (temp <= -1) {
             // 如果TCP写缓冲没有空间，则等待下一轮EPOLLOUT事件，虽然在此期间，
             // 服务器无法立即接收到同一客户的下一个请求，但可以保证连接的完整性。
@@ -165,214 +578,637 @@ bool HttpConnection::write() {
             return false;
         }
 
-        bytes_have_send_ += temp;
-        bytes_to_send_ -= temp;
+        ex_->bytes_have_send += temp;
+        ex_->bytes_to_send -= temp;
+        Metrics::add(Metrics::BYTES_SENT, temp);
+        if (vectored) {
+            advanceIovec(temp);
+        }
+        if (io_budget_ && temp >= budget && ex_->bytes_to_send > 0) {
+            // 这一次写满了预算，重新注册EPOLLOUT排到就绪队列的末尾，一个大文件的下载不会长时间占住loop线程
+            Metrics::add(Metrics::BUDGET_YIELDS);
+            modifyfd(epollfd_, sockfd_, EPOLLOUT);
+            return true;
+        }
+        budget -= temp;
+    }
 
-        if (bytes_have_send_ >= io_vec_[0].iov_len) {
-            io_vec_[0].iov_len = 0;
-            io_vec_[1].iov_base = file_address_ + (bytes_have_send_ - write_index_);
-            io_vec_[1].iov_len = bytes_to_send_;
+    return finishWrite();
+}
+
+// 跳过已经发送完的内存块，调整发送了一部分的内存块的起始位置
+void HttpConnection::advanceIovec(size_t len) {
+    while (len > 0) {
+        struct iovec &vec = ex_->io_vec[ex_->io_vec_index];
+        if (len >= vec.iov_len) {
+            len -= vec.iov_len;
+            ++ex_->io_vec_index;
         } else {
-            io_vec_[0].iov_base = write_buffer_ + bytes_have_send_;
-            io_vec_[0].iov_len = io_vec_[0].iov_len - temp;
+            vec.iov_base = (char *)vec.iov_base + len;
+            vec.iov_len -= len;
+            len = 0;
         }
+    }
+}
 
-        if (bytes_to_send_ <= 0) {
-            // 没有数据要发送了
-            unmap();
-            modifyfd(epollfd_, sockfd_, EPOLLIN);
+// io_uring后端：这一批响应中还没有发送的部分。零拷贝策略在io_uring后端下不可用，响应体都在io_vec中，
+// 分段映射的大文件每次只有当前窗口在io_vec中
+struct msghdr *HttpConnection::sendMessage() {
+    memset(&ex_->message, 0, sizeof(ex_->message));
+    ex_->message.msg_iov = ex_->io_vec + ex_->io_vec_index;
+    ex_->message.msg_iovlen = ex_->io_vec_count - ex_->io_vec_index;
+    return &ex_->message;
+}
 
-            if (is_link_) {
-                init();
-                return true;
-            } else {
-                return false;
-            }
+// io_uring后端：sendmsg发送了len字节。发送缓冲满时sendmsg只发送一部分就完成，刷新写超时后由loop
+// 继续提交剩下的部分
+bool HttpConnection::sent(size_t len) {
+    ex_->bytes_have_send += len;
+    ex_->bytes_to_send -= len;
+    Metrics::add(Metrics::BYTES_SENT, len);
+    advanceIovec(len);
+    while (ex_->io_vec_index == ex_->io_vec_count && streamPending()) {
+        if (!nextChunk()) {
+            return false;
+        }
+    }
+    if (ex_->io_vec_index < ex_->io_vec_count) {
+        timer_.deadline.store(deadlineAfter(write_timeout_), std::memory_order_relaxed);
+        io_wait_ = WAIT_WRITE;
+        return true;
+    }
+    return finishWrite();
+}
+
+// 流式发送的响应体是否还有没加入io_vec或者还没从文件发出的部分。多个范围时最后还有结束行
+bool HttpConnection::streamPending() const {
+    if (!ex_->streaming) {
+        return false;
+    }
+    return ex_->stream_remaining > 0 || ex_->pipe_bytes > 0 ||
+           ex_->stream_part + (ex_->multipart ? 0 : 1) < ex_->range_count;
+}
+
+// io_vec中的数据都发送完之后(或者刚生成响应头时)准备流式发送的响应体的下一段：当前范围发送完时换到下一个范围，
+// 多个范围时先加入它的分隔行；mmap策略下再映射这个范围接下来的至多STREAM_WINDOW字节，上一个窗口这时已经发送完，
+// 可以解除映射。这样无论文件多大，一个连接同时只映射一个窗口。响应体在内存中时整个范围一次加入
+bool HttpConnection::nextChunk() {
+    if (ex_->io_vec_index == ex_->io_vec_count) {
+        ex_->io_vec_index = ex_->io_vec_count = 0;
+    }
+    if (ex_->window_address) {
+        munmap(ex_->window_address, ex_->window_size);
+        ex_->window_address = NULL;
+    }
+
+    if (ex_->stream_remaining == 0) {
+        ++ex_->stream_part;
+        if (ex_->multipart) {
+            size_t begin = ex_->part_header[ex_->stream_part];
+            size_t end =
+                ex_->stream_part < ex_->range_count ? ex_->part_header[ex_->stream_part + 1] : ex_->multipart->size();
+            pushIovec(ex_->multipart->data() + begin, end - begin);
+        }
+        if (ex_->stream_part == ex_->range_count) {
+            return true;
+        }
+        ex_->file_offset = ex_->ranges[ex_->stream_part].first;
+        ex_->stream_remaining = ex_->ranges[ex_->stream_part].length;
+    }
+    if (ex_->stream_address) {
+        pushIovec(ex_->stream_address + ex_->file_offset, ex_->stream_remaining);
+        ex_->stream_remaining = 0;
+        return true;
+    }
+    if (file_strategy_ != MMAP) {
+        return true;
+    }
+
+    // mmap的偏移必须按页对齐，窗口从file_offset所在的页开始
+    static const off_t page_size = sysconf(_SC_PAGESIZE);
+    off_t skew = ex_->file_offset % page_size;
+    off_t len = ex_->stream_remaining < STREAM_WINDOW ? ex_->stream_remaining : STREAM_WINDOW;
+    void *address = mmap(0, skew + len, PROT_READ, MAP_PRIVATE, ex_->file_fd, ex_->file_offset - skew);
+    if (address == MAP_FAILED) {
+        return false;
+    }
+    ex_->window_address = (char *)address;
+    ex_->window_size = skew + len;
+    pushIovec(ex_->window_address + skew, len);
+    ex_->file_offset += len;
+    ex_->stream_remaining -= len;
+    return true;
+}
+
+// 零拷贝策略：用sendfile或splice把当前范围的内容直接从页缓存发往socket，不经过用户态，也不需要mmap。
+// file_offset记录文件已经送出的位置，返回写入socket的字节数，和sendmsg一样出错时返回-1
+ssize_t HttpConnection::writeFile() {
+    if (file_strategy_ == SPLICE) {
+        return spliceFile();
+    }
+    // 一次sendfile可以把整个socket发送缓冲填满，按字节预算限制每次的长度，write才能及时让出loop线程
+    off_t count = io_budget_ && ex_->stream_remaining > (off_t)io_budget_ ? (off_t)io_budget_ : ex_->stream_remaining;
+    ssize_t len = sendfile(sockfd_, ex_->file_fd, &ex_->file_offset, count);
+    if (len > 0) {
+        ex_->stream_remaining -= len;
+    }
+    return len;
+}
+
+// 通过管道splice：文件 -> 管道 -> socket，管道中可能残留上一轮没能写进socket的数据。
+// 后面还有数据时带上SPLICE_F_MORE，和MSG_MORE一样让内核合并TCP段
+ssize_t HttpConnection::spliceFile() {
+    if (ex_->pipe_fd[0] == -1 && pipe2(ex_->pipe_fd, O_NONBLOCK | O_CLOEXEC) < 0) {
+        ex_->pipe_fd[0] = ex_->pipe_fd[1] = -1;
+        return -1;
+    }
+
+    if (ex_->pipe_bytes == 0) {
+        ssize_t len = splice(ex_->file_fd, &ex_->file_offset, ex_->pipe_fd[1], NULL, ex_->stream_remaining,
+                             SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (len <= 0) {
+            return len;
         }
+        ex_->pipe_bytes = len;
+        ex_->stream_remaining -= len;
     }
+
+    unsigned int more =
+        ex_->stream_remaining > 0 || ex_->multipart || ex_->stream_part + 1 < ex_->range_count ? SPLICE_F_MORE : 0;
+    ssize_t len =
+        splice(ex_->pipe_fd[0], NULL, sockfd_, NULL, ex_->pipe_bytes, SPLICE_F_MOVE | SPLICE_F_NONBLOCK | more);
+    if (len > 0) {
+        ex_->pipe_bytes -= len;
+    }
+    return len;
 }
 
-// 主状态机，解析请求
+// 一批响应发送完毕，长连接则重置状态等待下一个请求，否则返回false由调用者关闭连接
+bool HttpConnection::finishWrite() {
+    unmap();
+
+    // 服务器正在排空时，响应之前就已经开始处理的长连接也在这里关闭
+    if (!ex_->keep_alive || (ex_->read_index == 0 && loop_->draining())) {
+        waitRead();
+        return false;
+    }
+
+    initResponses();
+    if (ex_->read_index > 0) {
+        // 上一批已满，读缓冲中还留有流水线请求，它们已经读进来了，不会再有EPOLLIN事件。
+        // 有线程池时和读到的请求一样交给线程池，不在loop线程中解析请求和查找文件
+        if (loop_->pooled()) {
+            suspendTimer();
+            loop_->submit(sockfd_);
+        } else {
+            process();
+        }
+    } else {
+        // 连接空闲，缓冲区和Exchange归还给池，下一个请求到达时再租用
+        releaseExchange();
+        timer_.deadline.store(deadlineAfter(idle_timeout_), std::memory_order_relaxed);
+        idle_ = true;
+        waitRead();
+    }
+    return true;
+}
+
+// 解析请求，请求完整时再查找目标文件，两步的耗时分别计入指标
 HttpConnection::HTTP_CODE HttpConnection::processRead() {
-    LINE_STATUS line_status = LINE_OK;
-    HTTP_CODE ret = NO_REQUEST;
-    char *text = 0;
-
-    while (((check_state_ == CHECK_STATE_CONTENT) && (line_status == LINE_OK)) ||
-           ((line_status = parseLine()) == LINE_OK)) {
-        // 获取一行数据
-        text = getLine();
-        start_line_ = checked_index_;
-        printf("got 1 http line: %s\n", text);
-
-        switch (check_state_) {
-            case CHECK_STATE_REQUESTLINE: {
-                ret = parseRequestLine(text);
-                if (ret == BAD_REQUEST) {
-                    return BAD_REQUEST;
-                }
-                break;
-            }
-            case CHECK_STATE_HEADER: {
-                ret = parseHeaders(text);
-                if (ret == BAD_REQUEST) {
-                    return BAD_REQUEST;
-                } else if (ret == GET_REQUEST) {
-                    return doRequest();
-                }
-                break;
-            }
-            case CHECK_STATE_CONTENT: {
-                ret = parseContent(text);
-                if (ret == GET_REQUEST) {
-                    return doRequest();
-                }
-                line_status = LINE_OPEN;
-                break;
-            }
-            default:
-                return INTERNAL_ERROR;
+    uint64_t start = Metrics::now();
+    HTTP_CODE ret = parseRequest();
+    uint64_t parsed = Metrics::now();
+    Metrics::record(Metrics::PROCESS_READ, parsed - start);
+    if (ret != GET_REQUEST) {
+        return ret;
+    }
+
+    ret = doRequest();
+    Metrics::record(Metrics::DO_REQUEST, Metrics::now() - parsed);
+    return ret;
+}
+
+// 主状态机，解析请求。请求行和请求头由parser一遍扫描切分好，数据不完整时下次从未完成的行继续，
+// 之后如果有请求体再等待请求体读完
+HttpConnection::HTTP_CODE HttpConnection::parseRequest() {
+    if (ex_->check_state != CHECK_STATE_CONTENT) {
+        RequestParser::RESULT result = ex_->parser.parse(ex_->read_buffer, ex_->read_index);
+        if (result == RequestParser::INCOMPLETE) {
+            return NO_REQUEST;
+        }
+
+        if (result == RequestParser::ERROR || parseRequestLine() == BAD_REQUEST || parseHeaders() == BAD_REQUEST) {
+            // 无法确定请求在哪里结束，也就找不到后面的流水线请求，回复之后关闭连接
+            ex_->is_link = false;
+            return BAD_REQUEST;
+        }
+        ex_->checked_index = ex_->parser.headerEnd();
+
+        // 请求头加上消息体装不进扩大到上限的读缓冲时，永远等不到完整的请求
+        if ((size_t)ex_->checked_index + ex_->content_length > buffer_pool_->maxBufferSize()) {
+            ex_->is_link = false;
+            return BAD_REQUEST;
+        }
+
+        // 如果HTTP请求有消息体，则还需要读取content_length字节的消息体，
+        // 状态机转移到CHECK_STATE_CONTENT状态
+        if (ex_->content_length != 0) {
+            ex_->check_state = CHECK_STATE_CONTENT;
         }
     }
 
-    return NO_REQUEST;
+    return parseContent();
 }
 
-// 根据服务器处理HTTP请求的结果，决定返回给客户端的内容
+// 根据服务器处理HTTP请求的结果，决定返回给客户端的内容。响应追加到这一批的末尾：
+// 响应头接在写缓冲中上一个响应的后面，和响应体一起加入io_vec
 bool HttpConnection::processWrite(HTTP_CODE ret) {
+    if (!ex_->write_buffer) {
+        size_t capacity = 0;
+        ex_->write_buffer = buffer_pool_->acquire(WRITE_BUFFER_SIZE, &capacity);
+        if (!ex_->write_buffer) {
+            return false;
+        }
+    }
+
+    int header_start = ex_->write_index;
+    ex_->status = 200;
     switch (ret) {
         case INTERNAL_ERROR:
-            addStatusLine(500, error_500_title);
-            addHeaders(strlen(error_500_form));
-            if (!addContent(error_500_form)) {
+            ex_->status = 500;
+            if (!addStatusLine(500, error_500_title) || !addHeaders(strlen(error_500_form)) || !addContent(error_500_form)) {
                 return false;
             }
             break;
         case BAD_REQUEST:
-            addStatusLine(400, error_400_title);
-            addHeaders(strlen(error_400_form));
-            if (!addContent(error_400_form)) {
+            ex_->status = 400;
+            if (!addStatusLine(400, error_400_title) || !addHeaders(strlen(error_400_form)) || !addContent(error_400_form)) {
                 return false;
             }
             break;
         case NO_RESOURCE:
-            addStatusLine(404, error_404_title);
-            addHeaders(strlen(error_404_form));
-            if (!addContent(error_404_form)) {
+            ex_->status = 404;
+            if (!addStatusLine(404, error_404_title) || !addHeaders(strlen(error_404_form)) || !addContent(error_404_form)) {
                 return false;
             }
             break;
         case FORBIDDEN_REQUEST:
-            addStatusLine(403, error_403_title);
-            addHeaders(strlen(error_403_form));
-            if (!addContent(error_403_form)) {
+            ex_->status = 403;
+            if (!addStatusLine(403, error_403_title) || !addHeaders(strlen(error_403_form)) || !addContent(error_403_form)) {
+                return false;
+            }
+            break;
+        case NOT_MODIFIED:
+            // 304没有响应体，只带校验值和缓存策略，客户端用它们更新缓存的副本
+            ex_->status = 304;
+            if (!addStatusLine(304, not_modified_304_title) || !addValidators() ||
+                !addVary() || !addIsLink() || !addBlankLine()) {
                 return false;
             }
             break;
         case FILE_REQUEST:
-            addStatusLine(200, ok_200_title);
-            addHeaders(file_state_.st_size);
-            io_vec_[0].iov_base = write_buffer_;
-            io_vec_[0].iov_len = write_index_;
-            io_vec_[1].iov_base = file_address_;
-            io_vec_[1].iov_len = file_state_.st_size;
-            io_vec_count_ = 2;
-
-            bytes_to_send_ = write_index_ + file_state_.st_size;
-
-            return true;
+            if (!addFileResponse()) {
+                return false;
+            }
+            break;
+        case STATS_REQUEST:
+            if (!addStats()) {
+                return false;
+            }
+            break;
+        case RANGE_NOT_SATISFIABLE:
+            ex_->status = 416;
+            if (!addStatusLine(416, error_416_title) || !addContentRange(NULL) || !addHeaders(strlen(error_416_form)) ||
+                !addContent(error_416_form)) {
+                return false;
+            }
+            break;
+        case SERVICE_UNAVAILABLE:
+            ex_->status = 503;
+            if (!addStatusLine(503, error_503_title) || !addRetryAfter() || !addHeaders(strlen(error_503_form)) ||
+                !addContent(error_503_form)) {
+                return false;
+            }
+            break;
         default:
             return false;
     }
 
-    io_vec_[0].iov_base = write_buffer_;
-    io_vec_[0].iov_len = write_index_;
-    io_vec_count_ = 1;
-    bytes_to_send_ = write_index_;
+    if (ret != FILE_REQUEST && ret != STATS_REQUEST) {
+        appendIovec(ex_->write_buffer + header_start, ex_->write_index - header_start);
+    }
+    ex_->keep_alive = ex_->is_link;
+    ++ex_->response_count;
+    Metrics::countRequest(ex_->status);
 
     return true;
 }
 
-// 解析HTTP请求行，获得请求方法，目标URL,以及HTTP版本号
-HttpConnection::HTTP_CODE HttpConnection::parseRequestLine(char *text) {
-    // GET /index.html HTTP/1.1
-    url_ = strpbrk(text, " \t");  // 判断第二个参数中的字符哪个在text中最先出现
-    if (!url_) {
-        return BAD_REQUEST;
+// 往这一批响应中追加一块要发送的内存，和上一块首尾相接时直接合并
+void HttpConnection::appendIovec(const char *base, size_t len) {
+    ex_->bytes_to_send += len;
+    pushIovec(base, len);
+}
+
+// 同appendIovec，但不计入bytes_to_send：流式发送的响应体生成响应头时就已经整个计入了
+void HttpConnection::pushIovec(const char *base, size_t len) {
+    if (len == 0) {
+        return;
+    }
+    if (ex_->io_vec_count > 0) {
+        struct iovec &last = ex_->io_vec[ex_->io_vec_count - 1];
+        if ((const char *)last.iov_base + last.iov_len == base) {
+            last.iov_len += len;
+            return;
+        }
     }
-    // GET\0/index.html HTTP/1.1
-    *url_++ = '\0';  // 置位空字符，字符串结束符
-    char *method = text;
-    if (strcasecmp(method, "GET") == 0) {  // 忽略大小写比较
-        method_ = GET;
+    ex_->io_vec[ex_->io_vec_count].iov_base = (char *)base;
+    ex_->io_vec[ex_->io_vec_count].iov_len = len;
+    ++ex_->io_vec_count;
+}
+
+// "Content-Range: bytes first-last/size\r\n"，range为NULL时是416响应的"*/size"。out至少要有CONTENT_RANGE_LEN字节
+static const int CONTENT_RANGE_LEN = 96;
+static int formatContentRange(const HttpConnection::ByteRange *range, off_t size, char *out) {
+    int len = 0;
+    HeaderWriter writer(out, CONTENT_RANGE_LEN, &len);
+    writer.append(CONTENT_RANGE);
+    if (range) {
+        writer.appendNumber(range->first);
+        writer.append("-", 1);
+        writer.appendNumber(range->first + range->length - 1);
     } else {
-        return BAD_REQUEST;
+        writer.append("*", 1);
+    }
+    writer.append("/", 1);
+    writer.appendNumber(size);
+    writer.append(CRLF);
+    return len;
+}
+
+// 静态文件的响应：整个文件回复200；Range请求回复206，多个范围时响应体是multipart/byteranges，
+// 每个范围前面是一段分隔行。响应体在内存中(文件缓存的内容或者小文件的映射)时直接切片加入io_vec；
+// 否则流式发送，这一批之后的部分由nextChunk()逐段加入。响应体的资源转交给这一批，等整批发送完毕再释放
+bool HttpConnection::addFileResponse() {
+    ResponseBody &body = ex_->bodies[ex_->body_count];
+    body.cache_entry = NULL;
+    body.compressed = NULL;
+    body.file_address = NULL;
+    body.file_size = 0;
+    body.content = NULL;
+
+    // 缓存的完整响应只有一种编码，预压缩文件按它自己的路径缓存，但也可能被直接请求，所以只用于不压缩的响应
+    bool partial = ex_->range_count > 0;
+    if (!partial && ex_->content_encoding == Compressor::IDENTITY && addCachedResponse()) {
+        body.cache_entry = ex_->cache_entry;
+        ex_->cache_entry = NULL;
+        ex_->file_address = 0;
+        ++ex_->body_count;
+        return true;
+    }
+    if (!partial) {
+        ex_->ranges[0].first = 0;
+        ex_->ranges[0].length = ex_->file_state.st_size;
+        ex_->range_count = 1;
+    }
+
+    off_t content_length = 0;
+    for (int i = 0; i < ex_->range_count; ++i) {
+        content_length += ex_->ranges[i].length;
+    }
+    char boundary[20] = {0};
+    if (ex_->range_count > 1) {
+        // 分隔符不需要保密，只要不太可能出现在文件内容中
+        static std::atomic<uint64_t> sequence(0);
+        uint64_t seed = (Metrics::now() ^ sequence.fetch_add(1, std::memory_order_relaxed)) * 0x9E3779B97F4A7C15ULL;
+        snprintf(boundary, sizeof(boundary), "%016llx", (unsigned long long)seed);
+
+        char content_range[CONTENT_RANGE_LEN];
+        body.content = new std::string();
+        for (int i = 0; i < ex_->range_count; ++i) {
+            ex_->part_header[i] = body.content->size();
+            int len = formatContentRange(&ex_->ranges[i], ex_->file_state.st_size, content_range);
+            body.content->append("\r\n--").append(boundary).append("\r\n");
+            body.content->append(ex_->content_type->header.data, ex_->content_type->header.len)
+                .append(content_range, len)
+                .append("\r\n");
+        }
+        ex_->part_header[ex_->range_count] = body.content->size();
+        body.content->append("\r\n--").append(boundary).append("--\r\n");
+        content_length += body.content->size();
+    }
+
+    int header_start = ex_->write_index;
+    ex_->status = partial ? 206 : 200;
+    if (!addFileHeaders(partial, content_length, ex_->range_count > 1 ? boundary : NULL)) {
+        delete body.content;
+        return false;
+    }
+    appendIovec(ex_->write_buffer + header_start, ex_->write_index - header_start);
+    ++ex_->body_count;
+
+    if (ex_->file_fd == -1) {
+        body.cache_entry = ex_->cache_entry;
+        body.compressed = ex_->compressed;
+        body.file_address = ex_->cache_entry || ex_->compressed ? NULL : ex_->file_address;
+        body.file_size = ex_->file_state.st_size;
+        ex_->cache_entry = NULL;
+        ex_->compressed = NULL;
+    }
+    if (ex_->file_fd == -1 && ex_->range_count == 1) {
+        appendIovec(ex_->file_address + ex_->ranges[0].first, ex_->ranges[0].length);
+        ex_->file_address = 0;
+        return true;
+    }
+
+    // 流式发送：零拷贝策略下第一个范围由write()直接从文件发送，mmap策略下映射第一个窗口。
+    // 在内存中的多个范围也逐个加入io_vec，这样一个响应最多占用三个内存块
+    ex_->streaming = true;
+    ex_->stream_address = ex_->file_address;
+    ex_->file_address = 0;
+    ex_->bytes_to_send += content_length;
+    ex_->multipart = body.content;
+    ex_->stream_part = -1;
+    ex_->stream_remaining = 0;
+    return nextChunk();
+}
+
+// 文件响应的响应头。partial时回复206，单个范围带Content-Range，多个范围时每个范围的Content-Range在分隔行中
+bool HttpConnection::addFileHeaders(bool partial, off_t content_length, const char *boundary) {
+    if (!addStatusLine(partial ? 206 : 200, partial ? partial_206_title : ok_200_title) ||
+        !addContentLength(content_length)) {
+        return false;
+    }
+    if (boundary) {
+        HeaderWriter writer(ex_->write_buffer, WRITE_BUFFER_SIZE, &ex_->write_index);
+        if (!writer.append(CONTENT_TYPE_MULTIPART) || !writer.append(boundary, strlen(boundary)) ||
+            !writer.append(CRLF)) {
+            return false;
+        }
+    } else if (!addContentType(ex_->content_type->header) || (partial && !addContentRange(&ex_->ranges[0]))) {
+        return false;
+    }
+    // 压缩的响应不支持Range，不带Accept-Ranges
+    HeaderWriter writer(ex_->write_buffer, WRITE_BUFFER_SIZE, &ex_->write_index);
+    if (ex_->content_encoding == Compressor::BROTLI && !writer.append(CONTENT_ENCODING_BR)) {
+        return false;
+    } else if (ex_->content_encoding == Compressor::GZIP && !writer.append(CONTENT_ENCODING_GZIP)) {
+        return false;
+    } else if (ex_->content_encoding == Compressor::IDENTITY && !writer.append(ACCEPT_RANGES)) {
+        return false;
+    }
+    return addVary() && addValidators() && addIsLink() && addBlankLine();
+}
+
+// 小文件使用文件缓存中预先生成的完整响应，整个响应是一块连续的只读内存，一次write就能发送。
+// 第一次请求时用写缓冲中的响应头生成，之后直接复用，不再拼接响应头
+bool HttpConnection::addCachedResponse() {
+    if (!ex_->cache_entry || !file_cache_->cacheResponses() || ex_->cache_entry->fd() != -1) {
+        return false;
+    }
+
+    size_t len = 0;
+    const char *response = ex_->cache_entry->response(ex_->is_link, &len);
+    if (!response) {
+        int header_start = ex_->write_index;
+        if (addFileHeaders(false, ex_->file_state.st_size, NULL)) {
+            response = ex_->cache_entry->setResponse(ex_->is_link, ex_->write_buffer + header_start,
+                                                     ex_->write_index - header_start, &len);
+        }
+        ex_->write_index = header_start;
+        if (!response) {
+            return false;
+        }
     }
-    // /index.html HTTP/1.1
-    // 检索字符串 str1 中第一个不在字符串 str2 中出现的字符下标。
-    version_ = strpbrk(url_, " \t");
-    if (!version_) {
+
+    appendIovec(response, len);
+
+    return true;
+}
+
+// 运行时指标的响应，响应体每次请求时生成，交给这一批持有，整批发送完毕后释放
+bool HttpConnection::addStats() {
+    std::string *content = new std::string();
+    Metrics::render(content);
+
+    int header_start = ex_->write_index;
+    if (!addStatusLine(200, ok_200_title) || !addHeaders(content->size(), CONTENT_TYPE_METRICS)) {
+        delete content;
+        return false;
+    }
+    appendIovec(ex_->write_buffer + header_start, ex_->write_index - header_start);
+    appendIovec(content->data(), content->size());
+
+    ResponseBody &body = ex_->bodies[ex_->body_count++];
+    body.cache_entry = NULL;
+    body.compressed = NULL;
+    body.file_address = NULL;
+    body.file_size = 0;
+    body.content = content;
+    return true;
+}
+
+// 每个请求一行访问日志，logfmt格式(key=value，空格分隔)，便于按字段检索。duration_us是解析请求到生成响应的耗时，
+// 不含发送
+void HttpConnection::logAccess(off_t bytes, uint64_t duration_ns) {
+    char time[32];
+    Log::timestamp(time);
+    char ip[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &address_.sin_addr, ip, sizeof(ip));
+    Log::access("time=%s remote=%s:%d method=%s url=%s status=%d bytes=%lld duration_us=%llu", time, ip,
+                ntohs(address_.sin_port), ex_->url ? "GET" : "-", ex_->url ? ex_->url : "-", ex_->status,
+                (long long)bytes, (unsigned long long)(duration_ns / 1000));
+}
+
+// 判断token是否等于字符串str(不区分大小写)
+static bool tokenEquals(const char *buffer, const Token &token, const char *str) {
+    return token.len == (int)strlen(str) && strncasecmp(buffer + token.offset, str, token.len) == 0;
+}
+
+// 检查解析出的请求行，获得请求方法，目标URL,以及HTTP版本号
+HttpConnection::HTTP_CODE HttpConnection::parseRequestLine() {
+    // GET /index.html HTTP/1.1
+    if (tokenEquals(ex_->read_buffer, ex_->parser.method(), "GET")) {  // 忽略大小写比较
+        ex_->method = GET;
+    } else {
         return BAD_REQUEST;
     }
-    *version_++ = '\0';
-    if (strcasecmp(version_, "HTTP/1.1") != 0) {
+    if (!tokenEquals(ex_->read_buffer, ex_->parser.version(), "HTTP/1.1")) {
         return BAD_REQUEST;
     }
+
+    // URL和版本号后面分别是空格和\r，置为字符串结束符
+    ex_->url = ex_->read_buffer + ex_->parser.url().offset;
+    ex_->url[ex_->parser.url().len] = '\0';
+    ex_->version = ex_->read_buffer + ex_->parser.version().offset;
+    ex_->version[ex_->parser.version().len] = '\0';
+    LOG_DEBUG("got http request: %s %s", ex_->url, ex_->version);
+
     /**
      * http://192.168.110.129:10000/index.html
      */
-    if (strncasecmp(url_, "http://", 7) == 0) {
-        url_ += 7;
+    if (strncasecmp(ex_->url, "http://", 7) == 0) {
+        ex_->url += 7;
         // 在参数 str 所指向的字符串中搜索第一次出现字符 c（一个无符号字符）的位置。
-        url_ = strchr(url_, '/');
+        ex_->url = strchr(ex_->url, '/');
     }
-    if (!url_ || url_[0] != '/') {
+    if (!ex_->url || ex_->url[0] != '/') {
         return BAD_REQUEST;
     }
-    check_state_ = CHECK_STATE_HEADER;  // 检查状态变成检查头
+    ex_->check_state = CHECK_STATE_HEADER;  // 检查状态变成检查头
     return NO_REQUEST;
 }
 
-// 解析HTTP请求的一个头部信息
-HttpConnection::HTTP_CODE HttpConnection::parseHeaders(char *text) {
-    // 遇到空行，表示头部字段解析完毕
-    if (text[0] == '\0') {
-        // 如果HTTP请求有消息体，则还需要读取content_length_字节的消息体，
-        // 状态机转移到CHECK_STATE_CONTENT状态
-        if (content_length_ != 0) {
-            check_state_ = CHECK_STATE_CONTENT;
-            return NO_REQUEST;
+// 处理解析出的所有请求头
+HttpConnection::HTTP_CODE HttpConnection::parseHeaders() {
+    for (int i = 0; i < ex_->parser.headerCount(); ++i) {
+        const HeaderToken &header = ex_->parser.header(i);
+        // 值后面是\r或者空白，置为字符串结束符
+        char *text = ex_->read_buffer + header.value.offset;
+        text[header.value.len] = '\0';
+
+        if (tokenEquals(ex_->read_buffer, header.name, "Connection")) {
+            // 处理Connection 头部字段  Connection: keep-alive
+            if (strcasecmp(text, "keep-alive") == 0) {
+                ex_->is_link = true;
+            } else if (strcasecmp(text, "close") == 0) {
+                ex_->is_link = false;
+            }
+        } else if (tokenEquals(ex_->read_buffer, header.name, "Content-Length")) {
+            // 处理Content-Length头部字段。消息体要整个读进读缓冲，不是合法的数字或者超过读缓冲的上限时拒绝
+            char *end = NULL;
+            errno = 0;
+            long long length = strtoll(text, &end, 10);
+            if (end == text || *end != '\0' || errno == ERANGE || length < 0 ||
+                (unsigned long long)length > buffer_pool_->maxBufferSize()) {
+                return BAD_REQUEST;
+            }
+            ex_->content_length = (int)length;
+        } else if (tokenEquals(ex_->read_buffer, header.name, "Host")) {
+            // 处理Host头部字段
+            ex_->host = text;
+        } else if (tokenEquals(ex_->read_buffer, header.name, "Range")) {
+            // 要等找到文件、知道文件大小之后才能确定范围，由doRequest处理
+            ex_->range = text;
+        } else if (tokenEquals(ex_->read_buffer, header.name, "If-Range")) {
+            ex_->if_range = text;
+        } else if (tokenEquals(ex_->read_buffer, header.name, "If-None-Match")) {
+            ex_->if_none_match = text;
+        } else if (tokenEquals(ex_->read_buffer, header.name, "If-Modified-Since")) {
+            ex_->if_modified_since = text;
+        } else if (tokenEquals(ex_->read_buffer, header.name, "Accept-Encoding")) {
+            ex_->accept_encoding = compressor_ ? Compressor::parseAcceptEncoding(text) : 0;
+        } else {
+            LOG_DEBUG("unknown header %.*s", header.name.len, ex_->read_buffer + header.name.offset);
         }
-        // 否则说明我们已经得到了一个完整的HTTP请求
-        return GET_REQUEST;
-    } else if (strncasecmp(text, "Connection:", 11) == 0) {
-        // 处理Connection 头部字段  Connection: keep-alive
-        text += 11;
-        text += strspn(text, " \t");
-        if (strcasecmp(text, "keep-alive") == 0) {
-            is_link_ = true;
-        }
-    } else if (strncasecmp(text, "Content-Length:", 15) == 0) {
-        // 处理Content-Length头部字段
-        text += 15;
-        text += strspn(text, " \t");
-        content_length_ = atol(text);
-    } else if (strncasecmp(text, "Host:", 5) == 0) {
-        // 处理Host头部字段
-        text += 5;
-        text += strspn(text, " \t");
-        host_ = text;
-    } else {
-        printf("oop! unknow header %s\n", text);
     }
 
     return NO_REQUEST;
 }
 
 // 我们没有真正解析HTTP请求的消息体，只是判断它是否被完整的读入了
-HttpConnection::HTTP_CODE HttpConnection::parseContent(char *text) {
-    if (read_index_ >= (content_length_ + checked_index_)) {
-        text[content_length_] = '\0';
+HttpConnection::HTTP_CODE HttpConnection::parseContent() {
+    if ((int64_t)ex_->read_index >= (int64_t)ex_->checked_index + ex_->content_length) {
         return GET_REQUEST;
     }
     return NO_REQUEST;
@@ -380,111 +1216,512 @@ HttpConnection::HTTP_CODE HttpConnection::parseContent(char *text) {
 
 // 当得到一个完整、正确的HTTP请求时，我们就分析目标文件的属性，
 // 如果目标文件存在、对所有用户可读，且不是目录，则使用mmap将其
-// 映射到内存地址file_address_处，并告诉调用者获取文件成功
+// 映射到内存地址file_address处，并告诉调用者获取文件成功。
+// 大文件不整个映射，保留文件描述符流式发送，见nextChunk()
 HttpConnection::HTTP_CODE HttpConnection::doRequest() {
-    // "/home/nowcoder/webserver/resources"
-    strcpy(real_file_, doc_root);
+    if (strcmp(ex_->url, STATS_URL) == 0) {
+        return STATS_REQUEST;
+    }
+
+    // 客户请求的目标文件的完整路径，其内容等于 doc_root + url, doc_root是网站根目录
+    const char *doc_root = doc_root_.load(std::memory_order_acquire);
+    char real_file[FILENAME_LEN] = {0};
+    strcpy(real_file, doc_root);
     int len = strlen(doc_root);
-    strncpy(real_file_ + len, url_, FILENAME_LEN - len - 1);
+    strncpy(real_file + len, ex_->url, FILENAME_LEN - len - 1);
 
-    // 获取real_file_文件的相关的状态信息，-1失败，0成功
-    if (stat(real_file_, &file_state_) < 0) {
+    // 优先从文件缓存中取，文件的类型也取自缓存项中和文件状态一起保存的结果，不用每个请求都查找；
+    // 缓存中没有合适的文件时走下面不缓存的路径，由它判断具体的错误
+    ex_->content_encoding = Compressor::IDENTITY;
+    ex_->content_type = NULL;
+    if (file_cache_) {
+        ex_->cache_entry = file_cache_->acquire(real_file, file_strategy_ == MMAP);
+        if (ex_->cache_entry) {
+            ex_->content_type = ex_->cache_entry->type();
+        }
+    }
+
+    // 文本类的文件可能压缩发送，响应随Accept-Encoding变化。不在缓存中的文件按url的扩展名确定类型，
+    // 预压缩文件的类型是原文件的
+    if (compressor_ && !ex_->content_type) {
+        ex_->content_type = MimeTypes::lookup(ex_->url);
+    }
+    ex_->vary = compressor_ && ex_->content_type->compressible;
+    if (ex_->vary && ex_->accept_encoding && !ex_->range && selectEncoding(real_file)) {
+        ex_->range_count = 0;
+        if (notModified()) {
+            compressor_->release(ex_->compressed);
+            ex_->compressed = NULL;
+            ex_->file_address = 0;
+            return NOT_MODIFIED;
+        }
+        return FILE_REQUEST;
+    }
+
+    // 缓存项可能已经被selectEncoding换成了预压缩文件的，类型仍然是上面取得的原文件的
+    if (ex_->cache_entry) {
+        ex_->file_state = ex_->cache_entry->state();
+        if (notModified()) {
+            file_cache_->release(ex_->cache_entry);
+            ex_->cache_entry = NULL;
+            return NOT_MODIFIED;
+        }
+        if (!selectRanges()) {
+            file_cache_->release(ex_->cache_entry);
+            ex_->cache_entry = NULL;
+            return RANGE_NOT_SATISFIABLE;
+        }
+        // 缓存了内容的文件直接writev，否则用缓存的文件描述符零拷贝发送
+        ex_->file_address = (char *)ex_->cache_entry->data();
+        if (!ex_->file_address) {
+            ex_->file_fd = ex_->cache_entry->fd();
+            ex_->file_offset = 0;
+        }
+        return FILE_REQUEST;
+    }
+
+    // 获取real_file文件的相关的状态信息，-1失败，0成功
+    if (stat(real_file, &ex_->file_state) < 0) {
         return NO_RESOURCE;
     }
 
     // 判断访问权限
-    if (!(file_state_.st_mode & S_IROTH)) {
+    if (!(ex_->file_state.st_mode & S_IROTH)) {
         return FORBIDDEN_REQUEST;
     }
 
     // 判断是否是目录
-    if (S_ISDIR(file_state_.st_mode)) {
+    if (S_ISDIR(ex_->file_state.st_mode)) {
         return BAD_REQUEST;
     }
 
+    ex_->content_type = ex_->content_type ? ex_->content_type : MimeTypes::lookup(ex_->url);
+
+    // 条件请求在Range之前判断，校验值一致时不打开文件
+    if (notModified()) {
+        return NOT_MODIFIED;
+    }
+    if (!selectRanges()) {
+        return RANGE_NOT_SATISFIABLE;
+    }
+
     // 以只读方式打开文件
-    int fd = open(real_file_, O_RDONLY);
+    int fd = open(real_file, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return NO_RESOURCE;
+    }
+
+    // 零拷贝策略保留文件描述符，由write()用sendfile/splice直接发送；mmap策略下的大文件也保留文件描述符，
+    // 发送时逐个窗口映射
+    if (file_strategy_ != MMAP || ex_->file_state.st_size > STREAM_WINDOW) {
+        ex_->file_fd = fd;
+        ex_->file_offset = 0;
+        return FILE_REQUEST;
+    }
+
     // 创建内存映射
-    file_address_ = (char *)mmap(0, file_state_.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ex_->file_address = (char *)mmap(0, ex_->file_state.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
     close(fd);
 
     return FILE_REQUEST;
 }
 
-// 解析一行，判断依据\r\n
-HttpConnection::LINE_STATUS HttpConnection::parseLine() {
-    char temp;
-    for (; checked_index_ < read_index_; ++checked_index_) {
-        temp = read_buffer_[checked_index_];
-        if (temp == '\r') {
-            if ((checked_index_ + 1) == read_index_) {
-                return LINE_OPEN;
-            } else if (read_buffer_[checked_index_ + 1] == '\n') {
-                read_buffer_[checked_index_++] = '\0';
-                read_buffer_[checked_index_++] = '\0';
-                return LINE_OK;
+// 按客户端接受的编码选择响应体，依次尝试br和gzip：先找预压缩文件(比原文件新的real_file.br、real_file.gz)，
+// 找到时把real_file换成它，由doRequest按普通文件发送，返回false；再找压缩缓存，命中时响应体直接来自缓存，返回true。
+// 都没有时提交后台压缩，这一次发送原文件。Range请求不压缩，范围总是对原文件而言的。
+// 使用文件缓存时原文件(doRequest已经取得的cache_entry)和预压缩文件都从缓存中取，不存在的预压缩文件记录在
+// 原文件的缓存项中，命中时不用stat；选中预压缩文件时把cache_entry换成它的缓存项
+bool HttpConnection::selectEncoding(char *real_file) {
+    struct stat state;
+    FileCache::Entry *entry = ex_->cache_entry;
+    if (file_cache_) {
+        if (!entry) {
+            return false;
+        }
+        state = entry->state();
+    } else if (stat(real_file, &state) < 0 || !S_ISREG(state.st_mode) || !(state.st_mode & S_IROTH)) {
+        return false;
+    }
+
+    size_t len = strlen(real_file);
+    Compressor::ENCODING preferred = Compressor::IDENTITY;
+    for (int i = Compressor::BROTLI; i < Compressor::ENCODING_COUNT; ++i) {
+        Compressor::ENCODING encoding = (Compressor::ENCODING)i;
+        if (!(ex_->accept_encoding & (1 << i))) {
+            continue;
+        }
+        preferred = preferred == Compressor::IDENTITY ? encoding : preferred;
+
+        const char *extension = Compressor::extension(encoding);
+        if (len + strlen(extension) < (size_t)FILENAME_LEN && !(entry && entry->variantMissing(i, TimerWheel::now()))) {
+            strcpy(real_file + len, extension);
+            if (entry) {
+                FileCache::Entry *sibling = file_cache_->acquire(real_file, file_strategy_ == MMAP);
+                if (!sibling) {
+                    entry->setVariantMissing(i, TimerWheel::now() + VARIANT_RECHECK_MS);
+                } else if (sibling->state().st_mtime >= state.st_mtime) {
+                    file_cache_->release(entry);
+                    ex_->cache_entry = sibling;
+                    ex_->content_encoding = encoding;
+                    return false;
+                } else {
+                    file_cache_->release(sibling);
+                }
+            } else {
+                struct stat sibling;
+                if (stat(real_file, &sibling) == 0 && S_ISREG(sibling.st_mode) && (sibling.st_mode & S_IROTH) &&
+                    sibling.st_mtime >= state.st_mtime) {
+                    ex_->content_encoding = encoding;
+                    return false;
+                }
             }
-            return LINE_BAD;
-        } else if (temp == '\n') {
-            if ((checked_index_ > 1) && (read_buffer_[checked_index_ - 1] == '\r')) {
-                read_buffer_[checked_index_ - 1] = '\0';
-                read_buffer_[checked_index_++] = '\0';
-                return LINE_OK;
+            real_file[len] = '\0';
+        }
+
+        ex_->compressed = compressor_->dynamic() ? compressor_->acquire(real_file, encoding, state) : NULL;
+        if (ex_->compressed) {
+            // 响应体是压缩后的内容，修改时间等仍然是原文件的
+            ex_->content_encoding = encoding;
+            ex_->file_state = state;
+            ex_->file_state.st_size = ex_->compressed->size();
+            ex_->file_address = (char *)ex_->compressed->data();
+            if (entry) {
+                file_cache_->release(entry);
+                ex_->cache_entry = NULL;
             }
-            return LINE_BAD;
+            return true;
         }
     }
+    if (preferred != Compressor::IDENTITY) {
+        compressor_->compress(real_file, preferred, state);
+    }
+    return false;
+}
 
-    return LINE_OK;
+// 读取一个不超过off_t范围的十进制数，没有数字或者溢出时返回-1
+static off_t parseOffset(const char **text) {
+    const char *p = *text;
+    off_t value = 0;
+    for (; *p >= '0' && *p <= '9'; ++p) {
+        if (value > (INT64_MAX - (*p - '0')) / 10) {
+            return -1;
+        }
+        value = value * 10 + (*p - '0');
+    }
+    if (p == *text) {
+        return -1;
+    }
+    *text = p;
+    return value;
 }
 
-// 对内存映射区执行munmap操作
-void HttpConnection::unmap() {
-    if (file_address_) {
-        munmap(file_address_, file_state_.st_size);
-        file_address_ = 0;
+// 根据Range请求头选出要发送的范围，放在ranges中，range_count为0表示回复整个文件。只支持bytes单位，
+// 语法错误、范围超过MAX_RANGES个或者If-Range不匹配时按照RFC 9110忽略Range。范围都不可满足时返回false，回复416
+bool HttpConnection::selectRanges() {
+    ex_->range_count = 0;
+    if (!ex_->range || strncasecmp(ex_->range, "bytes=", 6) != 0 || (ex_->if_range && !ifRangeMatches())) {
+        return true;
+    }
+
+    off_t size = ex_->file_state.st_size;
+    int specs = 0;
+    const char *p = ex_->range + 6;
+    while (true) {
+        while (*p == ' ' || *p == '\t' || *p == ',') {
+            ++p;
+        }
+        if (*p == '\0') {
+            break;
+        }
+        // first-last，first-，或者-suffix(最后suffix字节)
+        off_t first = *p == '-' ? -1 : parseOffset(&p);
+        if (*p != '-') {
+            ex_->range_count = 0;
+            return true;
+        }
+        ++p;
+        off_t last = *p >= '0' && *p <= '9' ? parseOffset(&p) : -2;
+        while (*p == ' ' || *p == '\t') {
+            ++p;
+        }
+        if (last == -1 || (first < 0 && last < 0) || (last >= 0 && first > last) || (*p != ',' && *p != '\0') ||
+            ++specs > MAX_RANGES) {
+            ex_->range_count = 0;
+            return true;
+        }
+
+        ByteRange range;
+        if (first < 0) {
+            range.first = last < size ? size - last : 0;
+            range.length = size - range.first;
+        } else {
+            range.first = first;
+            range.length = (last < 0 || last >= size ? size - 1 : last) - first + 1;
+        }
+        if (range.first < size && range.length > 0) {
+            ex_->ranges[ex_->range_count++] = range;
+        }
     }
+    return specs == 0 || ex_->range_count > 0;
 }
 
-// 往写缓冲中写入待发送的数据
-bool HttpConnection::addResponse(const char *format, ...) {
-    if (write_index_ >= WRITE_BUFFER_SIZE) {
+// ETag的最大长度：引号、三个64位十六进制数、编码后缀
+static const int ETAG_LEN = 64;
+
+// 解析IMF-fixdate格式的HTTP日期(Last-Modified中使用的格式)
+static bool parseHttpDate(const char *text, time_t *out) {
+    struct tm tm;
+    memset(&tm, 0, sizeof(tm));
+    const char *end = strptime(text, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+    if (!end || *end != '\0') {
         return false;
     }
+    *out = timegm(&tm);
+    return true;
+}
 
-    va_list arg_list;
-    va_start(arg_list, format);
+// If-Range的校验值和文件当前的版本一致时Range才生效，否则回复整个文件。实体标签用强比较，
+// 弱标签(W/开头)总是不匹配；日期要和修改时间相同
+bool HttpConnection::ifRangeMatches() const {
+    if (*ex_->if_range == '"') {
+        char etag[ETAG_LEN];
+        int len = formatETag(etag);
+        return strlen(ex_->if_range) == (size_t)len && memcmp(ex_->if_range, etag, len) == 0;
+    }
+    time_t date;
+    return parseHttpDate(ex_->if_range, &date) && date == ex_->file_state.st_mtime;
+}
 
-    int len = vsnprintf(write_buffer_ + write_index_, WRITE_BUFFER_SIZE - 1 - write_index_, format, arg_list);
-    if (len >= (WRITE_BUFFER_SIZE - 1 - write_index_)) {
+// 按RFC 9110判断条件请求：有If-None-Match时只看它，列表中有标签和当前的ETag弱比较相等(或者是*)时回复304；
+// 否则看If-Modified-Since，文件在这个日期之后没有修改过时回复304
+bool HttpConnection::notModified() const {
+    if (ex_->if_none_match) {
+        char etag[ETAG_LEN];
+        int len = formatETag(etag);
+        const char *p = ex_->if_none_match;
+        while (*p) {
+            while (*p == ' ' || *p == '\t' || *p == ',') {
+                ++p;
+            }
+            if (*p == '*') {
+                return true;
+            }
+            // 弱比较忽略W/前缀，标签中可以有逗号，以引号为界
+            if (p[0] == 'W' && p[1] == '/') {
+                p += 2;
+            }
+            if (*p != '"') {
+                return false;
+            }
+            const char *end = strchr(p + 1, '"');
+            if (!end) {
+                return false;
+            }
+            if (end + 1 - p == len && memcmp(p, etag, len) == 0) {
+                return true;
+            }
+            p = end + 1;
+        }
         return false;
     }
 
-    write_index_ += len;
-    va_end(arg_list);
+    time_t date;
+    return ex_->if_modified_since && parseHttpDate(ex_->if_modified_since, &date) && ex_->file_state.st_mtime <= date;
+}
 
-    return true;
+// 强ETag："inode-大小-修改时间(纳秒)"，十六进制。压缩的响应是另一种表示，加上编码作为后缀。
+// out至少要有ETAG_LEN字节，返回长度
+int HttpConnection::formatETag(char *out) const {
+    static const char HEX_DIGITS[] = "0123456789abcdef";
+    uint64_t fields[3] = {(uint64_t)ex_->file_state.st_ino, (uint64_t)ex_->file_state.st_size,
+                          (uint64_t)ex_->file_state.st_mtim.tv_sec * 1000000000 + ex_->file_state.st_mtim.tv_nsec};
+    int len = 0;
+    out[len++] = '"';
+    for (int i = 0; i < 3; ++i) {
+        if (i > 0) {
+            out[len++] = '-';
+        }
+        int digits = 1;
+        while (digits < 16 && (fields[i] >> (digits * 4)) != 0) {
+            ++digits;
+        }
+        for (int j = digits - 1; j >= 0; --j) {
+            out[len++] = HEX_DIGITS[(fields[i] >> (j * 4)) & 0xf];
+        }
+    }
+    if (ex_->content_encoding != Compressor::IDENTITY) {
+        const char *name = Compressor::name(ex_->content_encoding);
+        out[len++] = '-';
+        memcpy(out + len, name, strlen(name));
+        len += strlen(name);
+    }
+    out[len++] = '"';
+    return len;
 }
 
-bool HttpConnection::addContent(const char *content) { return addResponse("%s", content); }
+// 释放这一批响应的响应体占用的资源：对内存映射区执行munmap操作，或者关闭零拷贝发送的文件，
+// 来自文件缓存的则只释放缓存项的引用
+void HttpConnection::unmap() {
+    for (int i = 0; i < ex_->body_count; ++i) {
+        if (ex_->bodies[i].cache_entry) {
+            file_cache_->release(ex_->bodies[i].cache_entry);
+        }
+        if (ex_->bodies[i].compressed) {
+            compressor_->release(ex_->bodies[i].compressed);
+        }
+        if (ex_->bodies[i].content) {
+            delete ex_->bodies[i].content;
+        }
+        if (ex_->bodies[i].file_address) {
+            munmap(ex_->bodies[i].file_address, ex_->bodies[i].file_size);
+        }
+    }
+    ex_->body_count = 0;
+    ex_->streaming = false;
+    ex_->stream_address = NULL;
+    ex_->multipart = NULL;
+    if (ex_->window_address) {
+        munmap(ex_->window_address, ex_->window_size);
+        ex_->window_address = NULL;
+    }
 
-bool HttpConnection::addContentType() { return addResponse("Content-Type:%s\r\n", "text/html"); }
+    if (ex_->cache_entry) {
+        file_cache_->release(ex_->cache_entry);
+        ex_->cache_entry = NULL;
+        ex_->file_address = 0;
+        ex_->file_fd = -1;
+        return;
+    }
+    if (ex_->compressed) {
+        compressor_->release(ex_->compressed);
+        ex_->compressed = NULL;
+        ex_->file_address = 0;
+        return;
+    }
+    if (ex_->file_address) {
+        munmap(ex_->file_address, ex_->file_state.st_size);
+        ex_->file_address = 0;
+    }
+    if (ex_->file_fd != -1) {
+        close(ex_->file_fd);
+        ex_->file_fd = -1;
+    }
+}
+
+// 往写缓冲中追加正文，空间不够时返回false
+bool HttpConnection::addContent(const char *content) {
+    HeaderWriter writer(ex_->write_buffer, WRITE_BUFFER_SIZE, &ex_->write_index);
+    return writer.append(content, strlen(content));
+}
 
+bool HttpConnection::addContentType(const HeaderFragment &content_type) {
+    HeaderWriter writer(ex_->write_buffer, WRITE_BUFFER_SIZE, &ex_->write_index);
+    return writer.append(content_type);
+}
+
+// 常用的状态码直接使用编译期生成的整行，其他状态码再拼接
 bool HttpConnection::addStatusLine(int status, const char *title) {
-    return addResponse("%s %d %s\r\n", "HTTP/1.1", status, title);
+    HeaderWriter writer(ex_->write_buffer, WRITE_BUFFER_SIZE, &ex_->write_index);
+    switch (status) {
+        case 200:
+            return writer.append(STATUS_200);
+        case 206:
+            return writer.append(STATUS_206);
+        case 304:
+            return writer.append(STATUS_304);
+        case 400:
+            return writer.append(STATUS_400);
+        case 403:
+            return writer.append(STATUS_403);
+        case 404:
+            return writer.append(STATUS_404);
+        case 416:
+            return writer.append(STATUS_416);
+        case 500:
+            return writer.append(STATUS_500);
+        case 503:
+            return writer.append(STATUS_503);
+        default:
+            break;
+    }
+
+    int old_index = ex_->write_index;
+    if (!writer.append(HTTP_VERSION) || !writer.appendNumber(status) || !writer.append(" ", 1) ||
+        !writer.append(title, strlen(title)) || !writer.append(CRLF)) {
+        ex_->write_index = old_index;
+        return false;
+    }
+    return true;
+}
+
+bool HttpConnection::addHeaders(off_t content_len, const HeaderFragment &content_type) {
+    return addContentLength(content_len) && addContentType(content_type) && addIsLink() && addBlankLine();
 }
 
-bool HttpConnection::addHeaders(int content_len) {
-    addContentLength(content_len);
-    addContentType();
-    addIsLink();
-    addBlankLine();
+bool HttpConnection::addContentLength(off_t content_len) {
+    HeaderWriter writer(ex_->write_buffer, WRITE_BUFFER_SIZE, &ex_->write_index);
+    int old_index = ex_->write_index;
+    if (!writer.append(CONTENT_LENGTH) || !writer.appendNumber(content_len) || !writer.append(CRLF)) {
+        ex_->write_index = old_index;
+        return false;
+    }
+    return true;
 }
 
-bool HttpConnection::addContentLength(int content_len) { return addResponse("Content-Length: %d\r\n", content_len); }
+bool HttpConnection::addContentRange(const ByteRange *range) {
+    char content_range[CONTENT_RANGE_LEN];
+    int len = formatContentRange(range, ex_->file_state.st_size, content_range);
+    HeaderWriter writer(ex_->write_buffer, WRITE_BUFFER_SIZE, &ex_->write_index);
+    return writer.append(content_range, len);
+}
+
+// 文件响应和304的校验值(ETag和Last-Modified)和缓存策略
+bool HttpConnection::addValidators() {
+    char etag[ETAG_LEN];
+    int len = formatETag(etag);
+    HeaderWriter writer(ex_->write_buffer, WRITE_BUFFER_SIZE, &ex_->write_index);
+    int old_index = ex_->write_index;
+    if (!writer.append(ETAG) || !writer.append(etag, len) || !writer.append(CRLF) || !addLastModified() ||
+        (max_age_ > 0 ? !writer.append(CACHE_CONTROL_MAX_AGE) || !writer.appendNumber(max_age_) || !writer.append(CRLF)
+                      : !writer.append(CACHE_CONTROL_NO_CACHE))) {
+        ex_->write_index = old_index;
+        return false;
+    }
+    return true;
+}
+
+// 文件的修改时间，If-Modified-Since和If-Range用它作为校验值
+bool HttpConnection::addLastModified() {
+    char date[32];
+    struct tm tm;
+    gmtime_r(&ex_->file_state.st_mtime, &tm);
+    size_t len = strftime(date, sizeof(date), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+    HeaderWriter writer(ex_->write_buffer, WRITE_BUFFER_SIZE, &ex_->write_index);
+    int old_index = ex_->write_index;
+    if (!writer.append(LAST_MODIFIED) || !writer.append(date, len) || !writer.append(CRLF)) {
+        ex_->write_index = old_index;
+        return false;
+    }
+    return true;
+}
+
+// 可能压缩发送的文件，响应随Accept-Encoding变化
+bool HttpConnection::addVary() {
+    HeaderWriter writer(ex_->write_buffer, WRITE_BUFFER_SIZE, &ex_->write_index);
+    return !ex_->vary || writer.append(VARY_ACCEPT_ENCODING);
+}
 
 bool HttpConnection::addIsLink() {
-    return addResponse("Connection: %s\r\n", (is_link_ == true) ? "keep-alive" : "close");
+    HeaderWriter writer(ex_->write_buffer, WRITE_BUFFER_SIZE, &ex_->write_index);
+    return writer.append(ex_->is_link ? CONNECTION_KEEP_ALIVE : CONNECTION_CLOSE);
 }
 
-bool HttpConnection::addBlankLine() { return addResponse("%s", "\r\n"); }
\ No newline at end of file
+bool HttpConnection::addRetryAfter() {
+    HeaderWriter writer(ex_->write_buffer, WRITE_BUFFER_SIZE, &ex_->write_index);
+    return writer.append(RETRY_AFTER);
+}
+
+bool HttpConnection::addBlankLine() {
+    HeaderWriter writer(ex_->write_buffer, WRITE_BUFFER_SIZE, &ex_->write_index);
+    return writer.append(CRLF);
+}
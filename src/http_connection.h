@@ -8,6 +8,7 @@
 #include <signal.h>
 #include <sys/epoll.h>
 #include <sys/mman.h>
+#include <sys/sendfile.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -16,18 +17,38 @@
 
 #include <cassert>
 #include <cerrno>
-#include <cstdarg>
 #include <cstdio>
 #include <cstdlib>
+#include <atomic>
 #include <cstring>
 
+#include "buffer_pool.h"
+#include "compressor.h"
+#include "file_cache.h"
+#include "header_writer.h"
 #include "locker.h"
+#include "metrics.h"
+#include "mime_types.h"
+#include "object_pool.h"
+#include "request_parser.h"
+#include "timer_wheel.h"
 
-class HttpConnection {
+class EventLoop;
+
+// 一个客户端连接。连接数组以fd为下标，每个元素按缓存行对齐，只有常驻的状态，
+// 处理请求需要的大块状态在Exchange中，只有正在处理请求的连接才持有
+class alignas(64) HttpConnection {
    public:
     static const int FILENAME_LEN = 200;        // 文件名的最大长度
-    static const int READ_BUFFER_SIZE = 2048;   // 读缓冲区的大小
-    static const int WRITE_BUFFER_SIZE = 1024;  // 写缓冲区的大小
+    static const int READ_BUFFER_SIZE = 2048;   // 读缓冲区的初始大小，不够时逐级扩大到缓冲区池的上限
+    static const int WRITE_BUFFER_SIZE = 2048;  // 写缓冲区的大小
+    static const int MAX_PIPELINE = 16;         // 一批最多合并发送的流水线请求的响应数
+    static const int MAX_RESPONSE_HEADER = 512;  // 一个响应在写缓冲中最多占用的空间(响应头以及错误页面)
+    static const int MAX_RANGES = 8;             // 一个Range请求最多的范围数，更多时忽略Range，回复整个文件
+    static constexpr off_t STREAM_WINDOW = 1 << 20;  // mmap策略下大于它的文件分段映射，每次映射的大小
+    static const int DRAIN_GRACE_MS = 1000;      // 排空时还没有发来请求的新连接最多再等待的毫秒数
+    static const int VARIANT_RECHECK_MS = 1000;  // 文件缓存中记录的预压缩文件不存在，多久之后重新查找
+    static constexpr const char *STATS_URL = "/__stats";  // 保留的URL，返回Prometheus文本格式的运行时指标
 
     // HTTP请求方法，这里只支持GET
     enum METHOD { GET = 0, POST, HEAD, PUT, DELETE, TRACE, OPTIONS, CONNECT };
@@ -47,86 +68,246 @@ class HttpConnection {
         NO_RESOURCE,        // 表示服务器没有资源
         FORBIDDEN_REQUEST,  // 表示客户对资源没有足够的访问权限
         FILE_REQUEST,       // 文件请求,获取文件成功
+        NOT_MODIFIED,       // 条件请求的校验值和文件一致，回复304，不发送文件
+        STATS_REQUEST,      // 请求运行时指标
+        RANGE_NOT_SATISFIABLE,  // Range请求的范围都超出了文件
+        SERVICE_UNAVAILABLE,  // 线程池过载，拒绝请求
         INTERNAL_ERROR,     // 表示服务器内部错误
         CLOSED_CONNECTION   // 表示客户端已经关闭连接了
     };
 
-    // 从状态机的三种可能状态，即行的读取状态
-    enum LINE_STATUS {
-        LINE_OK = 0,  // 读取到一个完整的行
-        LINE_BAD,     // 行出错
-        LINE_OPEN     // 行数据尚且不完整
+    // 静态文件响应体的发送策略
+    enum FILE_STRATEGY {
+        MMAP = 0,  // mmap映射文件，和响应头一起writev
+        SENDFILE,  // sendfile从页缓存直接发往socket
+        SPLICE     // splice经过管道发往socket
+    };
+
+    // 连接读写的I/O后端，启动时选定，所有连接相同
+    enum IO_BACKEND {
+        EPOLL = 0,  // 就绪通知：epoll告诉loop可读可写，由read/write自己调用recv/sendmsg
+        URING       // 完成通知：loop通过io_uring收发数据，把结果交给receive/sent
+    };
+
+    // io_uring后端下，连接处理完一次I/O之后等待的下一件事，由loop据此提交请求
+    enum IO_WAIT {
+        WAIT_READ = 0,  // 等待下一个请求的数据
+        WAIT_WRITE,     // 有响应要发送
+        WAIT_CLOSE      // 要关闭连接
+    };
+
+    // 已经排队等待发送的响应的响应体所占用的资源，整批发送完毕后释放
+    struct ResponseBody {
+        FileCache::Entry *cache_entry;  // 来自文件缓存时持有的缓存项
+        Compressor::Entry *compressed;  // 来自压缩缓存时持有的缓存项
+        char *file_address;             // 不经过缓存时mmap得到的映射
+        off_t file_size;                // 映射的大小
+        std::string *content;           // 动态生成的响应体，比如运行时指标、多个范围的分隔行
+    };
+
+    // 文件中的一段字节，Range请求的一个范围
+    struct ByteRange {
+        off_t first;   // 第一个字节的位置
+        off_t length;  // 字节数，不为0
+    };
+
+    // 连接处理请求期间才需要的状态：读写缓冲、请求的解析结果、这一批响应以及流式发送的进度。连接读到数据时
+    // 从exchange_pool_租用，变为空闲时归还，空闲的长连接只占用HttpConnection本身。归还时不析构，
+    // splice策略的管道留在对象中给下一个连接复用
+    struct Exchange {
+        Exchange();
+        ~Exchange();
+
+        char *read_buffer;     // 读缓冲区，从缓冲区池租用，连接空闲时归还
+        size_t read_capacity;  // 读缓冲区的大小
+        int read_index;        // 标识读缓冲区中已经读入的客户端数据的最后一个字节的下一个位置
+        int checked_index;     // 请求体在读缓冲区中的起始位置
+        RequestParser parser;  // 请求行和请求头的解析器
+
+        CHECK_STATE check_state;  // 主状态机当前所处的状态
+        METHOD method;            // 请求方法
+
+        char *url;                // 客户请求的目标文件的文件名
+        char *version;            // HTTP协议版本号，我们仅支持HTTP1.1
+        char *host;               // 主机名
+        char *range;              // Range请求头的值，没有时为NULL
+        char *if_range;           // If-Range请求头的值
+        char *if_none_match;      // If-None-Match请求头的值
+        char *if_modified_since;  // If-Modified-Since请求头的值
+        int accept_encoding;      // 客户端接受的内容编码，见Compressor::parseAcceptEncoding
+        int content_length;       // HTTP请求的消息体长度，不超过读缓冲的上限
+        bool is_link;             // HTTP请求是否要求保持连接
+        bool keep_alive;          // 这一批响应发送完毕后是否保持连接，取决于最后一个响应
+        int status;               // 最近一个响应的状态码
+
+        char *write_buffer;  // 写缓冲区，依次存放这一批每个响应的响应头，生成响应时从缓冲区池租用
+        int write_index;     // 写缓冲区中待发送的字节数
+        char *file_address;  // 客户请求的目标文件被mmap到内存中的起始位置
+        struct stat
+            file_state;  // 目标文件的状态。通过它我们可以判断文件是否存在、是否为目录、是否可读，并获取文件大小等信息
+        struct iovec io_vec[2 * MAX_PIPELINE + 1];  // 这一批响应的响应头和响应体，用一次sendmsg聚集写
+        int io_vec_count;                           // 被写内存块的数量
+        int io_vec_index;                           // 第一个没有发送完的内存块
+        struct msghdr message;                      // io_uring后端下正在进行的sendmsg的参数，完成之前不能改动
+
+        ResponseBody bodies[MAX_PIPELINE];  // 已经排队的响应的响应体资源
+        int body_count;
+        int response_count;  // 这一批中已经排队的响应数
+
+        FileCache::Entry *cache_entry;          // 响应体来自文件缓存时持有的缓存项
+        Compressor::Entry *compressed;          // 响应体来自压缩缓存时持有的缓存项
+        Compressor::ENCODING content_encoding;  // 最近一个文件请求的响应体的内容编码
+        const MimeTypes::Type *content_type;    // 最近一个文件请求的Content-Type
+        bool vary;                              // 响应是否随Accept-Encoding变化，需要带Vary
+
+        // 流式发送的响应体：零拷贝策略下的文件，mmap策略下分段映射的大文件，或者多个范围。这样的响应只能是一批中的
+        // 最后一个，发送的过程中逐段加入io_vec
+        int file_fd;        // 流式发送的目标文件，响应体在内存中时为-1
+        off_t file_offset;  // 文件中下一个要发送(零拷贝)或者映射(mmap)的字节的位置
+        int pipe_fd[2];     // splice策略使用的管道，第一次使用时创建，随对象复用
+        size_t pipe_bytes;  // 已经splice进管道、还没有写入socket的字节数
+
+        ByteRange ranges[MAX_RANGES];        // 最近一个文件请求要发送的范围，回复整个文件时是一个覆盖全文的范围
+        int range_count;                     // 范围数，doRequest中为0表示没有有效的Range
+        size_t part_header[MAX_RANGES + 1];  // 多个范围时每个范围的分隔行在multipart中的起始位置，最后是结束行
+        bool streaming;                      // 这一批的最后一个响应是否流式发送
+        const char *stream_address;          // 流式发送在内存中的响应体，由这一批的bodies持有，否则为NULL
+        std::string *multipart;              // 多个范围时的分隔行，由这一批的bodies持有
+        int stream_part;                     // 流式发送中正在发送的范围
+        off_t stream_remaining;              // 这个范围中还没有映射或者零拷贝发送的字节数
+        char *window_address;                // mmap策略下当前映射的窗口
+        size_t window_size;
+
+        off_t bytes_to_send;    // 将要发送的数据的字节数，包括流式发送的响应体还没有加入io_vec的部分
+        off_t bytes_have_send;  // 已经发送的字节数
     };
 
    public:
-    HttpConnection() {}
+    HttpConnection()
+        : sockfd_(-1),
+          epollfd_(-1),
+          loop_(NULL),
+          ex_(NULL),
+          worker_(-1),
+          io_wait_(WAIT_READ),
+          idle_(false),
+          fresh_(false),
+          queued_at_(0),
+          request_deadline_(TimerNode::NO_DEADLINE) {}
     ~HttpConnection() {}
 
    public:
-    void init(int sockfd, const sockaddr_in &addr);  // 初始化新接受的连接
-    void closeConnection();                          // 关闭连接
-    void process();                                  // 处理客户端请求
-    bool read();                                     // 非阻塞读
-    bool write();                                    // 非阻塞写
+    void init(int sockfd, const sockaddr_in &addr, EventLoop *loop);  // 初始化新接受的连接
+    void closeConnection();                                           // 关闭连接
+    void process();                                                   // 处理客户端请求
+    bool read();                                                      // 非阻塞读
+    bool write();                                                     // 非阻塞写
+    bool closeIfIdle();                                               // 排空时关闭空闲的连接
+    bool idle() const { return idle_; }  // 连接是否空闲，read没有读到数据时仍然空闲，不用交给process
+    bool reject();                                                    // 线程池过载时回复503
+
+    // 下面这一组函数由io_uring后端在loop线程中调用，代替read和write
+    bool receive(const char *data, size_t len);  // recv收到的数据追加到读缓冲，装不下时返回false
+    struct msghdr *sendMessage();                 // 还没有发送完的响应，提交给sendmsg
+    bool sent(size_t len);                        // sendmsg完成，返回false时关闭连接
+    IO_WAIT ioWait() const { return io_wait_; }
+    // 这一批响应发送完之后是否接着等待下一个请求，是的话loop把recv链接在sendmsg之后一起提交
+    bool readAfterWrite() const { return ex_->keep_alive && ex_->read_index == 0; }
+
+    int worker() const { return worker_; }  // 上一次处理这个连接的工作线程，供工作窃取线程池使用
+    void setWorker(int id) { worker_ = id; }
+    void queued() { queued_at_ = Metrics::now(); }  // loop把连接交给线程池时调用，统计在队列中等待的时间
 
    private:
     void init();                       // 初始化连接
-    HTTP_CODE processRead();           // 解析HTTP请求
+    void initRequest();                // 开始解析下一个请求
+    void initResponses();              // 一批响应发送完毕，开始生成下一批
+    void consumeRequest();             // 从读缓冲中移除处理完的请求
+    bool growReadBuffer();             // 读缓冲写满时扩大一级
+    bool acquireExchange();            // 开始处理请求时租用Exchange和读缓冲
+    void releaseExchange();            // 把读写缓冲和Exchange归还给池
+    void suspendTimer();               // 交给process处理之前暂停超时
+    void armTimer(uint64_t deadline);  // 设置连接的超时时刻
+    void abortConnection();            // 在工作线程中放弃连接，交给loop线程关闭
+    void waitRead();                   // 等待读：epoll后端重新注册EPOLLIN，io_uring后端记下来由loop提交recv
+    void waitWrite();                  // 等待写
+    void advanceIovec(size_t len);     // 跳过已经发送的len字节
+    HTTP_CODE processRead();           // 解析HTTP请求并查找目标文件
     bool processWrite(HTTP_CODE ret);  // 填充HTTP应答
+    void logAccess(off_t bytes, uint64_t duration_ns);  // 写一行访问日志
 
     // 下面这一组函数被process_read调用以分析HTTP请求
-    HTTP_CODE parseRequestLine(char *text);
-    HTTP_CODE parseHeaders(char *text);
-    HTTP_CODE parseContent(char *text);
+    HTTP_CODE parseRequest();
+    HTTP_CODE parseRequestLine();
+    HTTP_CODE parseHeaders();
+    HTTP_CODE parseContent();
     HTTP_CODE doRequest();
-    char *getLine() { return read_buffer_ + start_line_; }
-    LINE_STATUS parseLine();
+    bool selectEncoding(char *real_file);
+    bool selectRanges();
+    bool ifRangeMatches() const;
+    bool notModified() const;
+    int formatETag(char *out) const;
 
     // 这一组函数被process_write调用以填充HTTP应答。
     void unmap();
-    bool addResponse(const char *format, ...);
+    bool streamPending() const;
+    bool nextChunk();
+    ssize_t writeFile();
+    ssize_t spliceFile();
+    bool finishWrite();
+    void appendIovec(const char *base, size_t len);
+    void pushIovec(const char *base, size_t len);
+    bool addFileResponse();
+    bool addFileHeaders(bool partial, off_t content_length, const char *boundary);
+    bool addCachedResponse();
+    bool addStats();
     bool addContent(const char *content);
-    bool addContentType();
+    bool addContentType(const HeaderFragment &content_type);
     bool addStatusLine(int status, const char *title);
-    bool addHeaders(int content_length);
-    bool addContentLength(int content_length);
+    bool addHeaders(off_t content_length, const HeaderFragment &content_type = CONTENT_TYPE_HTML);
+    bool addContentLength(off_t content_length);
+    bool addContentRange(const ByteRange *range);
+    bool addValidators();
+    bool addLastModified();
+    bool addVary();
     bool addIsLink();
+    bool addRetryAfter();
     bool addBlankLine();
 
    public:
-    static int epollfd_;  // 所有socket上的事件都被注册到同一个epoll内核事件中，所以设置成静态的
-    static int user_count_;  // 统计用户的数量
+    static std::atomic<int> user_count_;  // 统计用户的数量，会被多个loop线程和工作线程同时修改
+    static FILE_STRATEGY file_strategy_;  // 静态文件响应体的发送策略
+    static FileCache *file_cache_;        // 静态文件缓存，为空表示不使用缓存
+    static Compressor *compressor_;       // 响应体的压缩，为空表示不压缩
+    static BufferPool *buffer_pool_;      // 读写缓冲区池，所有连接共享
+    static ObjectPool<Exchange> *exchange_pool_;  // 正在处理请求的连接租用的Exchange，所有连接共享
+    static IO_BACKEND io_backend_;        // 读写的I/O后端
+    static int max_age_;                  // 文件响应的Cache-Control: max-age，0表示no-cache(每次都要验证)
+    static size_t io_budget_;             // epoll后端下一次事件中一个连接最多读或写的字节数，0表示不限制
+    // 下面几项收到SIGHUP时可能被重新加载配置的线程修改，新的值对之后设置的超时和处理的请求生效
+    static std::atomic<int> idle_timeout_;    // 长连接等待下一个请求的超时，单位毫秒，0表示不限制
+    static std::atomic<int> header_timeout_;  // 从收到请求的第一个字节到请求头接收完整的超时
+    static std::atomic<int> write_timeout_;   // 发送响应时两次写入之间的超时
+    static void setDocRoot(const char *doc_root);  // 设置网站的根目录
 
    private:
-    int sockfd_;  // 该HTTP连接的socket和对方的socket地址
-    sockaddr_in address_;
-
-    char read_buffer_[READ_BUFFER_SIZE];  // 读缓冲区
-    int read_index_;     // 标识读缓冲区中已经读入的客户端数据的最后一个字节的下一个位置
-    int checked_index_;  // 当前正在分析的字符在读缓冲区中的位置
-    int start_line_;     // 当前正在解析的行的起始位置
-
-    CHECK_STATE check_state_;  // 主状态机当前所处的状态
-    METHOD method_;            // 请求方法
-
-    char real_file_[FILENAME_LEN];  // 客户请求的目标文件的完整路径，其内容等于 doc_root + m_url, doc_root是网站根目录
-    char *url_;           // 客户请求的目标文件的文件名
-    char *version_;       // HTTP协议版本号，我们仅支持HTTP1.1
-    char *host_;          // 主机名
-    int content_length_;  // HTTP请求的消息总长度
-    bool is_link_;        // HTTP请求是否要求保持连接
-
-    char write_buffer_[WRITE_BUFFER_SIZE];  // 写缓冲区
-    int write_index_;                       // 写缓冲区中待发送的字节数
-    char *file_address_;                    // 客户请求的目标文件被mmap到内存中的起始位置
-    struct stat
-        file_state_;  // 目标文件的状态。通过它我们可以判断文件是否存在、是否为目录、是否可读，并获取文件大小等信息
-    struct iovec
-        io_vec_[2];  // 我们将采用writev来执行写操作，所以定义下面两个成员，其中m_iv_count表示被写内存块的数量。
-    int io_vec_count_;
-
-    int bytes_to_send_;    // 将要发送的数据的字节数
-    int bytes_have_send_;  // 已经发送的字节数
+    static std::atomic<const char *> doc_root_;  // 网站的根目录
+
+   private:
+    // 下面是每个连接常驻的状态，每个事件都会访问，放在一起；对方的地址只在写访问日志时使用，放在最后
+    int sockfd_;          // 该HTTP连接的socket
+    int epollfd_;         // 连接所属loop的epoll实例，每个loop各自一个
+    EventLoop *loop_;     // 连接所属的loop
+    Exchange *ex_;        // 正在处理请求时租用的状态，空闲时为NULL
+    int worker_;          // 上一次处理这个连接的工作线程编号，没有时为-1
+    IO_WAIT io_wait_;     // io_uring后端下等待的下一件事
+    bool idle_;           // 只由loop线程修改：变为空闲时置位，读到数据交给process时清除
+    bool fresh_;          // 新连接还没有读到过数据
+    uint64_t queued_at_;  // 交给线程池的时刻(纳秒)，不经过线程池时为0
+
+    uint64_t request_deadline_;  // 当前请求的请求头必须在这个时刻之前接收完整
+    TimerNode timer_;            // 连接在所属loop的时间轮中的定时器
+    sockaddr_in address_;        // 对方的socket地址
 };
 
 #endif
@@ -0,0 +1,189 @@
+#include "io_uring.h"
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+#include <exception>
+#include <new>
+
+IoUring::IoUring(unsigned entries)
+    : ring_fd_(-1),
+      sq_ring_(MAP_FAILED),
+      sq_ring_size_(0),
+      sqes_((struct io_uring_sqe *)MAP_FAILED),
+      sqes_size_(0),
+      sqe_tail_(0),
+      buf_ring_((struct io_uring_buf_ring *)MAP_FAILED),
+      buf_ring_size_(0),
+      buffers_(NULL),
+      buffer_count_(0),
+      buffer_size_(0) {
+    // 完成事件只在loop线程进入io_uring_enter等待时处理，内核不用为每个完成事件打断loop线程
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN | IORING_SETUP_SINGLE_ISSUER |
+                   IORING_SETUP_DEFER_TASKRUN;
+    ring_fd_ = syscall(__NR_io_uring_setup, entries, &params);
+    if (ring_fd_ < 0 && errno == EINVAL) {
+        // 较老的内核不认识这些标志
+        memset(&params, 0, sizeof(params));
+        ring_fd_ = syscall(__NR_io_uring_setup, entries, &params);
+    }
+    if (ring_fd_ < 0) {
+        throw std::exception();
+    }
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_EXT_ARG)) {
+        close(ring_fd_);
+        throw std::exception();
+    }
+
+    sq_ring_size_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (cq_ring_size > sq_ring_size_) {
+        sq_ring_size_ = cq_ring_size;
+    }
+    sq_ring_ = mmap(0, sq_ring_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQ_RING);
+    sqes_size_ = params.sq_entries * sizeof(struct io_uring_sqe);
+    sqes_ = (struct io_uring_sqe *)mmap(0, sqes_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd_,
+                                        IORING_OFF_SQES);
+    if (sq_ring_ == MAP_FAILED || sqes_ == MAP_FAILED) {
+        if (sq_ring_ != MAP_FAILED) {
+            munmap(sq_ring_, sq_ring_size_);
+        }
+        if (sqes_ != MAP_FAILED) {
+            munmap(sqes_, sqes_size_);
+        }
+        close(ring_fd_);
+        throw std::exception();
+    }
+
+    char *ring = (char *)sq_ring_;
+    sq_head_ = (unsigned *)(ring + params.sq_off.head);
+    sq_tail_ = (unsigned *)(ring + params.sq_off.tail);
+    sq_mask_ = *(unsigned *)(ring + params.sq_off.ring_mask);
+    sq_entries_ = params.sq_entries;
+    sqe_tail_ = *sq_tail_;
+    unsigned *array = (unsigned *)(ring + params.sq_off.array);
+    for (unsigned i = 0; i < sq_entries_; ++i) {
+        array[i] = i;
+    }
+
+    cq_head_ = (unsigned *)(ring + params.cq_off.head);
+    cq_tail_ = (unsigned *)(ring + params.cq_off.tail);
+    cq_mask_ = *(unsigned *)(ring + params.cq_off.ring_mask);
+    cqes_ = (struct io_uring_cqe *)(ring + params.cq_off.cqes);
+}
+
+// 关闭ring_fd_时内核取消所有未完成的请求，注册的缓冲区也随之注销
+IoUring::~IoUring() {
+    if (buf_ring_ != MAP_FAILED) {
+        munmap(buf_ring_, buf_ring_size_);
+    }
+    delete[] buffers_;
+    if (sqes_ != MAP_FAILED) {
+        munmap(sqes_, sqes_size_);
+    }
+    if (sq_ring_ != MAP_FAILED) {
+        munmap(sq_ring_, sq_ring_size_);
+    }
+    close(ring_fd_);
+}
+
+int IoUring::enter(unsigned to_submit, unsigned wait_nr, unsigned flags, const void *arg, size_t arg_size) {
+    return syscall(__NR_io_uring_enter, ring_fd_, to_submit, wait_nr, flags, arg, arg_size);
+}
+
+struct io_uring_sqe *IoUring::getSqe() {
+    if (sqe_tail_ - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE) == sq_entries_) {
+        __atomic_store_n(sq_tail_, sqe_tail_, __ATOMIC_RELEASE);
+        enter(sq_entries_, 0, 0, NULL, 0);
+    }
+    struct io_uring_sqe *sqe = &sqes_[sqe_tail_ & sq_mask_];
+    memset(sqe, 0, sizeof(*sqe));
+    ++sqe_tail_;
+    return sqe;
+}
+
+// 提交和等待合并成一次io_uring_enter
+int IoUring::submitAndWait(unsigned wait_nr, int timeout) {
+    __atomic_store_n(sq_tail_, sqe_tail_, __ATOMIC_RELEASE);
+    unsigned to_submit = sqe_tail_ - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE);
+
+    struct __kernel_timespec ts;
+    struct io_uring_getevents_arg arg;
+    memset(&arg, 0, sizeof(arg));
+    unsigned flags = IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+    if (timeout >= 0) {
+        ts.tv_sec = timeout / 1000;
+        ts.tv_nsec = (long long)(timeout % 1000) * 1000000;
+        arg.ts = (uint64_t)(uintptr_t)&ts;
+    }
+
+    int ret = enter(to_submit, wait_nr, flags, &arg, sizeof(arg));
+    if (ret < 0 && (errno == ETIME || errno == EINTR)) {
+        return 0;
+    }
+    return ret;
+}
+
+struct io_uring_cqe *IoUring::peekCqe() {
+    unsigned head = *cq_head_;
+    if (head == __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+    return &cqes_[head & cq_mask_];
+}
+
+void IoUring::cqeSeen() { __atomic_store_n(cq_head_, *cq_head_ + 1, __ATOMIC_RELEASE); }
+
+bool IoUring::setupBuffers(int group, unsigned count, unsigned size) {
+    buf_ring_size_ = count * sizeof(struct io_uring_buf);
+    buf_ring_ = (struct io_uring_buf_ring *)mmap(NULL, buf_ring_size_, PROT_READ | PROT_WRITE,
+                                                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (buf_ring_ == MAP_FAILED) {
+        return false;
+    }
+    buffers_ = new (std::nothrow) char[(size_t)count * size];
+    if (!buffers_) {
+        return false;
+    }
+    buffer_count_ = count;
+    buffer_size_ = size;
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)buf_ring_;
+    reg.ring_entries = count;
+    reg.bgid = group;
+    if (syscall(__NR_io_uring_register, ring_fd_, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        return false;
+    }
+    for (unsigned bid = 0; bid < count; ++bid) {
+        recycleBuffer(bid);
+    }
+    return true;
+}
+
+// 环的tail和第0项的resv字段重叠，填写时不能碰resv。头文件中的bufs是柔性数组成员，在C++中
+// 它前面多出一个空结构体，偏移不对，直接把环当作io_uring_buf数组
+void IoUring::recycleBuffer(unsigned bid) {
+    unsigned short tail = buf_ring_->tail;
+    struct io_uring_buf *buf = (struct io_uring_buf *)buf_ring_ + (tail & (buffer_count_ - 1));
+    buf->addr = (uint64_t)(uintptr_t)buffer(bid);
+    buf->len = buffer_size_;
+    buf->bid = bid;
+    __atomic_store_n(&buf_ring_->tail, (unsigned short)(tail + 1), __ATOMIC_RELEASE);
+}
+
+// 多次accept和provided buffer ring都是5.19加入的，能注册buffer ring就说明两者都支持
+bool IoUring::supported() {
+    try {
+        IoUring ring(4);
+        return ring.setupBuffers(0, 1, 64);
+    } catch (...) {
+        return false;
+    }
+}
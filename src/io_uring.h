@@ -0,0 +1,70 @@
+#ifndef IOURING_H
+#define IOURING_H
+
+#include <linux/io_uring.h>
+
+#include <cstddef>
+#include <cstdint>
+
+// io_uring的最小封装，直接使用io_uring_setup/io_uring_enter/io_uring_register系统调用并自己映射
+// 提交队列(SQ)和完成队列(CQ)，不依赖liburing。一个实例只能在一个线程中使用：创建它的线程
+// 就是唯一向它提交请求的线程(IORING_SETUP_SINGLE_ISSUER)，所以要在loop线程中创建。
+// 还可以注册一组提供给recv的缓冲区(provided buffer ring)：recv请求不带缓冲区，数据到达时内核
+// 从这组缓冲区中取一个，等待数据的连接不需要各自占用一块缓冲区
+class IoUring {
+   public:
+    // entries是提交队列的大小，完成队列是它的两倍。失败时抛出std::exception
+    explicit IoUring(unsigned entries);
+    ~IoUring();
+
+   public:
+    // 取一个清零的SQE，提交队列已满时先把已有的提交给内核
+    struct io_uring_sqe *getSqe();
+    // 提交所有SQE并等待至少wait_nr个完成事件，最多等待timeout毫秒，timeout < 0时不限。
+    // 超时、被信号打断时返回0，其他错误返回-1
+    int submitAndWait(unsigned wait_nr, int timeout);
+    // 下一个完成事件，没有时返回NULL。处理完之后调用cqeSeen
+    struct io_uring_cqe *peekCqe();
+    void cqeSeen();
+
+    // 注册count个(2的幂)大小为size的缓冲区，作为第group组提供给带IOSQE_BUFFER_SELECT的recv
+    bool setupBuffers(int group, unsigned count, unsigned size);
+    char *buffer(unsigned bid) { return buffers_ + (size_t)bid * buffer_size_; }
+    // recv用完的缓冲区还给内核
+    void recycleBuffer(unsigned bid);
+
+    // 内核是否支持这里用到的功能：多次accept、provided buffer ring和带超时的io_uring_enter
+    static bool supported();
+
+   private:
+    int enter(unsigned to_submit, unsigned wait_nr, unsigned flags, const void *arg, size_t arg_size);
+
+   private:
+    int ring_fd_;
+
+    // 提交队列，它的索引数组在创建时填成恒等映射，SQE按顺序使用
+    void *sq_ring_;
+    size_t sq_ring_size_;
+    unsigned *sq_head_;  // 内核已经取走的SQE
+    unsigned *sq_tail_;
+    unsigned sq_mask_;
+    unsigned sq_entries_;
+    struct io_uring_sqe *sqes_;
+    size_t sqes_size_;
+    unsigned sqe_tail_;  // 已经填好的SQE之后的位置，提交时才写回sq_tail_
+
+    // 完成队列，和提交队列共用一次映射(IORING_FEAT_SINGLE_MMAP)
+    unsigned *cq_head_;
+    unsigned *cq_tail_;
+    unsigned cq_mask_;
+    struct io_uring_cqe *cqes_;
+
+    // provided buffer ring
+    struct io_uring_buf_ring *buf_ring_;
+    size_t buf_ring_size_;
+    char *buffers_;
+    unsigned buffer_count_;
+    unsigned buffer_size_;
+};
+
+#endif
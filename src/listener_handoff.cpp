@@ -0,0 +1,166 @@
+#include "listener_handoff.h"
+
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+
+#include "log.h"
+
+ListenerHandoff::ListenerHandoff(const char *path) : path_(path), listenfd_(-1), predecessor_(-1) {}
+
+// 进程退出后path上的socket文件会留下来，下一次启动时connect得到ECONNREFUSED，当作没有旧进程处理，
+// listen时再删除重建
+ListenerHandoff::~ListenerHandoff() {
+    if (listenfd_ != -1) {
+        close(listenfd_);
+    }
+    if (predecessor_ != -1) {
+        close(predecessor_);
+    }
+}
+
+static bool makeAddress(const char *path, struct sockaddr_un *address) {
+    memset(address, 0, sizeof(*address));
+    address->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(address->sun_path)) {
+        LOG_ERROR("handoff path too long: %s", path);
+        return false;
+    }
+    strcpy(address->sun_path, path);
+    return true;
+}
+
+bool ListenerHandoff::takeOver(std::vector<int> *listeners) {
+    struct sockaddr_un address;
+    if (!makeAddress(path_, &address)) {
+        return false;
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return false;
+    }
+    if (connect(fd, (struct sockaddr *)&address, sizeof(address)) < 0) {
+        close(fd);
+        // 没有旧进程在运行
+        return errno == ENOENT || errno == ECONNREFUSED;
+    }
+
+    // 数据部分是监听socket的个数，描述符在控制消息中
+    int count = 0;
+    struct iovec iov = {&count, sizeof(count)};
+    char control[CMSG_SPACE(MAX_LISTENERS * sizeof(int))];
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    ssize_t len = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+    if (len != sizeof(count) || (msg.msg_flags & MSG_CTRUNC)) {
+        close(fd);
+        return false;
+    }
+    size_t first = listeners->size();
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            int number = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            int *fds = (int *)CMSG_DATA(cmsg);
+            listeners->insert(listeners->end(), fds, fds + number);
+        }
+    }
+    if ((int)(listeners->size() - first) != count) {
+        for (size_t i = first; i < listeners->size(); ++i) {
+            close((*listeners)[i]);
+        }
+        listeners->resize(first);
+        close(fd);
+        return false;
+    }
+
+    predecessor_ = fd;
+    return true;
+}
+
+void ListenerHandoff::confirm() {
+    if (predecessor_ == -1) {
+        return;
+    }
+    char ack = 1;
+    ::write(predecessor_, &ack, 1);
+    close(predecessor_);
+    predecessor_ = -1;
+}
+
+bool ListenerHandoff::listen() {
+    struct sockaddr_un address;
+    if (!makeAddress(path_, &address)) {
+        return false;
+    }
+    listenfd_ = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listenfd_ < 0) {
+        return false;
+    }
+    // 旧进程的socket文件已经没有用了
+    unlink(path_);
+    if (bind(listenfd_, (struct sockaddr *)&address, sizeof(address)) < 0 || ::listen(listenfd_, 1) < 0) {
+        LOG_ERROR("listen on %s failed, errno is: %d", path_, errno);
+        close(listenfd_);
+        listenfd_ = -1;
+        return false;
+    }
+    return true;
+}
+
+bool ListenerHandoff::serve(const std::vector<int> &listeners) {
+    while (true) {
+        int connfd = accept4(listenfd_, NULL, NULL, SOCK_CLOEXEC);
+        if (connfd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            return false;
+        }
+
+        // 新进程在超时之内没有确认就当作接管失败，继续等待下一个
+        struct timeval timeout = {30, 0};
+        setsockopt(connfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+        char ack = 0;
+        bool confirmed = sendListeners(connfd, listeners) && recv(connfd, &ack, 1, 0) == 1 && ack == 1;
+        close(connfd);
+        if (confirmed) {
+            return true;
+        }
+        LOG_ERROR("listener handoff failed");
+    }
+}
+
+bool ListenerHandoff::sendListeners(int connfd, const std::vector<int> &listeners) {
+    int count = listeners.size();
+    if (count > MAX_LISTENERS) {
+        return false;
+    }
+    struct iovec iov = {&count, sizeof(count)};
+    char control[CMSG_SPACE(MAX_LISTENERS * sizeof(int))];
+    memset(control, 0, sizeof(control));
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = CMSG_SPACE(count * sizeof(int));
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(count * sizeof(int));
+    memcpy(CMSG_DATA(cmsg), listeners.data(), count * sizeof(int));
+
+    return sendmsg(connfd, &msg, MSG_NOSIGNAL) == sizeof(count);
+}
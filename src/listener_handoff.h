@@ -0,0 +1,37 @@
+#ifndef LISTENERHANDOFF_H
+#define LISTENERHANDOFF_H
+
+#include <vector>
+
+// 热重启时在新旧两个进程之间交接监听socket。正在运行的进程在一个Unix域socket上等待，
+// 新进程启动时连上去，旧进程用SCM_RIGHTS把监听socket发给它。新进程开始accept之后回复确认，
+// 旧进程收到确认才开始排空，监听socket始终有进程持有，重启期间不会出现连接被拒绝。
+// 新进程没有确认就退出时，旧进程继续正常服务，等待下一次交接
+class ListenerHandoff {
+   public:
+    static const int MAX_LISTENERS = 256;  // 一次最多交接的监听socket数
+
+    explicit ListenerHandoff(const char *path);
+    ~ListenerHandoff();
+
+   public:
+    // 新进程启动时调用：连接path上正在运行的旧进程，收到的监听socket追加到listeners中。
+    // 没有旧进程时返回true且listeners不变，交接失败返回false
+    bool takeOver(std::vector<int> *listeners);
+    // 新进程已经开始accept，通知旧进程开始排空。没有从旧进程接管时什么也不做
+    void confirm();
+    // 在path上监听，等待下一个新进程来接管
+    bool listen();
+    // 等待新进程连接，把listeners交给它，直到有新进程确认接管才返回true。在单独的线程中调用
+    bool serve(const std::vector<int> &listeners);
+
+   private:
+    bool sendListeners(int connfd, const std::vector<int> &listeners);
+
+   private:
+    const char *path_;  // Unix域socket的路径
+    int listenfd_;      // 在path_上监听的socket
+    int predecessor_;   // 和旧进程的连接，确认之后关闭
+};
+
+#endif
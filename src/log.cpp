@@ -0,0 +1,274 @@
+#include "log.h"
+
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdarg>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+std::atomic<Log::LEVEL> Log::level_(Log::INFO);
+int Log::fds_[Log::LOG_NUMBER] = {STDOUT_FILENO, -1};
+std::atomic<int> Log::access_fd_(-1);
+std::atomic<bool> Log::running_(false);
+pthread_t Log::thread_;
+thread_local Log::ThreadLog *Log::local_ = NULL;
+Locker Log::locker_;
+std::vector<Log::ThreadLog *> Log::threads_;
+std::atomic<uint64_t> Log::dropped_(0);
+bool Log::reopen_ = false;
+int Log::reopen_fds_[Log::LOG_NUMBER];
+
+static const char *LEVEL_NAMES[] = {"DEBUG", "INFO", "WARN", "ERROR"};
+
+static int openLog(const char *path) { return open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644); }
+
+// 关闭打开的日志文件，标准输出不关闭
+static void closeLogs(const int *fds, int number) {
+    for (int i = 0; i < number; ++i) {
+        if (fds[i] > STDERR_FILENO) {
+            close(fds[i]);
+        }
+    }
+}
+
+bool Log::start(LEVEL level, const char *error_path, const char *access_path) {
+    level_.store(level);
+    if (error_path && (fds_[ERROR_LOG] = openLog(error_path)) < 0) {
+        fds_[ERROR_LOG] = STDOUT_FILENO;
+        return false;
+    }
+    if (access_path && (fds_[ACCESS_LOG] = openLog(access_path)) < 0) {
+        fds_[ACCESS_LOG] = -1;
+        return false;
+    }
+    access_fd_.store(fds_[ACCESS_LOG]);
+
+    running_.store(true);
+    if (pthread_create(&thread_, NULL, run, NULL) != 0) {
+        running_.store(false);
+        return false;
+    }
+    atexit(stop);
+    return true;
+}
+
+// 停止后台线程，写完剩下的日志。之后的日志同步写出
+void Log::stop() {
+    if (running_.exchange(false)) {
+        pthread_join(thread_, NULL);
+        flush();
+    }
+}
+
+bool Log::reopen(const char *error_path, const char *access_path) {
+    int fds[LOG_NUMBER] = {STDOUT_FILENO, -1};
+    if ((error_path && (fds[ERROR_LOG] = openLog(error_path)) < 0) ||
+        (access_path && (fds[ACCESS_LOG] = openLog(access_path)) < 0)) {
+        closeLogs(fds, LOG_NUMBER);
+        return false;
+    }
+
+    locker_.lock();
+    if (reopen_) {
+        closeLogs(reopen_fds_, LOG_NUMBER);
+    }
+    memcpy(reopen_fds_, fds, sizeof(fds));
+    reopen_ = true;
+    locker_.unlock();
+    access_fd_.store(fds[ACCESS_LOG], std::memory_order_relaxed);
+    return true;
+}
+
+bool Log::parseLevel(const char *text, LEVEL *level) {
+    static const char *names[] = {"debug", "info", "warn", "error", "off"};
+    for (int i = DEBUG; i <= OFF; ++i) {
+        if (strcmp(text, names[i]) == 0) {
+            *level = (LEVEL)i;
+            return true;
+        }
+    }
+    return false;
+}
+
+// 时间精确到毫秒就够了，用CLOCK_REALTIME_COARSE。日期和时分秒部分每秒只格式化一次
+int Log::timestamp(char *out) {
+    static thread_local time_t last_second = 0;
+    static thread_local char prefix[24];
+
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+    if (ts.tv_sec != last_second) {
+        struct tm tm;
+        localtime_r(&ts.tv_sec, &tm);
+        strftime(prefix, sizeof(prefix), "%Y-%m-%dT%H:%M:%S", &tm);
+        last_second = ts.tv_sec;
+    }
+    return sprintf(out, "%s.%03d", prefix, (int)(ts.tv_nsec / 1000000));
+}
+
+void Log::write(LEVEL level, const char *format, ...) {
+    char line[MAX_LINE];
+    int len = timestamp(line);
+    len += snprintf(line + len, MAX_LINE - len, " %s ", LEVEL_NAMES[level]);
+
+    va_list args;
+    va_start(args, format);
+    int message = vsnprintf(line + len, MAX_LINE - len, format, args);
+    va_end(args);
+    len = message < 0 ? len : (len + message < (int)MAX_LINE - 1 ? len + message : MAX_LINE - 2);
+    line[len++] = '\n';
+    push(ERROR_LOG, line, len);
+}
+
+void Log::access(const char *format, ...) {
+    char line[MAX_LINE];
+    va_list args;
+    va_start(args, format);
+    int len = vsnprintf(line, MAX_LINE, format, args);
+    va_end(args);
+    if (len < 0) {
+        return;
+    }
+    len = len < (int)MAX_LINE - 1 ? len : MAX_LINE - 2;
+    line[len++] = '\n';
+    push(ACCESS_LOG, line, len);
+}
+
+// 线程退出时析构其他thread_local对象的过程中还可能写日志，这时缓冲已经交给后台线程释放，丢弃这一行
+static thread_local bool thread_exited = false;
+
+Log::ThreadExit::~ThreadExit() {
+    thread_exited = true;
+    local_->exited.store(true, std::memory_order_release);
+    local_ = NULL;
+}
+
+// 追加一整行到当前线程的缓冲，后台线程只会看到完整的行
+void Log::push(int log, const char *line, size_t len) {
+    if (!running_.load(std::memory_order_relaxed)) {
+        if (fds_[log] != -1) {
+            ::write(fds_[log], line, len);
+        }
+        return;
+    }
+    if (!local_) {
+        if (thread_exited) {
+            dropped_.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        local_ = new ThreadLog();
+        locker_.lock();
+        threads_.push_back(local_);
+        locker_.unlock();
+        static thread_local ThreadExit thread_exit;
+    }
+
+    Ring &ring = local_->rings[log];
+    uint64_t head = ring.head.load(std::memory_order_relaxed);
+    if (RING_SIZE - (head - ring.tail.load(std::memory_order_acquire)) < len) {
+        dropped_.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    size_t offset = head & (RING_SIZE - 1);
+    size_t first = RING_SIZE - offset < len ? RING_SIZE - offset : len;
+    memcpy(ring.data + offset, line, first);
+    memcpy(ring.data, line + first, len - first);
+    ring.head.store(head + len, std::memory_order_release);
+}
+
+// 每个缓冲中未写出的部分最多是首尾两段，所有线程的这些段合成一次writev。已经退出的线程在读取head之前
+// 判断，这一次写完之后它的缓冲不会再有新的日志，随即释放
+void Log::flush() {
+    locker_.lock();
+    std::vector<ThreadLog *> threads(threads_);
+    if (reopen_) {
+        closeLogs(fds_, LOG_NUMBER);
+        memcpy(fds_, reopen_fds_, sizeof(fds_));
+        reopen_ = false;
+    }
+    locker_.unlock();
+
+    std::vector<ThreadLog *> exited;
+    for (size_t i = 0; i < threads.size(); ++i) {
+        if (threads[i]->exited.load(std::memory_order_acquire)) {
+            exited.push_back(threads[i]);
+        }
+    }
+
+    for (int log = 0; log < LOG_NUMBER; ++log) {
+        std::vector<struct iovec> vecs;
+        std::vector<uint64_t> heads(threads.size());
+        for (size_t i = 0; i < threads.size(); ++i) {
+            Ring &ring = threads[i]->rings[log];
+            uint64_t tail = ring.tail.load(std::memory_order_relaxed);
+            heads[i] = ring.head.load(std::memory_order_acquire);
+            size_t len = heads[i] - tail;
+            if (len == 0) {
+                continue;
+            }
+            size_t offset = tail & (RING_SIZE - 1);
+            size_t first = RING_SIZE - offset < len ? RING_SIZE - offset : len;
+            struct iovec vec = {ring.data + offset, first};
+            vecs.push_back(vec);
+            if (len > first) {
+                struct iovec rest = {ring.data, len - first};
+                vecs.push_back(rest);
+            }
+        }
+
+        // 一次最多IOV_MAX段，部分写入时从写到的位置继续。没有打开这种日志时直接丢弃
+        for (size_t start = 0; fds_[log] != -1 && start < vecs.size();) {
+            int count = vecs.size() - start < IOV_MAX ? vecs.size() - start : IOV_MAX;
+            ssize_t len = writev(fds_[log], &vecs[start], count);
+            if (len < 0) {
+                break;
+            }
+            while (count > 0 && (size_t)len >= vecs[start].iov_len) {
+                len -= vecs[start].iov_len;
+                ++start;
+                --count;
+            }
+            if (count > 0) {
+                vecs[start].iov_base = (char *)vecs[start].iov_base + len;
+                vecs[start].iov_len -= len;
+            }
+        }
+
+        for (size_t i = 0; i < threads.size(); ++i) {
+            threads[i]->rings[log].tail.store(heads[i], std::memory_order_release);
+        }
+    }
+
+    if (exited.empty()) {
+        return;
+    }
+    locker_.lock();
+    for (size_t i = 0; i < exited.size(); ++i) {
+        threads_.erase(std::find(threads_.begin(), threads_.end(), exited[i]));
+    }
+    locker_.unlock();
+    for (size_t i = 0; i < exited.size(); ++i) {
+        delete exited[i];
+    }
+}
+
+// 后台线程，每个间隔收集一次，这段时间内各线程写的日志合成一批写出。丢弃了日志时报告丢弃的行数
+void *Log::run(void *arg) {
+    uint64_t reported = 0;
+    while (running_.load(std::memory_order_relaxed)) {
+        flush();
+        usleep(FLUSH_INTERVAL_MS * 1000);
+        uint64_t dropped = dropped_.load(std::memory_order_relaxed);
+        if (dropped != reported) {
+            LOG_WARN("%llu log lines dropped, log buffers full", (unsigned long long)(dropped - reported));
+            reported = dropped;
+        }
+    }
+    return NULL;
+}
@@ -0,0 +1,104 @@
+#ifndef LOG_H
+#define LOG_H
+
+#include <pthread.h>
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "locker.h"
+
+// 异步日志。每个线程第一次写日志时分配自己的环形缓冲(错误日志和访问日志各一个)，只有这个线程写入，
+// 后台线程定期把所有线程缓冲中的整行日志收集起来，每个日志文件一次writev写出，线程退出后它的缓冲在
+// 最后一次收集之后释放(线程池会按负载创建和退出线程)。写日志的线程只做
+// 一次格式化和memcpy，不加锁，也不进入内核；缓冲满时丢弃这一行并计数，不会阻塞请求处理。
+// 后台线程启动之前(比如解析命令行时)直接同步写出
+class Log {
+   public:
+    enum LEVEL { DEBUG = 0, INFO, WARN, ERROR, OFF };
+
+    static const size_t RING_SIZE = 256 * 1024;  // 每个线程每种日志的缓冲大小，2的幂
+    static const size_t MAX_LINE = 1024;         // 一行日志的最大长度，超出的部分截断
+    static const int FLUSH_INTERVAL_MS = 10;     // 后台线程收集日志的间隔
+
+   public:
+    // 打开日志文件并启动后台线程。error_path为空时错误日志写到标准输出，access_path为空时不记录访问日志。
+    // 进程退出时(atexit)写完剩下的日志
+    static bool start(LEVEL level, const char *error_path, const char *access_path);
+    static void stop();
+
+    // 收到SIGHUP时修改日志级别、重新打开日志文件(路径可以和原来不同，也配合日志轮转)，需要后台线程在运行。
+    // 新的文件在后台线程下一次写出时换上，不记录访问日志时缓冲中剩下的访问日志被丢弃
+    static void setLevel(LEVEL level) { level_.store(level, std::memory_order_relaxed); }
+    static bool reopen(const char *error_path, const char *access_path);
+
+    static bool enabled(LEVEL level) { return level >= level_.load(std::memory_order_relaxed); }
+    static bool accessEnabled() { return access_fd_.load(std::memory_order_relaxed) != -1; }
+    static bool parseLevel(const char *text, LEVEL *level);
+
+    // 写一行错误日志，自动加上时间和级别，format不需要换行符。一般通过下面的LOG_*宏调用
+    static void write(LEVEL level, const char *format, ...) __attribute__((format(printf, 2, 3)));
+    // 写一行访问日志，format不需要换行符
+    static void access(const char *format, ...) __attribute__((format(printf, 1, 2)));
+    // 当前时间，ISO 8601格式精确到毫秒，写入out(至少24字节)，返回长度
+    static int timestamp(char *out);
+
+    static uint64_t dropped() { return dropped_.load(std::memory_order_relaxed); }  // 缓冲满时丢弃的行数
+
+   private:
+    enum { ERROR_LOG = 0, ACCESS_LOG, LOG_NUMBER };
+
+    // 单生产者单消费者的环形缓冲，head和tail是累计写入和取走的字节数
+    struct Ring {
+        Ring() : data(new char[RING_SIZE]), head(0), tail(0) {}
+        ~Ring() { delete[] data; }
+        char *data;
+        std::atomic<uint64_t> head;  // 只由所属线程写
+        std::atomic<uint64_t> tail;  // 只由后台线程写
+    };
+
+    struct ThreadLog {
+        ThreadLog() : exited(false) {}
+        Ring rings[LOG_NUMBER];
+        std::atomic<bool> exited;  // 所属线程已经退出，不会再写入，后台线程写完剩下的日志后释放
+    };
+
+    // 线程第一次写日志时创建的thread_local对象，线程退出时析构，把缓冲标记为已退出
+    struct ThreadExit {
+        ~ThreadExit();
+    };
+
+    static void push(int log, const char *line, size_t len);
+    static void flush();  // 把所有缓冲中的日志写出
+    static void *run(void *arg);
+
+   private:
+    static std::atomic<LEVEL> level_;
+    static int fds_[LOG_NUMBER];             // 只由后台线程使用，后台线程启动之前和停止之后同步写出时使用
+    static std::atomic<int> access_fd_;      // 访问日志的文件描述符，没有访问日志时为-1，只用来判断是否记录
+    static std::atomic<bool> running_;
+    static pthread_t thread_;
+    static thread_local ThreadLog *local_;  // 当前线程的缓冲
+    static Locker locker_;                  // 保护threads_，reopen_和reopen_fds_
+    static bool reopen_;                    // 有等待后台线程换上的新文件
+    static int reopen_fds_[LOG_NUMBER];
+    static std::vector<ThreadLog *> threads_;
+    static std::atomic<uint64_t> dropped_;
+};
+
+// 级别低于设定值时只是一次比较，参数不会求值
+#define LOG(level, ...)                     \
+    do {                                    \
+        if (Log::enabled(level)) {          \
+            Log::write(level, __VA_ARGS__); \
+        }                                   \
+    } while (0)
+
+#define LOG_DEBUG(...) LOG(Log::DEBUG, __VA_ARGS__)
+#define LOG_INFO(...) LOG(Log::INFO, __VA_ARGS__)
+#define LOG_WARN(...) LOG(Log::WARN, __VA_ARGS__)
+#define LOG_ERROR(...) LOG(Log::ERROR, __VA_ARGS__)
+
+#endif
@@ -2,20 +2,30 @@
 #include <fcntl.h>
 #include <netinet/in.h>
 #include <sys/epoll.h>
+#include <sys/resource.h>
 #include <sys/socket.h>
+#include <time.h>
 #include <unistd.h>
 
+#include <atomic>
 #include <cerrno>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <string>
+#include <utility>
+#include <vector>
 
+#include "config.h"
+#include "event_loop.h"
 #include "http_connection.h"
+#include "listener_handoff.h"
 #include "locker.h"
+#include "log.h"
+#include "mime_types.h"
 #include "threadpool.h"
-
-#define MAX_FD 65536            // 最大的文件描述符个数
-#define MAX_EVENT_NUMBER 10000  // 监听的最大的事件数量
+#include "uring_loop.h"
+#include "work_stealing_pool.h"
 
 extern void addfd(int epollfd, int fd, bool one_shot);
 extern void removefd(int epollfd, int fd);
@@ -28,91 +38,628 @@ void addSignal(int sig, void(handler)(int)) {
     assert(sigaction(sig, &signal_action, NULL) != -1);
 }
 
-int main(int argc, char *argv[]) {
-    if (argc <= 1) {
-        printf("usage: %s port_number\n", basename(argv[0]));
-        return 1;
+void usage(const char *program) {
+    printf("usage: %s [port_number] [-C config_file] [-o key=value] [-D doc_root] [-r reactor_number]\n", program);
+    printf("       [-d rr|least] [-s] [-b backlog] [-i seconds]\n");
+    printf("       [-f mmap|sendfile|splice] [-c cache_mb] [-R] [-z off|static|on] [-m buffer_kb]\n");
+    printf("       [-q lockfree|locked|steal] [-t thread_number] [-a cpu_list|numa] [-T idle,header,write]\n");
+    printf("       [-H handoff_path] [-e epoll|uring] [-L debug|info|warn|error|off] [-E error_log] [-l access_log]\n");
+    printf("  -C  配置文件，每行一项key = value，命令行上的选项优先。收到SIGHUP时重新读取，网站根目录、超时和日志\n");
+    printf("      的配置立即生效，并重新打开日志文件\n");
+    printf("  -o  设置一个配置项，key是配置文件中的名字，比如-o bind=127.0.0.1 -o queue_depth=65536\n");
+    printf("  -D  网站的根目录\n");
+    printf("  -r  子reactor(事件循环线程)的数量，0表示单reactor + 线程池模式(默认)\n");
+    printf("  -d  多reactor模式下新连接的分发策略：rr轮询(默认)，least最少连接\n");
+    printf("  -s  分片监听：每个子reactor用SO_REUSEPORT打开自己的监听socket，由内核分配连接，需要-r > 0\n");
+    printf("  -b  listen的backlog，默认%d\n", SOMAXCONN);
+    printf("  -i  每隔多少秒打印一次统计：各分片每秒accept的连接数，文件缓存的命中/未命中/淘汰次数，\n");
+    printf("      缓冲区池租出和空闲的内存，超时关闭的连接数，0不打印(默认)\n");
+    printf("  -f  静态文件响应体的发送方式：mmap + writev(默认)，sendfile，splice\n");
+    printf("  -c  文件缓存的容量，单位MB，0不使用缓存(默认)\n");
+    printf("  -R  为文件缓存中的小文件缓存完整的HTTP响应，需要-c\n");
+    printf("  -z  文本类文件的压缩：off(默认)，static发送和文件放在一起的预压缩文件(.br/.gz)，on没有预压缩文件时\n");
+    printf("      在后台线程压缩并缓存，-o compress_cache_mb=N指定缓存容量，默认16\n");
+    printf("  -m  一个连接的读缓冲最多扩大到多少KB，2到1024，默认16\n");
+    printf("  -q  线程池的请求队列：lockfree无锁环形队列(默认)，locked互斥锁 + 信号量保护的链表，\n");
+    printf("      steal每个线程一个队列的工作窃取线程池，需要-r 0\n");
+    printf("  -t  线程池的线程数量，默认8，-r 0时有效。-o max_threads=N让线程数在-t和N之间随队列等待时间伸缩，\n");
+    printf("      -o overload=pause|reject指定队列满时暂停读取连接(默认)还是回复503\n");
+    printf("  -a  工作窃取线程池的线程绑定的CPU：CPU列表(如0-3,8)中每个线程依次绑定一个CPU，\n");
+    printf("      numa每个线程依次绑定一个NUMA节点的所有CPU，需要-q steal\n");
+    printf("  -T  空闲、读请求头、写响应的超时秒数，0表示不限制，默认60,30,60\n");
+    printf("  -H  热重启：从这个Unix域socket上运行的旧进程接管监听socket，之后在上面等待下一个新进程接管\n");
+    printf("  -e  子reactor的I/O后端：epoll(默认)，uring用io_uring收发数据，需要-r > 0和-f mmap，\n");
+    printf("      内核不支持时退回epoll\n");
+    printf("  -L  日志级别：debug，info(默认)，warn，error，off\n");
+    printf("  -E  错误日志文件，默认写到标准输出\n");
+    printf("  -l  访问日志文件，每个请求一行，默认不记录\n");
+}
+
+// 命令行选项对应的配置项，没有参数的选项取值为true
+static const char *OPTION_KEYS[][2] = {
+    {"D", "doc_root"},   {"r", "reactors"},        {"d", "dispatch"},      {"s", "sharded"},
+    {"b", "backlog"},    {"i", "report_interval"}, {"f", "file_strategy"}, {"c", "cache_mb"},
+    {"R", "cache_responses"}, {"m", "buffer_kb"},  {"q", "queue"},         {"t", "threads"},
+    {"a", "affinity"},   {"T", "timeouts"},        {"H", "handoff"},       {"e", "io_backend"},
+    {"L", "log_level"},  {"E", "error_log"},       {"l", "access_log"},    {"z", "compress"},
+};
+
+// 命令行上的配置项，按出现的顺序
+typedef std::vector<std::pair<std::string, std::string> > Overrides;
+
+// 依次应用默认值、配置文件和命令行上的配置项，再检查配置项之间的约束
+bool loadConfig(const char *path, const Overrides &overrides, Config *config, std::string *error) {
+    if (path && !config->load(path, error)) {
+        return false;
+    }
+    for (size_t i = 0; i < overrides.size(); ++i) {
+        if (!config->set(overrides[i].first, overrides[i].second, error)) {
+            return false;
+        }
     }
+    return config->validate(error);
+}
 
-    int port = atoi(argv[1]);
-    addSignal(SIGPIPE, SIG_IGN);
+// 应用可以在运行中修改的配置项(日志文件除外)，启动时和收到SIGHUP时调用
+void applyLiveConfig(const Config &config) {
+    HttpConnection::setDocRoot(config.doc_root.c_str());
+    HttpConnection::idle_timeout_.store(config.idle_timeout * 1000, std::memory_order_relaxed);
+    HttpConnection::header_timeout_.store(config.header_timeout * 1000, std::memory_order_relaxed);
+    HttpConnection::write_timeout_.store(config.write_timeout * 1000, std::memory_order_relaxed);
+    Log::setLevel(config.log_level);
+}
 
-    ThreadPool<HttpConnection> *pool = NULL;
-    try {
-        pool = new ThreadPool<HttpConnection>;
-    } catch (...) {
-        return 1;
+static const char *pathOrNull(const std::string &path) { return path.empty() ? NULL : path.c_str(); }
+
+// 重新加载配置的线程的参数
+struct ReloadContext {
+    const char *path;    // 配置文件，没有时为NULL
+    Overrides overrides;  // 命令行上的配置项，重新加载时仍然优先
+    Config config;        // 当前生效的配置
+    std::atomic<bool> stop;  // main要求线程退出，随后用SIGHUP唤醒它
+};
+
+// 等待SIGHUP，重新读取配置文件并应用可以在运行中修改的配置项，其他配置项的修改只给出警告。
+// 日志文件总是重新打开，配合日志轮转。新的配置有错误时保留原来的配置
+void *reloadConfig(void *arg) {
+    ReloadContext *context = (ReloadContext *)arg;
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGHUP);
+    while (true) {
+        int sig = 0;
+        if (sigwait(&signals, &sig) != 0) {
+            continue;
+        }
+        if (context->stop.load()) {
+            break;
+        }
+
+        Config config;
+        std::string error;
+        if (!loadConfig(context->path, context->overrides, &config, &error)) {
+            LOG_ERROR("reload config failed, keeping the current one: %s", error.c_str());
+            continue;
+        }
+        std::vector<std::string> keys;
+        context->config.changed(config, &keys);
+        for (size_t i = 0; i < keys.size(); ++i) {
+            if (Config::live(keys[i])) {
+                context->config.set(keys[i], config.get(keys[i]), NULL);
+                LOG_INFO("config %s changed to \"%s\"", keys[i].c_str(), config.get(keys[i]).c_str());
+            } else {
+                LOG_WARN("config %s changed, takes effect after restart", keys[i].c_str());
+            }
+        }
+        applyLiveConfig(context->config);
+        if (!Log::reopen(pathOrNull(context->config.error_log), pathOrNull(context->config.access_log))) {
+            LOG_ERROR("reopen log failed, errno is: %d", errno);
+        }
+    }
+
+    return NULL;
+}
+
+// 负责accept的loop，收到SIGTERM/SIGINT或者监听socket被新进程接管后排空它们
+static EventLoop **drain_loops = NULL;
+static int drain_loop_number = 0;
+static volatile sig_atomic_t stopping = 0;
+
+void drainLoops() {
+    stopping = 1;
+    for (int i = 0; i < drain_loop_number; ++i) {
+        drain_loops[i]->drain();
     }
+}
 
-    HttpConnection *users = new HttpConnection[MAX_FD];
+// 第一次收到信号时排空后退出，排空期间再次收到信号立即退出
+void handleStop(int sig) {
+    if (stopping) {
+        _exit(1);
+    }
+    drainLoops();
+}
 
-    int listenfd = socket(PF_INET, SOCK_STREAM, 0);
+// 热重启线程的参数
+struct HandoffContext {
+    ListenerHandoff *handoff;
+    std::vector<int> listeners;  // 交给新进程的监听socket，是loop中监听socket的dup，loop排空时关闭自己的那份
+};
+
+// 等待新进程接管监听socket，接管成功后排空本进程
+void *handoff(void *arg) {
+    HandoffContext *context = (HandoffContext *)arg;
+    if (context->handoff->serve(context->listeners)) {
+        LOG_INFO("listeners handed off, draining");
+        drainLoops();
+    }
+    return NULL;
+}
+
+// 解析"0-3,8,10-11"格式的CPU列表，格式错误时返回false
+bool parseCpuList(const char *text, std::vector<int> *cpus) {
+    while (*text) {
+        char *end = NULL;
+        long first = strtol(text, &end, 10);
+        long last = first;
+        if (end == text || first < 0) {
+            return false;
+        }
+        if (*end == '-') {
+            text = end + 1;
+            last = strtol(text, &end, 10);
+            if (end == text || last < first) {
+                return false;
+            }
+        }
+        for (long cpu = first; cpu <= last && cpu < CPU_SETSIZE; ++cpu) {
+            cpus->push_back(cpu);
+        }
+        text = end;
+        if (*text == ',' || *text == '\n') {
+            ++text;
+        } else if (*text) {
+            return false;
+        }
+    }
+    return !cpus->empty();
+}
+
+// 从/sys中读取每个NUMA节点的CPU列表
+bool numaNodes(std::vector<std::vector<int> > *nodes) {
+    for (int node = 0;; ++node) {
+        char path[64];
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+        FILE *file = fopen(path, "r");
+        if (!file) {
+            break;
+        }
+        char line[1024] = {0};
+        std::vector<int> cpus;
+        bool ok = fgets(line, sizeof(line), file) && parseCpuList(line, &cpus);
+        fclose(file);
+        if (ok) {
+            nodes->push_back(cpus);
+        }
+    }
+    return !nodes->empty();
+}
+
+// 创建非阻塞的监听socket，reuse_port为true时多个socket可以绑定同一个端口，由内核在它们之间分配连接
+int createListener(const char *bind_address, int port, int backlog, bool reuse_port) {
+    int listenfd = socket(PF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (listenfd < 0) {
+        return -1;
+    }
 
-    int ret = 0;
     struct sockaddr_in address;
-    address.sin_addr.s_addr = INADDR_ANY;
+    memset(&address, 0, sizeof(address));
+    inet_pton(AF_INET, bind_address, &address.sin_addr);
     address.sin_family = AF_INET;
     address.sin_port = htons(port);
 
     // 端口复用
     int reuse = 1;
     setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
-    ret = bind(listenfd, (struct sockaddr *)&address, sizeof(address));
-    ret = listen(listenfd, 5);
+    if (reuse_port) {
+        setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse));
+    }
 
-    // 创建epoll对象，和事件数组，添加
-    epoll_event events[MAX_EVENT_NUMBER];
-    int epollfd = epoll_create(5);
-    // 添加到epoll对象中
-    addfd(epollfd, listenfd, false);
-    HttpConnection::epollfd_ = epollfd;
+    if (bind(listenfd, (struct sockaddr *)&address, sizeof(address)) < 0 || listen(listenfd, backlog) < 0) {
+        LOG_ERROR("listen on %s:%d failed, errno is: %d", bind_address, port, errno);
+        close(listenfd);
+        return -1;
+    }
 
-    while (true) {
-        int number = epoll_wait(epollfd, events, MAX_EVENT_NUMBER, -1);
+    return listenfd;
+}
+
+// 优先使用从旧进程接管的监听socket，不够时新建
+int takeListener(std::vector<int> *inherited, const Config &config, bool reuse_port) {
+    if (!inherited->empty()) {
+        int listenfd = inherited->front();
+        inherited->erase(inherited->begin());
+        return listenfd;
+    }
+    return createListener(config.bind.c_str(), config.port, config.backlog, reuse_port);
+}
+
+// 按选定的I/O后端创建子reactor
+EventLoop *createLoop(HttpConnection *users) {
+    if (HttpConnection::io_backend_ == HttpConnection::URING) {
+        return new UringLoop(users);
+    }
+    return new EventLoop(users);
+}
 
-        if ((number < 0) && (errno != EINTR)) {
-            printf("epoll failure\n");
+// 统计线程的参数
+struct ReportContext {
+    Executor<HttpConnection> *pool;                   // 单reactor模式下的线程池，否则为NULL
+    WorkStealingPool<HttpConnection> *stealing_pool;  // 工作窃取线程池，没有使用时为NULL
+    EventLoop **shards;  // 分片监听模式下的各个分片，否则为NULL
+    int shard_number;
+    EventLoop **loops;  // 所有管理连接的loop
+    int loop_number;
+    int interval;  // 打印间隔，单位秒
+
+    Locker locker;             // 保护stop
+    ConditionVariable wakeup;  // main要求退出时唤醒统计线程
+    bool stop;                 // main要求统计线程退出
+};
+
+// 统计线程，每隔interval秒打印一次各分片在这段时间内平均每秒accept的连接数，以及文件缓存的计数
+void *report(void *arg) {
+    ReportContext *context = (ReportContext *)arg;
+    uint64_t *last = new uint64_t[context->shard_number]();
+    context->locker.lock();
+    while (true) {
+        // 等到下一次打印的时刻，main要求退出时提前醒来
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += context->interval;
+        while (!context->stop && context->wakeup.timeWait(context->locker.getMutex(), deadline)) {
+        }
+        if (context->stop) {
             break;
         }
+        context->locker.unlock();
+
+        if (context->shards) {
+            printf("accepts/s:");
+            for (int i = 0; i < context->shard_number; ++i) {
+                uint64_t count = context->shards[i]->acceptCount();
+                printf(" shard%d=%llu", i, (unsigned long long)((count - last[i]) / context->interval));
+                last[i] = count;
+            }
+            printf("\n");
+        }
+        FileCache *cache = HttpConnection::file_cache_;
+        if (cache) {
+            printf("file cache: hits=%llu misses=%llu evictions=%llu invalidations=%llu\n",
+                   (unsigned long long)cache->hits(), (unsigned long long)cache->misses(),
+                   (unsigned long long)cache->evictions(), (unsigned long long)cache->invalidations());
+        }
+        Compressor *compressor = HttpConnection::compressor_;
+        if (compressor) {
+            printf("compress: hits=%llu misses=%llu compressions=%llu cache=%zuKB\n",
+                   (unsigned long long)compressor->hits(), (unsigned long long)compressor->misses(),
+                   (unsigned long long)compressor->compressions(), compressor->size() / 1024);
+        }
+        if (context->pool) {
+            printf("pool: workers=%d\n", context->pool->workerNumber());
+        }
+        WorkStealingPool<HttpConnection> *pool = context->stealing_pool;
+        if (pool) {
+            printf("workers:");
+            for (int i = 0; i < pool->workerNumber(); ++i) {
+                printf(" %d:depth=%zu,steals=%llu,processed=%llu", i, pool->depth(i),
+                       (unsigned long long)pool->steals(i), (unsigned long long)pool->processed(i));
+            }
+            printf("\n");
+        }
+        BufferPool *buffers = HttpConnection::buffer_pool_;
+        printf("buffers: leased=%zuKB idle=%zuKB\n", buffers->leasedBytes() / 1024, buffers->idleBytes() / 1024);
+        ObjectPool<HttpConnection::Exchange> *exchanges = HttpConnection::exchange_pool_;
+        printf("exchanges: leased=%zu idle=%zu\n", exchanges->leased(), exchanges->idle());
+        uint64_t timeouts = 0;
+        for (int i = 0; i < context->loop_number; ++i) {
+            timeouts += context->loops[i]->timeoutCount();
+        }
+        printf("timeouts: %llu\n", (unsigned long long)timeouts);
+        fflush(stdout);
+        context->locker.lock();
+    }
+    context->locker.unlock();
 
-        for (int i = 0; i < number; i++) {
-            int sockfd = events[i].data.fd;
-            if (sockfd == listenfd) {
-                struct sockaddr_in client_address;
-                socklen_t client_addrlength = sizeof(client_address);
-                int connfd = accept(listenfd, (struct sockaddr *)&client_address, &client_addrlength);
+    delete[] last;
+    return NULL;
+}
 
-                if (connfd < 0) {
-                    printf("errno is: %d\n", errno);
-                    continue;
-                }
+int main(int argc, char *argv[]) {
+    ReloadContext reload_context;
+    reload_context.path = NULL;
+    reload_context.stop.store(false);
+    Overrides &overrides = reload_context.overrides;
+
+    int opt = 0;
+    while ((opt = getopt(argc, argv, "C:o:D:r:d:sb:i:f:c:Rz:m:q:t:a:T:H:e:L:E:l:")) != -1) {
+        const char *key = NULL;
+        for (size_t i = 0; i < sizeof(OPTION_KEYS) / sizeof(OPTION_KEYS[0]); ++i) {
+            if (OPTION_KEYS[i][0][0] == opt) {
+                key = OPTION_KEYS[i][1];
+            }
+        }
+        const char *equal = opt == 'o' ? strchr(optarg, '=') : NULL;
+        if (opt == 'C') {
+            reload_context.path = optarg;
+        } else if (equal) {
+            overrides.push_back(std::make_pair(std::string(optarg, equal - optarg), std::string(equal + 1)));
+        } else if (key) {
+            overrides.push_back(std::make_pair(key, optarg ? optarg : "true"));
+        } else {
+            usage(basename(argv[0]));
+            return 1;
+        }
+    }
+    if (optind < argc) {
+        overrides.push_back(std::make_pair("port", argv[optind]));
+    }
+
+    Config &config = reload_context.config;
+    std::string error;
+    if (!loadConfig(reload_context.path, overrides, &config, &error)) {
+        printf("%s\n", error.c_str());
+        usage(basename(argv[0]));
+        return 1;
+    }
+
+    addSignal(SIGPIPE, SIG_IGN);
+    // SIGHUP只由重新加载配置的线程用sigwait接收，之后创建的线程都继承这个信号屏蔽字
+    sigset_t reload_signals;
+    sigemptyset(&reload_signals);
+    sigaddset(&reload_signals, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &reload_signals, NULL);
+
+    // 之后的日志都由后台线程批量写出，进程退出时写完
+    if (!Log::start(config.log_level, pathOrNull(config.error_log), pathOrNull(config.access_log))) {
+        printf("open log failed, errno is: %d\n", errno);
+        return 1;
+    }
+
+    if (config.io_backend == "uring") {
+        if (IoUring::supported()) {
+            HttpConnection::io_backend_ = HttpConnection::URING;
+        } else {
+            LOG_WARN("io_uring is not supported, falling back to epoll");
+        }
+    }
+    if (config.file_strategy == "sendfile") {
+        HttpConnection::file_strategy_ = HttpConnection::SENDFILE;
+    } else if (config.file_strategy == "splice") {
+        HttpConnection::file_strategy_ = HttpConnection::SPLICE;
+    }
+    HttpConnection::max_age_ = config.max_age;
+    HttpConnection::io_budget_ = (size_t)config.io_budget_kb * 1024;
+    MimeTypes::configure(config.mime_types);
+    EventLoop::DISPATCH_POLICY dispatch = config.dispatch == "least" ? EventLoop::LEAST_LOADED : EventLoop::ROUND_ROBIN;
+    int reactor_number = config.reactors;
+    bool sharded = config.sharded;
+
+    // 单reactor模式下，读写在主线程，请求处理交给线程池；多reactor模式下每个loop线程自己处理请求
+    // 工作窃取线程池的线程按配置绑定CPU
+    std::vector<std::vector<int> > affinity;
+    if (!config.affinity.empty()) {
+        std::vector<int> cpus;
+        if (config.affinity == "numa") {
+            if (!numaNodes(&affinity)) {
+                LOG_ERROR("no NUMA node found");
+                return 1;
+            }
+        } else if (parseCpuList(config.affinity.c_str(), &cpus)) {
+            for (size_t i = 0; i < cpus.size(); ++i) {
+                affinity.push_back(std::vector<int>(1, cpus[i]));
+            }
+        } else {
+            usage(basename(argv[0]));
+            return 1;
+        }
+    }
+
+    Executor<HttpConnection> *pool = NULL;
+    WorkStealingPool<HttpConnection> *stealing_pool = NULL;
+    if (reactor_number == 0) {
+        try {
+            if (config.queue == "steal") {
+                stealing_pool = new WorkStealingPool<HttpConnection>(config.threads, config.queue_depth, affinity);
+                pool = stealing_pool;
+            } else if (config.queue == "locked") {
+                pool = new ThreadPool<HttpConnection, LockedQueue<HttpConnection> >(
+                    config.threads, config.queue_depth, config.max_threads, config.queue_wait_target_ms);
+            } else {
+                pool = new ThreadPool<HttpConnection>(config.threads, config.queue_depth, config.max_threads,
+                                                      config.queue_wait_target_ms);
+            }
+        } catch (...) {
+            return 1;
+        }
+    }
 
-                if (HttpConnection::user_count_ >= MAX_FD) {
-                    close(connfd);
-                    continue;
+    if (config.cache_mb > 0) {
+        try {
+            HttpConnection::file_cache_ =
+                new FileCache((size_t)config.cache_mb * 1024 * 1024, 64 * 1024, config.cache_responses);
+        } catch (...) {
+            return 1;
+        }
+    }
+
+    if (config.compress != "off") {
+        try {
+            HttpConnection::compressor_ =
+                new Compressor(config.compress == "on" ? (size_t)config.compress_cache_mb * 1024 * 1024 : 0);
+        } catch (...) {
+            return 1;
+        }
+    }
+
+    HttpConnection::buffer_pool_ = new BufferPool((size_t)config.buffer_kb * 1024);
+    // 和缓冲区池的每一级一样，最多保留4MB空闲的Exchange
+    HttpConnection::exchange_pool_ =
+        new ObjectPool<HttpConnection::Exchange>(4 * 1024 * 1024 / sizeof(HttpConnection::Exchange));
+    applyLiveConfig(config);
+
+    // 文件描述符的上限不到max_fd时尽量调高，连接数组按max_fd分配
+    EventLoop::max_fd_ = config.max_fd;
+    EventLoop::max_events_ = config.max_events;
+    EventLoop::overload_policy_ = config.overload == "reject" ? EventLoop::REJECT : EventLoop::PAUSE;
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < (rlim_t)config.max_fd) {
+        limit.rlim_cur = limit.rlim_max < (rlim_t)config.max_fd ? limit.rlim_max : (rlim_t)config.max_fd;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+
+    // 热重启：先从旧进程接管监听socket，没有旧进程时自己创建
+    const char *handoff_path = pathOrNull(config.handoff);
+    std::vector<int> inherited;
+    ListenerHandoff *listener_handoff = NULL;
+    if (handoff_path) {
+        listener_handoff = new ListenerHandoff(handoff_path);
+        if (!listener_handoff->takeOver(&inherited)) {
+            LOG_ERROR("take over listeners from %s failed", handoff_path);
+            return 1;
+        }
+        if (!inherited.empty()) {
+            LOG_INFO("took over %zu listeners from %s", inherited.size(), handoff_path);
+        }
+    }
+
+    HttpConnection *users = new HttpConnection[EventLoop::max_fd_];
+    ReportContext report_context = {pool, stealing_pool, NULL, 0, NULL, 0, config.report_interval};
+    report_context.stop = false;
+    pthread_t report_thread;
+    HandoffContext handoff_context;
+    handoff_context.handoff = listener_handoff;
+    std::vector<EventLoop *> acceptors;  // 负责accept的loop：分片监听时是各个分片，否则是主loop
+
+    // 主loop运行在主线程中，负责接受新连接。分片监听模式下没有主loop，每个子reactor各自监听、accept，
+    // 主线程只负责统计
+    EventLoop *main_loop = NULL;
+    EventLoop **sub_loops = NULL;
+    try {
+        if (sharded) {
+            sub_loops = new EventLoop *[reactor_number];
+            for (int i = 0; i < reactor_number; ++i) {
+                LOG_INFO("正在创建第%d个监听分片", i);
+                int shard_listenfd = takeListener(&inherited, config, true);
+                if (shard_listenfd < 0) {
+                    return 1;
                 }
-                users[connfd].init(connfd, client_address);
-            } else if (events[i].events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
-                users[sockfd].closeConnection();
-            } else if (events[i].events & EPOLLIN) {
-                if (users[sockfd].read()) {
-                    pool->addTask(users + sockfd);
-                } else {
-                    users[sockfd].closeConnection();
+                if (listener_handoff) {
+                    handoff_context.listeners.push_back(dup(shard_listenfd));
                 }
-            } else if (events[i].events & EPOLLOUT) {
-                if (!users[sockfd].write()) {
-                    users[sockfd].closeConnection();
+                sub_loops[i] = createLoop(users);
+                sub_loops[i]->addListener(shard_listenfd, sub_loops + i, 1, dispatch);
+                if (!sub_loops[i]->start()) {
+                    throw std::exception();
                 }
+                acceptors.push_back(sub_loops[i]);
+            }
+            report_context.shards = sub_loops;
+            report_context.shard_number = reactor_number;
+        } else {
+            int listenfd = takeListener(&inherited, config, false);
+            if (listenfd < 0) {
+                return 1;
             }
+            if (listener_handoff) {
+                handoff_context.listeners.push_back(dup(listenfd));
+            }
+            main_loop = new EventLoop(users, pool);
+            if (reactor_number == 0) {
+                // 单reactor：主loop自己负责所有连接的读写
+                main_loop->addListener(listenfd, &main_loop, 1, dispatch);
+            } else {
+                // 多reactor：主loop只负责accept，连接分发给各个子loop
+                sub_loops = new EventLoop *[reactor_number];
+                for (int i = 0; i < reactor_number; ++i) {
+                    LOG_INFO("正在创建第%d个事件循环线程", i);
+                    sub_loops[i] = createLoop(users);
+                    if (!sub_loops[i]->start()) {
+                        throw std::exception();
+                    }
+                }
+                main_loop->addListener(listenfd, sub_loops, reactor_number, dispatch);
+            }
+            acceptors.push_back(main_loop);
         }
+    } catch (...) {
+        return 1;
+    }
+    // 旧进程的监听socket比这次需要的多(比如分片数变少了)，多出的不再使用
+    for (size_t i = 0; i < inherited.size(); ++i) {
+        close(inherited[i]);
     }
 
-    close(epollfd);
-    close(listenfd);
+    // 收到SIGTERM/SIGINT时排空：不再接受新连接，发送完正在处理的响应，关闭空闲的长连接
+    drain_loops = acceptors.data();
+    drain_loop_number = acceptors.size();
+    addSignal(SIGTERM, handleStop);
+    addSignal(SIGINT, handleStop);
 
+    // 通知旧进程开始排空，然后等待下一个新进程来接管
+    if (listener_handoff) {
+        listener_handoff->confirm();
+        if (listener_handoff->listen()) {
+            pthread_t handoff_thread;
+            pthread_create(&handoff_thread, NULL, handoff, &handoff_context);
+        }
+    }
+
+    // 单reactor时连接都在主loop上，多reactor和分片监听时都在子loop上
+    report_context.loops = reactor_number == 0 ? &main_loop : sub_loops;
+    report_context.loop_number = reactor_number == 0 ? 1 : reactor_number;
+    if (config.report_interval > 0) {
+        pthread_create(&report_thread, NULL, report, &report_context);
+    }
+    pthread_t reload_thread;
+    pthread_create(&reload_thread, NULL, reloadConfig, &reload_context);
+    if (main_loop) {
+        main_loop->loop();
+    }
+
+    // 统计线程访问各个loop和池，重新加载配置的线程修改HttpConnection的配置，在销毁它们之前先让这两个线程退出
+    if (config.report_interval > 0) {
+        report_context.locker.lock();
+        report_context.stop = true;
+        report_context.wakeup.signal();
+        report_context.locker.unlock();
+        pthread_join(report_thread, NULL);
+    }
+    reload_context.stop.store(true);
+    pthread_kill(reload_thread, SIGHUP);
+    pthread_join(reload_thread, NULL);
+
+    // 多reactor时主loop不再分发新连接之后才排空子loop，分发过去的连接不会丢失；分片监听时各个分片
+    // 自己accept，已经随信号排空。loop排空时已经关闭了自己的监听socket
+    for (int i = 0; sub_loops && i < reactor_number; ++i) {
+        if (!sharded) {
+            sub_loops[i]->drain();
+        }
+        sub_loops[i]->join();
+        delete sub_loops[i];
+    }
+    delete[] sub_loops;
+    for (size_t i = 0; i < handoff_context.listeners.size(); ++i) {
+        close(handoff_context.listeners[i]);
+    }
+
+    delete main_loop;
     delete[] users;
-    delete pool;
+    delete pool;  // 等待工作线程退出
+    delete HttpConnection::file_cache_;
+    delete HttpConnection::compressor_;  // 等待压缩线程退出
+    delete HttpConnection::buffer_pool_;
+    delete HttpConnection::exchange_pool_;
 
     return 0;
-}
\ No newline at end of file
+}
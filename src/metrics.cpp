@@ -0,0 +1,108 @@
+#include "metrics.h"
+
+#include <cstdarg>
+#include <cstdio>
+
+thread_local Metrics::Shard *Metrics::local_ = NULL;
+Locker Metrics::locker_;
+std::vector<Metrics::Shard *> Metrics::shards_;
+
+static const char *COUNTER_NAMES[Metrics::COUNTER_NUMBER][2] = {
+    {"webserver_accepts_total", "Connections accepted"},
+    {"webserver_connections_opened_total", "Connections registered to an event loop"},
+    {"webserver_connections_closed_total", "Connections closed"},
+    {"webserver_sent_bytes_total", "Response bytes written to sockets"},
+    {"webserver_overloaded_total", "Requests deferred or rejected with 503 because the thread pool queue was full"},
+    {"webserver_budget_yields_total", "Reads or writes that used up the per-event byte budget and were requeued"},
+};
+
+static const char *STAGE_NAMES[Metrics::STAGE_NUMBER] = {"queue_wait", "process_read", "do_request", "write"};
+
+// 第一次记录时分配当前线程的Shard，之后一直使用它
+Metrics::Shard *Metrics::registerThread() {
+    local_ = new Shard();
+    locker_.lock();
+    shards_.push_back(local_);
+    locker_.unlock();
+    return local_;
+}
+
+// 耗时向上取整到微秒，放进不小于它的第一个2的幂对应的桶
+void Metrics::record(STAGE stage, uint64_t ns) {
+    uint64_t us = (ns + 999) / 1000;
+    int bucket = us <= 1 ? 0 : 64 - __builtin_clzll(us - 1);
+    Shard *local = shard();
+    bump(local->buckets[stage][bucket < BUCKET_NUMBER - 1 ? bucket : BUCKET_NUMBER - 1], 1);
+    bump(local->sums[stage], ns);
+}
+
+static void appendLine(std::string *out, const char *format, ...) __attribute__((format(printf, 2, 3)));
+
+static void appendLine(std::string *out, const char *format, ...) {
+    char line[256];
+    va_list args;
+    va_start(args, format);
+    int len = vsnprintf(line, sizeof(line), format, args);
+    va_end(args);
+    out->append(line, len < (int)sizeof(line) ? len : sizeof(line) - 1);
+}
+
+void Metrics::render(std::string *out) {
+    uint64_t counters[COUNTER_NUMBER] = {0};
+    std::vector<uint64_t> requests(MAX_STATUS, 0);
+    uint64_t buckets[STAGE_NUMBER][BUCKET_NUMBER] = {{0}};
+    uint64_t sums[STAGE_NUMBER] = {0};
+
+    locker_.lock();
+    for (size_t i = 0; i < shards_.size(); ++i) {
+        Shard *shard = shards_[i];
+        for (int c = 0; c < COUNTER_NUMBER; ++c) {
+            counters[c] += shard->counters[c].load(std::memory_order_relaxed);
+        }
+        for (int s = 0; s < MAX_STATUS; ++s) {
+            requests[s] += shard->requests[s].load(std::memory_order_relaxed);
+        }
+        for (int s = 0; s < STAGE_NUMBER; ++s) {
+            for (int b = 0; b < BUCKET_NUMBER; ++b) {
+                buckets[s][b] += shard->buckets[s][b].load(std::memory_order_relaxed);
+            }
+            sums[s] += shard->sums[s].load(std::memory_order_relaxed);
+        }
+    }
+    locker_.unlock();
+
+    for (int c = 0; c < COUNTER_NUMBER; ++c) {
+        appendLine(out, "# HELP %s %s\n# TYPE %s counter\n%s %llu\n", COUNTER_NAMES[c][0], COUNTER_NAMES[c][1],
+                   COUNTER_NAMES[c][0], COUNTER_NAMES[c][0], (unsigned long long)counters[c]);
+    }
+    appendLine(out, "# HELP webserver_connections Active connections\n# TYPE webserver_connections gauge\n"
+                    "webserver_connections %lld\n",
+               (long long)(counters[CONNECTIONS_OPENED] - counters[CONNECTIONS_CLOSED]));
+
+    out->append("# HELP webserver_requests_total Responses by status code\n# TYPE webserver_requests_total counter\n");
+    for (int s = 1; s < MAX_STATUS; ++s) {
+        if (requests[s]) {
+            appendLine(out, "webserver_requests_total{code=\"%d\"} %llu\n", s, (unsigned long long)requests[s]);
+        }
+    }
+    if (requests[0]) {
+        appendLine(out, "webserver_requests_total{code=\"other\"} %llu\n", (unsigned long long)requests[0]);
+    }
+
+    out->append("# HELP webserver_stage_seconds Time spent in each request processing stage\n"
+                "# TYPE webserver_stage_seconds histogram\n");
+    for (int s = 0; s < STAGE_NUMBER; ++s) {
+        uint64_t cumulative = 0;
+        for (int b = 0; b < BUCKET_NUMBER - 1; ++b) {
+            cumulative += buckets[s][b];
+            appendLine(out, "webserver_stage_seconds_bucket{stage=\"%s\",le=\"%.9g\"} %llu\n", STAGE_NAMES[s],
+                       (double)(1ULL << b) / 1e6, (unsigned long long)cumulative);
+        }
+        cumulative += buckets[s][BUCKET_NUMBER - 1];
+        appendLine(out, "webserver_stage_seconds_bucket{stage=\"%s\",le=\"+Inf\"} %llu\n", STAGE_NAMES[s],
+                   (unsigned long long)cumulative);
+        appendLine(out, "webserver_stage_seconds_sum{stage=\"%s\"} %.9f\n", STAGE_NAMES[s], sums[s] / 1e9);
+        appendLine(out, "webserver_stage_seconds_count{stage=\"%s\"} %llu\n", STAGE_NAMES[s],
+                   (unsigned long long)cumulative);
+    }
+}
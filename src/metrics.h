@@ -0,0 +1,92 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <time.h>
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "locker.h"
+
+// 运行时指标。每个线程第一次记录时分配一份自己的计数器和直方图(Shard)，之后只有这个线程写它：
+// 不加锁，也不用带lock前缀的原子加，只是relaxed的读和写，和普通的内存加法开销相同。
+// 读取时把所有线程的Shard加起来，以Prometheus文本格式输出，读到的是各个计数器近似同一时刻的值
+class Metrics {
+   public:
+    enum COUNTER {
+        ACCEPTS = 0,         // accept的连接数
+        CONNECTIONS_OPENED,  // 注册到loop中的连接数
+        CONNECTIONS_CLOSED,  // 关闭的连接数，和上一个的差是当前的活跃连接数
+        BYTES_SENT,          // 发送的响应字节数
+        OVERLOADED,          // 线程池队列满时暂缓或者以503拒绝的请求数
+        BUDGET_YIELDS,       // 连接一次读写用完了字节预算、重新排队等待下一轮事件的次数
+        COUNTER_NUMBER
+    };
+
+    // 请求处理各阶段的耗时
+    enum STAGE {
+        QUEUE_WAIT = 0,  // 请求在线程池队列中等待的时间
+        PROCESS_READ,    // 解析请求，不含doRequest
+        DO_REQUEST,      // 查找目标文件
+        WRITE,           // 一次write()：把响应写入socket
+        STAGE_NUMBER
+    };
+
+    static const int MAX_STATUS = 600;  // 按状态码计数的请求，状态码的范围
+    // 耗时直方图的桶：第i个桶是不超过2^i微秒的请求，最后一个桶是超过2^(BUCKET_NUMBER-2)微秒的
+    static const int BUCKET_NUMBER = 22;
+
+   public:
+    static void add(COUNTER counter, uint64_t value = 1) { bump(shard()->counters[counter], value); }
+    static void countRequest(int status) {
+        bump(shard()->requests[status > 0 && status < MAX_STATUS ? status : 0], 1);
+    }
+    static void record(STAGE stage, uint64_t ns);
+
+    // 单调时钟的当前时刻(纳秒)，用来计算各阶段的耗时
+    static uint64_t now() {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+    }
+
+    // 把所有线程的指标加起来，以Prometheus文本格式追加到out
+    static void render(std::string *out);
+
+   private:
+    // 一个线程的指标，按缓存行对齐，避免和其他线程的数据共享缓存行
+    struct alignas(64) Shard {
+        std::atomic<uint64_t> counters[COUNTER_NUMBER];
+        std::atomic<uint64_t> requests[MAX_STATUS];  // 下标是状态码，0是范围外的状态码
+        std::atomic<uint64_t> buckets[STAGE_NUMBER][BUCKET_NUMBER];
+        std::atomic<uint64_t> sums[STAGE_NUMBER];  // 各阶段耗时的总和(纳秒)
+    };
+
+    // 只有所属的线程写，所以读出来加上再写回就够了
+    static void bump(std::atomic<uint64_t> &value, uint64_t delta) {
+        value.store(value.load(std::memory_order_relaxed) + delta, std::memory_order_relaxed);
+    }
+
+    static Shard *shard() { return local_ ? local_ : registerThread(); }
+    static Shard *registerThread();
+
+   private:
+    static thread_local Shard *local_;    // 当前线程的Shard
+    static Locker locker_;                // 保护shards_
+    static std::vector<Shard *> shards_;  // 所有线程的Shard，线程退出后保留，计数不会丢失
+};
+
+// 在作用域内计时，离开时记录到stage
+class StageTimer {
+   public:
+    explicit StageTimer(Metrics::STAGE stage) : stage_(stage), start_(Metrics::now()) {}
+    ~StageTimer() { Metrics::record(stage_, Metrics::now() - start_); }
+
+   private:
+    Metrics::STAGE stage_;
+    uint64_t start_;
+};
+
+#endif
@@ -0,0 +1,230 @@
+#include "mime_types.h"
+
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+// 内置的扩展名表，扩展名都是小写。第三项表示是否值得压缩
+#define MIME_TYPE(extension, type, compressible) {extension, "Content-Type: " type "\r\n", compressible}
+static constexpr MimeTypes::Type TYPES[] = {
+    MIME_TYPE("html", "text/html", true),
+    MIME_TYPE("htm", "text/html", true),
+    MIME_TYPE("xhtml", "application/xhtml+xml", true),
+    MIME_TYPE("css", "text/css", true),
+    MIME_TYPE("js", "text/javascript", true),
+    MIME_TYPE("mjs", "text/javascript", true),
+    MIME_TYPE("json", "application/json", true),
+    MIME_TYPE("map", "application/json", true),
+    MIME_TYPE("webmanifest", "application/manifest+json", true),
+    MIME_TYPE("xml", "application/xml", true),
+    MIME_TYPE("rss", "application/rss+xml", true),
+    MIME_TYPE("atom", "application/atom+xml", true),
+    MIME_TYPE("txt", "text/plain", true),
+    MIME_TYPE("md", "text/markdown", true),
+    MIME_TYPE("csv", "text/csv", true),
+    MIME_TYPE("ics", "text/calendar", true),
+    MIME_TYPE("yaml", "application/yaml", true),
+    MIME_TYPE("yml", "application/yaml", true),
+    MIME_TYPE("svg", "image/svg+xml", true),
+    MIME_TYPE("wasm", "application/wasm", true),
+    MIME_TYPE("m3u8", "application/vnd.apple.mpegurl", true),
+    MIME_TYPE("mpd", "application/dash+xml", true),
+    MIME_TYPE("ttf", "font/ttf", true),
+    MIME_TYPE("otf", "font/otf", true),
+    MIME_TYPE("woff", "font/woff", false),
+    MIME_TYPE("woff2", "font/woff2", false),
+    MIME_TYPE("eot", "application/vnd.ms-fontobject", false),
+    MIME_TYPE("png", "image/png", false),
+    MIME_TYPE("apng", "image/apng", false),
+    MIME_TYPE("jpg", "image/jpeg", false),
+    MIME_TYPE("jpeg", "image/jpeg", false),
+    MIME_TYPE("gif", "image/gif", false),
+    MIME_TYPE("webp", "image/webp", false),
+    MIME_TYPE("avif", "image/avif", false),
+    MIME_TYPE("bmp", "image/bmp", false),
+    MIME_TYPE("ico", "image/x-icon", false),
+    MIME_TYPE("tif", "image/tiff", false),
+    MIME_TYPE("tiff", "image/tiff", false),
+    MIME_TYPE("mp4", "video/mp4", false),
+    MIME_TYPE("m4v", "video/mp4", false),
+    MIME_TYPE("webm", "video/webm", false),
+    MIME_TYPE("ogv", "video/ogg", false),
+    MIME_TYPE("mov", "video/quicktime", false),
+    MIME_TYPE("ts", "video/mp2t", false),
+    MIME_TYPE("mp3", "audio/mpeg", false),
+    MIME_TYPE("m4a", "audio/mp4", false),
+    MIME_TYPE("ogg", "audio/ogg", false),
+    MIME_TYPE("oga", "audio/ogg", false),
+    MIME_TYPE("wav", "audio/wav", false),
+    MIME_TYPE("flac", "audio/flac", false),
+    MIME_TYPE("pdf", "application/pdf", false),
+    MIME_TYPE("zip", "application/zip", false),
+    MIME_TYPE("gz", "application/gzip", false),
+    MIME_TYPE("tar", "application/x-tar", false),
+    MIME_TYPE("7z", "application/x-7z-compressed", false),
+    MIME_TYPE("epub", "application/epub+zip", false),
+    MIME_TYPE("bin", "application/octet-stream", false),
+};
+static constexpr MimeTypes::Type DEFAULT_TYPE = MIME_TYPE("", "application/octet-stream", false);
+#undef MIME_TYPE
+
+static constexpr int TYPE_COUNT = sizeof(TYPES) / sizeof(TYPES[0]);
+
+// 哈希表有SLOT_COUNT个槽，每个槽存放TYPES的下标，EMPTY_SLOT表示空槽。槽数约为扩展名数的8倍，
+// 这样随机的种子大约每几十个就有一个没有冲突，编译期的搜索很快
+static constexpr int SLOT_BITS = 9;
+static constexpr int SLOT_COUNT = 1 << SLOT_BITS;
+static constexpr uint8_t EMPTY_SLOT = 0xff;
+static_assert(TYPE_COUNT < EMPTY_SLOT, "too many built-in MIME types for uint8_t slots");
+
+// 带种子的FNV-1a，扩展名已经是小写
+static constexpr uint32_t hashExtension(const char *extension, size_t len, uint32_t seed) {
+    uint32_t hash = 2166136261u ^ seed;
+    for (size_t i = 0; i < len; ++i) {
+        hash = (hash ^ (uint8_t)extension[i]) * 16777619u;
+    }
+    return (hash ^ (hash >> 16)) & (SLOT_COUNT - 1);
+}
+
+static constexpr size_t extensionLength(const char *extension) {
+    size_t len = 0;
+    while (extension[len]) {
+        ++len;
+    }
+    return len;
+}
+
+struct Slots {
+    uint8_t index[SLOT_COUNT];
+};
+
+// 用seed把所有扩展名放进哈希表，有冲突时返回false
+static constexpr bool buildSlots(uint32_t seed, Slots *slots) {
+    for (int i = 0; i < SLOT_COUNT; ++i) {
+        slots->index[i] = EMPTY_SLOT;
+    }
+    for (int i = 0; i < TYPE_COUNT; ++i) {
+        uint32_t slot = hashExtension(TYPES[i].extension, extensionLength(TYPES[i].extension), seed);
+        if (slots->index[slot] != EMPTY_SLOT) {
+            return false;
+        }
+        slots->index[slot] = (uint8_t)i;
+    }
+    return true;
+}
+
+// 从0开始找第一个没有冲突的种子
+static constexpr uint32_t findSeed() {
+    for (uint32_t seed = 0;; ++seed) {
+        Slots slots = {};
+        if (buildSlots(seed, &slots)) {
+            return seed;
+        }
+    }
+}
+
+static constexpr Slots makeSlots(uint32_t seed) {
+    Slots slots = {};
+    buildSlots(seed, &slots);
+    return slots;
+}
+
+static constexpr uint32_t SEED = findSeed();
+static constexpr Slots SLOTS = makeSlots(SEED);
+
+// 配置项mime_types中的类型，字符串由OVERRIDE_TEXTS持有。启动时设置一次，通常只有几项，顺序查找
+static std::vector<std::string> OVERRIDE_TEXTS;
+static std::vector<MimeTypes::Type> OVERRIDES;
+
+const MimeTypes::Type *MimeTypes::lookup(const char *path) {
+    const char *dot = strrchr(path, '.');
+    if (!dot || strchr(dot, '/')) {
+        return &DEFAULT_TYPE;
+    }
+    char extension[MAX_EXTENSION_LEN + 1];
+    size_t len = 0;
+    for (const char *p = dot + 1; *p; ++p) {
+        if (len == MAX_EXTENSION_LEN) {
+            return &DEFAULT_TYPE;
+        }
+        extension[len++] = *p >= 'A' && *p <= 'Z' ? *p - 'A' + 'a' : *p;
+    }
+    extension[len] = '\0';
+
+    for (size_t i = 0; i < OVERRIDES.size(); ++i) {
+        if (strcmp(OVERRIDES[i].extension, extension) == 0) {
+            return &OVERRIDES[i];
+        }
+    }
+    uint8_t index = SLOTS.index[hashExtension(extension, len, SEED)];
+    if (index != EMPTY_SLOT && strcmp(TYPES[index].extension, extension) == 0) {
+        return &TYPES[index];
+    }
+    return &DEFAULT_TYPE;
+}
+
+// 把spec拆成(扩展名，类型)对，扩展名转成小写
+static bool split(const std::string &spec, std::vector<std::pair<std::string, std::string> > *pairs,
+                  std::string *error) {
+    size_t begin = 0;
+    while (begin < spec.size()) {
+        size_t end = spec.find(',', begin);
+        end = end == std::string::npos ? spec.size() : end;
+        std::string item = spec.substr(begin, end - begin);
+        begin = end + 1;
+
+        size_t first = item.find_first_not_of(" \t");
+        if (first == std::string::npos) {
+            continue;
+        }
+        size_t equal = item.find('=');
+        std::string extension = equal == std::string::npos ? "" : item.substr(first, equal - first);
+        extension.erase(extension.find_last_not_of(" \t") + 1);
+        std::string type = equal == std::string::npos ? "" : item.substr(equal + 1);
+        type.erase(0, type.find_first_not_of(" \t"));
+        type.erase(type.find_last_not_of(" \t") + 1);
+        if (extension.empty() || extension[0] == '.' || extension.size() > (size_t)MimeTypes::MAX_EXTENSION_LEN ||
+            type.find('/') == std::string::npos || type.find_first_of("\r\n") != std::string::npos) {
+            if (error) {
+                *error = "invalid MIME type mapping: " + item;
+            }
+            return false;
+        }
+        for (size_t i = 0; i < extension.size(); ++i) {
+            extension[i] = extension[i] >= 'A' && extension[i] <= 'Z' ? extension[i] - 'A' + 'a' : extension[i];
+        }
+        pairs->push_back(std::make_pair(extension, type));
+    }
+    return true;
+}
+
+bool MimeTypes::parse(const std::string &spec, std::string *error) {
+    std::vector<std::pair<std::string, std::string> > pairs;
+    return split(spec, &pairs, error);
+}
+
+bool MimeTypes::configure(const std::string &spec) {
+    std::vector<std::pair<std::string, std::string> > pairs;
+    if (!split(spec, &pairs, NULL)) {
+        return false;
+    }
+
+    // 先生成全部字符串，之后OVERRIDE_TEXTS不再扩容，Type中的指针保持有效
+    OVERRIDES.clear();
+    OVERRIDE_TEXTS.clear();
+    OVERRIDE_TEXTS.reserve(pairs.size() * 2);
+    for (size_t i = 0; i < pairs.size(); ++i) {
+        OVERRIDE_TEXTS.push_back(pairs[i].first);
+        OVERRIDE_TEXTS.push_back("Content-Type: " + pairs[i].second + "\r\n");
+    }
+    for (size_t i = 0; i < pairs.size(); ++i) {
+        const std::string &header = OVERRIDE_TEXTS[2 * i + 1];
+        const std::string &type = pairs[i].second;
+        bool compressible = type.compare(0, 5, "text/") == 0 || type.find("+xml") != std::string::npos ||
+                            type.find("json") != std::string::npos;
+        MimeTypes::Type entry = {OVERRIDE_TEXTS[2 * i].c_str(), HeaderFragment(header.data(), header.size()),
+                                 compressible};
+        OVERRIDES.push_back(entry);
+    }
+    return true;
+}
@@ -0,0 +1,30 @@
+#ifndef MIMETYPES_H
+#define MIMETYPES_H
+
+#include <string>
+
+#include "header_writer.h"
+
+// 按扩展名确定响应的Content-Type。内置的扩展名表在编译期生成完美哈希(见mime_types.cpp)，
+// 查找只计算一次哈希、比较一次扩展名，运行时不建表也不分配内存。配置项mime_types可以增加或者覆盖扩展名，
+// 启动时设置一次，查找时先于内置表检查
+class MimeTypes {
+   public:
+    // 一种扩展名对应的类型
+    struct Type {
+        const char *extension;  // 小写的扩展名，不含点
+        HeaderFragment header;  // 整行Content-Type响应头
+        bool compressible;      // 文本类的类型，值得压缩
+    };
+
+    static const int MAX_EXTENSION_LEN = 15;  // 更长的扩展名直接按默认类型处理
+
+   public:
+    // path的扩展名对应的类型，没有扩展名或者不认识时返回application/octet-stream，不会返回NULL
+    static const Type *lookup(const char *path);
+    // 检查"扩展名=类型,扩展名=类型"格式的配置项，比如"log=text/plain,ts=application/typescript"
+    static bool parse(const std::string &spec, std::string *error);
+    static bool configure(const std::string &spec);  // 启动时应用配置项，替换掉之前配置的，之后只读
+};
+
+#endif
@@ -0,0 +1,73 @@
+#ifndef OBJECTPOOL_H
+#define OBJECTPOOL_H
+
+#include <atomic>
+#include <cstddef>
+#include <new>
+#include <vector>
+
+#include "locker.h"
+
+// 对象池，所有线程共享。归还的对象不析构，放进空闲链表留给下一个使用者，它持有的资源(比如管道)也一起复用，
+// 由使用者在取出后重置自己需要的状态。空闲的对象超过idle_limit个时直接删除，
+// 这样占用的内存跟着同时在用的对象数走，而不是历史上的峰值
+template <typename T>
+class ObjectPool {
+   public:
+    explicit ObjectPool(size_t idle_limit) : idle_limit_(idle_limit), leased_(0) { free_.reserve(idle_limit); }
+
+    ~ObjectPool() {
+        for (size_t i = 0; i < free_.size(); ++i) {
+            delete free_[i];
+        }
+    }
+
+   public:
+    // 优先取空闲的对象，没有时新建，内存不足时返回NULL
+    T *acquire() {
+        locker_.lock();
+        T *object = NULL;
+        if (!free_.empty()) {
+            object = free_.back();
+            free_.pop_back();
+        }
+        locker_.unlock();
+
+        if (!object) {
+            object = new (std::nothrow) T();
+            if (!object) {
+                return NULL;
+            }
+        }
+        leased_.fetch_add(1, std::memory_order_relaxed);
+        return object;
+    }
+
+    // 归还acquire得到的对象，空闲的对象已满时删除
+    void release(T *object) {
+        leased_.fetch_sub(1, std::memory_order_relaxed);
+        locker_.lock();
+        if (free_.size() < idle_limit_) {
+            free_.push_back(object);
+            object = NULL;
+        }
+        locker_.unlock();
+        delete object;
+    }
+
+    size_t leased() const { return leased_.load(std::memory_order_relaxed); }  // 正在使用的对象数
+    size_t idle() const {                                                      // 池中空闲的对象数
+        locker_.lock();
+        size_t idle = free_.size();
+        locker_.unlock();
+        return idle;
+    }
+
+   private:
+    size_t idle_limit_;
+    std::vector<T *> free_;  // 空闲的对象，预先分配了idle_limit_个位置，放入时不会分配内存
+    mutable Locker locker_;  // 保护free_
+    std::atomic<size_t> leased_;
+};
+
+#endif
@@ -0,0 +1,269 @@
+#include "request_parser.h"
+
+#include <strings.h>
+
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define REQUEST_PARSER_X86 1
+#endif
+
+// 按顺序把[begin, end)中每个\r和\n的位置写入positions，最多max个，返回写入的数量
+typedef int (*ScanFunction)(const char *begin, const char *end, const char **positions, int max);
+
+static int scanScalar(const char *begin, const char *end, const char **positions, int max) {
+    int count = 0;
+    for (; begin < end && count < max; ++begin) {
+        if (*begin == '\r' || *begin == '\n') {
+            positions[count++] = begin;
+        }
+    }
+    return count;
+}
+
+#ifdef REQUEST_PARSER_X86
+// 把一个块的比较结果mask中置位的位置依次写入positions，写满max个时返回false
+static inline bool collect(const char *block, unsigned int mask, const char **positions, int *count, int max) {
+    while (mask != 0) {
+        if (*count == max) {
+            return false;
+        }
+        positions[(*count)++] = block + __builtin_ctz(mask);
+        mask &= mask - 1;
+    }
+    return true;
+}
+
+// pcmpestrm一次在16字节中同时比较\r和\n，得到命中位置的位掩码，剩下不足16字节的部分逐字节比较
+__attribute__((target("sse4.2"))) static int scanSse42(const char *begin, const char *end, const char **positions,
+                                                       int max) {
+    const __m128i line_end = _mm_setr_epi8('\r', '\n', 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+
+    int count = 0;
+    for (; end - begin >= 16; begin += 16) {
+        __m128i block = _mm_loadu_si128((const __m128i *)begin);
+        __m128i matched = _mm_cmpestrm(line_end, 2, block, 16, _SIDD_UBYTE_OPS | _SIDD_CMP_EQUAL_ANY | _SIDD_BIT_MASK);
+        if (!collect(begin, _mm_cvtsi128_si32(matched), positions, &count, max)) {
+            return count;
+        }
+    }
+    return count + scanScalar(begin, end, positions + count, max - count);
+}
+
+// 每次比较32字节，剩下的部分用VEX编码的16字节比较，避免和SSE指令混用带来的状态切换开销
+__attribute__((target("avx2"))) static int scanAvx2(const char *begin, const char *end, const char **positions,
+                                                    int max) {
+    const __m256i cr = _mm256_set1_epi8('\r');
+    const __m256i lf = _mm256_set1_epi8('\n');
+
+    int count = 0;
+    for (; end - begin >= 32; begin += 32) {
+        __m256i block = _mm256_loadu_si256((const __m256i *)begin);
+        __m256i matched = _mm256_or_si256(_mm256_cmpeq_epi8(block, cr), _mm256_cmpeq_epi8(block, lf));
+        if (!collect(begin, _mm256_movemask_epi8(matched), positions, &count, max)) {
+            return count;
+        }
+    }
+    if (end - begin >= 16) {
+        __m128i block = _mm_loadu_si128((const __m128i *)begin);
+        __m128i matched = _mm_or_si128(_mm_cmpeq_epi8(block, _mm256_castsi256_si128(cr)),
+                                       _mm_cmpeq_epi8(block, _mm256_castsi256_si128(lf)));
+        if (!collect(begin, _mm_movemask_epi8(matched), positions, &count, max)) {
+            return count;
+        }
+        begin += 16;
+    }
+    return count + scanScalar(begin, end, positions + count, max - count);
+}
+#endif
+
+// 根据CPU支持的指令集选择最快的实现
+static RequestParser::ENGINE detectEngine() {
+#ifdef REQUEST_PARSER_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return RequestParser::AVX2;
+    }
+    if (__builtin_cpu_supports("sse4.2")) {
+        return RequestParser::SSE42;
+    }
+#endif
+    return RequestParser::SCALAR;
+}
+
+static ScanFunction scanFunction(RequestParser::ENGINE engine) {
+#ifdef REQUEST_PARSER_X86
+    if (engine == RequestParser::AVX2) {
+        return scanAvx2;
+    }
+    if (engine == RequestParser::SSE42) {
+        return scanSse42;
+    }
+#endif
+    return scanScalar;
+}
+
+static RequestParser::ENGINE current_engine = detectEngine();
+static ScanFunction scan_line_ends = scanFunction(current_engine);
+
+RequestParser::ENGINE RequestParser::engine() { return current_engine; }
+
+// 指定指令集，只能选择CPU支持的
+void RequestParser::setEngine(ENGINE engine) {
+    if (engine > detectEngine()) {
+        return;
+    }
+    current_engine = engine;
+    scan_line_ends = scanFunction(engine);
+}
+
+const char *RequestParser::engineName(ENGINE engine) {
+    switch (engine) {
+        case AVX2:
+            return "avx2";
+        case SSE42:
+            return "sse4.2";
+        default:
+            return "scalar";
+    }
+}
+
+void RequestParser::reset() {
+    request_line_done_ = false;
+    line_start_ = 0;
+    method_.offset = method_.len = 0;
+    url_.offset = url_.len = 0;
+    version_.offset = version_.len = 0;
+    header_count_ = 0;
+}
+
+// 解析buffer中的[0, len)。用SIMD一遍扫描出一批行尾的位置，再逐行切分，每一行在找到结尾的\r\n之前
+// 都不会改变任何状态，数据不完整时下一次调用从这一行的开头重新解析
+RequestParser::RESULT RequestParser::parse(const char *buffer, int len) {
+    const char *end = buffer + len;
+    const char *line_ends[SCAN_BATCH];  // 扫描出的\r和\n的位置
+    int count = 0;
+    int next = 0;
+    const char *scan_from = buffer + line_start_;
+
+    while (line_start_ < len) {
+        if (next == count) {
+            count = scan_line_ends(scan_from, end, line_ends, SCAN_BATCH);
+            if (count == 0) {
+                return INCOMPLETE;
+            }
+            next = 0;
+            scan_from = count == SCAN_BATCH ? line_ends[count - 1] + 1 : end;
+        }
+
+        // 行必须以\r\n结束
+        const char *delimiter = line_ends[next++];
+        if (*delimiter != '\r') {
+            return ERROR;
+        }
+        if (delimiter + 1 == end) {
+            return INCOMPLETE;
+        }
+        if (delimiter[1] != '\n') {
+            return ERROR;
+        }
+        // 跳过\n，它是下一个扫描结果，或者在这一批之外
+        if (next < count) {
+            ++next;
+        } else {
+            scan_from = delimiter + 2;
+        }
+
+        int line_end = delimiter - buffer;
+        if (!request_line_done_) {
+            // 请求行：GET /index.html HTTP/1.1
+            if (parseRequestLine(buffer, line_end) == ERROR) {
+                return ERROR;
+            }
+            request_line_done_ = true;
+        } else if (line_end == line_start_) {
+            // 空行，请求头结束
+            line_start_ = line_end + 2;
+            return COMPLETE;
+        } else {
+            // 请求头：Host: 192.168.110.129:10000，行很短，直接memchr找冒号
+            const char *colon = (const char *)memchr(buffer + line_start_, ':', line_end - line_start_);
+            if (!colon || parseHeader(buffer, colon - buffer, line_end) == ERROR) {
+                return ERROR;
+            }
+        }
+        line_start_ = line_end + 2;
+    }
+
+    return INCOMPLETE;
+}
+
+// 把[line_start_, line_end)的请求行切分成方法、URL和版本三部分，它们之间以一个空格分隔
+RequestParser::RESULT RequestParser::parseRequestLine(const char *buffer, int line_end) {
+    const char *begin = buffer + line_start_;
+    const char *end = buffer + line_end;
+
+    const char *space = (const char *)memchr(begin, ' ', end - begin);
+    if (!space || space == begin) {
+        return ERROR;
+    }
+    method_.offset = line_start_;
+    method_.len = space - begin;
+
+    begin = space + 1;
+    space = (const char *)memchr(begin, ' ', end - begin);
+    if (!space || space == begin) {
+        return ERROR;
+    }
+    url_.offset = begin - buffer;
+    url_.len = space - begin;
+
+    begin = space + 1;
+    if (begin == end) {
+        return ERROR;
+    }
+    version_.offset = begin - buffer;
+    version_.len = end - begin;
+
+    return COMPLETE;
+}
+
+// 记录[line_start_, line_end)的请求头，名字和冒号之间不允许有空白，值去掉两端的空白
+RequestParser::RESULT RequestParser::parseHeader(const char *buffer, int colon, int line_end) {
+    if (colon == line_start_ || buffer[colon - 1] == ' ' || buffer[colon - 1] == '\t') {
+        return ERROR;
+    }
+    if (header_count_ >= MAX_HEADERS) {
+        return ERROR;
+    }
+
+    int value_begin = colon + 1;
+    while (value_begin < line_end && (buffer[value_begin] == ' ' || buffer[value_begin] == '\t')) {
+        ++value_begin;
+    }
+    int value_end = line_end;
+    while (value_end > value_begin && (buffer[value_end - 1] == ' ' || buffer[value_end - 1] == '\t')) {
+        --value_end;
+    }
+
+    HeaderToken &header = headers_[header_count_++];
+    header.name.offset = line_start_;
+    header.name.len = colon - line_start_;
+    header.value.offset = value_begin;
+    header.value.len = value_end - value_begin;
+
+    return COMPLETE;
+}
+
+// 按名字查找请求头(不区分大小写)，没有时返回NULL
+const Token *RequestParser::find(const char *buffer, const char *name) const {
+    int len = strlen(name);
+    for (int i = 0; i < header_count_; ++i) {
+        const Token &header_name = headers_[i].name;
+        if (header_name.len == len && strncasecmp(buffer + header_name.offset, name, len) == 0) {
+            return &headers_[i].value;
+        }
+    }
+    return NULL;
+}
@@ -0,0 +1,78 @@
+#ifndef REQUESTPARSER_H
+#define REQUESTPARSER_H
+
+#include <cstddef>
+
+// 请求中的一段文本，用在读缓冲区中的偏移和长度表示，缓冲区被搬移或扩容后依然有效
+struct Token {
+    int offset;
+    int len;
+};
+
+// 一个请求头，name和value都不包含两端的空白
+struct HeaderToken {
+    Token name;
+    Token value;
+};
+
+// HTTP请求解析器。用SIMD指令一遍扫描出所有行尾，把请求行和所有请求头切分成偏移/长度索引，
+// 不修改缓冲区。数据不完整时记住当前行的起始位置，下次读到更多数据后从这一行继续解析
+class RequestParser {
+   public:
+    // 最多支持的请求头数量，更多时是语法错误(回复400)。和Apache的LimitRequestFields默认值相同，
+    // 经过多层代理、带着很多cookie和sec-ch-*的浏览器请求也远不到这个数
+    static const int MAX_HEADERS = 100;
+
+    // 解析结果
+    enum RESULT {
+        INCOMPLETE = 0,  // 请求头还不完整，需要继续读取
+        COMPLETE,        // 请求行和请求头都解析完了
+        ERROR            // 请求语法错误
+    };
+
+    // 查找分隔符使用的指令集，运行时根据CPU支持情况选择
+    enum ENGINE {
+        SCALAR = 0,  // 逐字节比较
+        SSE42,       // SSE4.2 pcmpestrm，每次比较16字节
+        AVX2         // AVX2，每次比较32字节
+    };
+
+   public:
+    RequestParser() { reset(); }
+
+   public:
+    void reset();  // 开始解析一个新的请求
+    // 解析buffer中的[0, len)，从上次停下的行继续
+    RESULT parse(const char *buffer, int len);
+
+    const Token &method() const { return method_; }
+    const Token &url() const { return url_; }
+    const Token &version() const { return version_; }
+    int headerCount() const { return header_count_; }
+    const HeaderToken &header(int i) const { return headers_[i]; }
+    // 请求头结束(空行之后)的位置，也就是请求体开始的位置
+    int headerEnd() const { return line_start_; }
+    // 按名字查找请求头(不区分大小写)，没有时返回NULL
+    const Token *find(const char *buffer, const char *name) const;
+
+    static ENGINE engine();                // 当前使用的指令集
+    static void setEngine(ENGINE engine);  // 指定指令集，CPU不支持时返回前不做修改，供基准测试使用
+    static const char *engineName(ENGINE engine);
+
+   private:
+    static const int SCAN_BATCH = 64;  // 每次扫描最多记录的行尾位置数
+
+    RESULT parseRequestLine(const char *buffer, int line_end);
+    RESULT parseHeader(const char *buffer, int colon, int line_end);
+
+   private:
+    bool request_line_done_;  // 请求行是否已经解析
+    int line_start_;          // 当前正在解析的行的起始位置
+    Token method_;
+    Token url_;
+    Token version_;
+    int header_count_;
+    HeaderToken headers_[MAX_HEADERS];
+};
+
+#endif
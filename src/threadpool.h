@@ -2,131 +2,256 @@
 #define THREADPOOL_H
 
 #include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
 
+#include <atomic>
 #include <cstdio>
-#include <list>
 
-#include "http_connection.h"
 #include "locker.h"
+#include "log.h"
+#include "work_queue.h"
 
-// 线程池类，定义模板类是为了代码的复用，模板参数T就是任务类
+// 任务的执行者，EventLoop通过它提交请求，不依赖具体的线程池实现
 template <typename T>
-class ThreadPool {
+class Executor {
    public:
-    ThreadPool(int thread_number = 8, int max_request = 10000);
+    virtual ~Executor() {}
 
+    virtual bool addTask(T *task) = 0;
+    virtual int workerNumber() const = 0;  // 当前的工作线程数
+};
+
+// 线程池类，定义模板类是为了代码的复用，模板参数T就是任务类，Queue是请求队列的策略(见work_queue.h)。
+// max_thread_number大于thread_number时线程数可以伸缩：管理线程定期估算任务在队列中的等待时间
+// (队列长度 / 这段时间内完成的任务数 * 采样间隔)，超过target_wait_ms时增加线程，
+// 一直有线程空闲时逐个减少，线程数保持在[thread_number, max_thread_number]之间
+template <typename T, typename Queue = LockFreeQueue<T> >
+class ThreadPool : public Executor<T> {
+   public:
+    static const int ADJUST_INTERVAL_MS = 100;  // 管理线程的采样间隔
+    static const int SHRINK_AFTER_MS = 5000;    // 连续这么长时间都有线程空闲时才减少一个线程
+
+    ThreadPool(int thread_number = 8, int max_request = 10000, int max_thread_number = 0, int target_wait_ms = 10);
+
+    // 通知所有线程退出并等待它们结束，调用前不能再有新任务
     ~ThreadPool();
 
     bool addTask(T *task);
+    int workerNumber() const { return live_.load(std::memory_order_relaxed); }
 
    private:
+    // 一个工作线程的槽位，线程退出后槽位可以被新线程复用
+    struct alignas(64) Worker {
+        ThreadPool *pool;
+        pthread_t thread;
+        bool joinable;                    // 创建过线程且还没有join，只由管理线程和析构函数访问
+        std::atomic<bool> running;        // 线程退出前清除
+        std::atomic<uint64_t> processed;  // 处理的任务数，只由这个线程写
+    };
+
     static void *worker(void *arg);
+    static void *manager(void *arg);
 
-    void run();
+    void run(Worker *self);
+    bool startWorker();  // 在空闲的槽位上创建一个工作线程
+    void adjust();       // 管理线程的主循环
+    void shutdown();     // 通知所有线程退出并等待它们结束
 
    private:
-    // 线程的数量
+    // 线程数的下限和上限
     int thread_number_;
+    int max_thread_number_;
+    int target_wait_ms_;
 
-    // 线程池数组，大小为thread_number_
-    pthread_t *threads_;
-
-    // 请求队列中最多允许的，等待处理的请求数量
-    int max_request_;
+    // 工作线程的槽位，大小为max_thread_number_
+    Worker *workers_;
+    std::atomic<int> live_;    // 正在运行的工作线程数
+    std::atomic<int> retire_;  // 要求退出的线程数，取到空任务的线程检查它
+    pthread_t manager_;
+    bool has_manager_;  // 线程数可以伸缩时才有管理线程
 
     // 请求队列
-    std::list<T *> work_queue_;
-
-    // 互斥锁
-    Locker queue_locker_;
-
-    // 信号量来判断是否有任务需要处理
-    Semaphore queue_status_;
+    Queue work_queue_;
 
     // 是否结束线程
-    bool stop_;
+    std::atomic<bool> stop_;
 };
 
-template <typename T>
-ThreadPool<T>::ThreadPool(int thread_number, int max_request)
-    : thread_number_(thread_number), max_request_(max_request), stop_(false), threads_(NULL) {
-    if (thread_number <= 0 || max_request <= 0) {
+template <typename T, typename Queue>
+ThreadPool<T, Queue>::ThreadPool(int thread_number, int max_request, int max_thread_number, int target_wait_ms)
+    : thread_number_(thread_number),
+      max_thread_number_(max_thread_number > thread_number ? max_thread_number : thread_number),
+      target_wait_ms_(target_wait_ms),
+      workers_(NULL),
+      live_(0),
+      retire_(0),
+      has_manager_(false),
+      work_queue_(max_request),
+      stop_(false) {
+    if (thread_number <= 0 || max_request <= 0 || target_wait_ms <= 0) {
         throw std::exception();
     }
 
-    threads_ = new pthread_t[thread_number_];
-    if (!threads_) {
-        throw std::exception();
+    workers_ = new Worker[max_thread_number_];
+    for (int i = 0; i < max_thread_number_; ++i) {
+        workers_[i].pool = this;
+        workers_[i].joinable = false;
+        workers_[i].running.store(false, std::memory_order_relaxed);
+        workers_[i].processed.store(0, std::memory_order_relaxed);
     }
 
-    // 创建thread_number_个线程，并将他们设置为线程脱离
+    // 先创建thread_number_个线程，析构时等待它们结束
     for (int i = 0; i < thread_number_; ++i) {
-        printf("正在创建第%d个线程\n", i);
+        LOG_INFO("正在创建第%d个线程", i);
 
-        if ((pthread_create(threads_ + i, NULL, worker, this)) != 0) {
-            delete[] threads_;
+        if (!startWorker()) {
+            shutdown();
+            delete[] workers_;
             throw std::exception();
         }
-
-        // 创建成功，设置线程分离
-        if (pthread_detach(threads_[i]) != 0) {
-            delete[] threads_;
+    }
+    if (max_thread_number_ > thread_number_) {
+        has_manager_ = pthread_create(&manager_, NULL, manager, this) == 0;
+        if (!has_manager_) {
+            shutdown();
+            delete[] workers_;
             throw std::exception();
         }
     }
 }
 
-template <typename T>
-ThreadPool<T>::~ThreadPool() {
-    delete[] threads_;
+template <typename T, typename Queue>
+ThreadPool<T, Queue>::~ThreadPool() {
+    shutdown();
+    delete[] workers_;
+}
+
+template <typename T, typename Queue>
+void ThreadPool<T, Queue>::shutdown() {
     stop_ = true;
+    if (has_manager_) {
+        pthread_join(manager_, NULL);
+    }
+    // 每个线程放一个空任务，阻塞在队列上的线程取到后检查stop_退出
+    for (int i = live_.load(); i > 0; --i) {
+        while (!work_queue_.push(NULL)) {
+            sched_yield();
+        }
+    }
+    for (int i = 0; i < max_thread_number_; ++i) {
+        if (workers_[i].joinable) {
+            pthread_join(workers_[i].thread, NULL);
+        }
+    }
 }
 
-template <typename T>
-bool ThreadPool<T>::addTask(T *task) {
-    queue_locker_.lock();
-    if (work_queue_.size() > max_request_) {
-        queue_locker_.unlock();
-        return false;
+template <typename T, typename Queue>
+bool ThreadPool<T, Queue>::addTask(T *task) {
+    return work_queue_.push(task);
+}
+
+template <typename T, typename Queue>
+bool ThreadPool<T, Queue>::startWorker() {
+    for (int i = 0; i < max_thread_number_; ++i) {
+        Worker &slot = workers_[i];
+        if (slot.running.load(std::memory_order_acquire)) {
+            continue;
+        }
+        if (slot.joinable) {
+            pthread_join(slot.thread, NULL);
+            slot.joinable = false;
+        }
+        slot.running.store(true, std::memory_order_relaxed);
+        live_.fetch_add(1, std::memory_order_relaxed);
+        if (pthread_create(&slot.thread, NULL, worker, &slot) != 0) {
+            slot.running.store(false, std::memory_order_relaxed);
+            live_.fetch_sub(1, std::memory_order_relaxed);
+            return false;
+        }
+        slot.joinable = true;
+        return true;
     }
+    return false;
+}
 
-    work_queue_.push_back(task);
-    queue_locker_.unlock();
-    queue_status_.post();
+template <typename T, typename Queue>
+void *ThreadPool<T, Queue>::worker(void *arg) {
+    Worker *self = (Worker *)arg;
+    self->pool->run(self);
 
-    return true;
+    return self;
 }
 
-template <typename T>
-void *ThreadPool<T>::worker(void *arg) {
+template <typename T, typename Queue>
+void ThreadPool<T, Queue>::run(Worker *self) {
+    while (!stop_) {
+        // 取出任务，队列为空时阻塞
+        T *task = work_queue_.pop();
+        if (!task) {
+            // 管理线程要求减少线程时放入空任务唤醒一个线程，取到的线程认领一个名额后退出
+            int retire = retire_.load(std::memory_order_relaxed);
+            while (retire > 0 && !retire_.compare_exchange_weak(retire, retire - 1, std::memory_order_relaxed)) {
+            }
+            if (retire > 0) {
+                break;
+            }
+            continue;
+        }
+
+        task->process();
+        self->processed.store(self->processed.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    }
+    live_.fetch_sub(1, std::memory_order_relaxed);
+    self->running.store(false, std::memory_order_release);
+}
+
+template <typename T, typename Queue>
+void *ThreadPool<T, Queue>::manager(void *arg) {
     ThreadPool *pool = (ThreadPool *)arg;
-    pool->run();
+    pool->adjust();
 
     return pool;
 }
 
-template <typename T>
-void ThreadPool<T>::run() {
-    while (!stop_) {
-        // 判断有没有任务去执行，如果信号量有值就不阻塞，没有值就阻塞在这
-        queue_status_.wait();
-        // 到这里说明有任务，上锁，开始执行
-        queue_locker_.lock();
-        if (work_queue_.empty()) {
-            queue_locker_.unlock();
-            continue;
+// 估算的等待时间超过目标时，一次最多增加当前线程数的一半(至少一个)；每个采样点都有线程阻塞在队列上、
+// 持续SHRINK_AFTER_MS时减少一个。队列长度不为0但这段时间一个任务也没有完成(比如线程都阻塞在磁盘I/O上)
+// 说明等待时间已经无穷大
+template <typename T, typename Queue>
+void ThreadPool<T, Queue>::adjust() {
+    uint64_t last_processed = 0;
+    int idle_samples = 0;
+    while (!stop_.load(std::memory_order_relaxed)) {
+        usleep(ADJUST_INTERVAL_MS * 1000);
+
+        uint64_t processed = 0;
+        for (int i = 0; i < max_thread_number_; ++i) {
+            processed += workers_[i].processed.load(std::memory_order_relaxed);
         }
-        // 到这里说明有数据
-        T *task = work_queue_.front();
-        work_queue_.pop_front();
-        queue_locker_.unlock();
+        uint64_t completed = processed - last_processed;
+        last_processed = processed;
+        size_t depth = work_queue_.size();
+        int live = live_.load(std::memory_order_relaxed);
 
-        if (!task) {
+        bool slow = depth > 0 && (completed == 0 || depth * ADJUST_INTERVAL_MS / completed > (size_t)target_wait_ms_);
+        if (slow && live < max_thread_number_) {
+            int grow = live / 2 > 1 ? live / 2 : 1;
+            grow = grow < max_thread_number_ - live ? grow : max_thread_number_ - live;
+            for (int i = 0; i < grow && startWorker(); ++i) {
+            }
+            LOG_INFO("thread pool grew to %d workers, queue depth %zu", live_.load(), depth);
+            idle_samples = 0;
             continue;
         }
 
-        task->process();
+        idle_samples = work_queue_.idle() > 0 ? idle_samples + 1 : 0;
+        if (idle_samples * ADJUST_INTERVAL_MS >= SHRINK_AFTER_MS && live - retire_.load() > thread_number_) {
+            int target = live - retire_.fetch_add(1, std::memory_order_relaxed) - 1;
+            work_queue_.push(NULL);
+            LOG_INFO("thread pool shrinking to %d workers", target);
+            idle_samples = 0;
+        }
     }
 }
 
-#endif
\ No newline at end of file
+#endif
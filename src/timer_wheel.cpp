@@ -0,0 +1,136 @@
+#include "timer_wheel.h"
+
+#include <time.h>
+
+TimerWheel::TimerWheel() : current_tick_(now() / TICK_MS), size_(0) {
+    for (int level = 0; level < LEVEL_NUMBER; ++level) {
+        for (int i = 0; i < SLOT_NUMBER; ++i) {
+            slots_[level][i].prev = slots_[level][i].next = &slots_[level][i];
+        }
+    }
+}
+
+uint64_t TimerWheel::now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+void TimerWheel::add(TimerNode *node) {
+    link(node, expireTick(node->deadline.load(std::memory_order_relaxed)));
+    ++size_;
+}
+
+// 没有超时的节点放在最高层最远的槽位；等待重新设置的节点放在下一个tick，每个tick检查一次
+uint64_t TimerWheel::expireTick(uint64_t deadline) const {
+    if (deadline == TimerNode::NO_DEADLINE) {
+        return UINT64_MAX;
+    }
+    if (deadline == TimerNode::REARM_PENDING) {
+        return current_tick_ + 1;
+    }
+    return (deadline + TICK_MS - 1) / TICK_MS;
+}
+
+void TimerWheel::remove(TimerNode *node) {
+    if (!node->next) {
+        return;
+    }
+    node->prev->next = node->next;
+    node->next->prev = node->prev;
+    node->prev = node->next = NULL;
+    --size_;
+}
+
+// 根据到期的tick离现在有多远选择层：第level层的槽位覆盖64^level个tick。超过最高层范围的放在最高层
+// 最远的槽位，到时再重新分配
+void TimerWheel::link(TimerNode *node, uint64_t expire_tick) {
+    if (expire_tick <= current_tick_) {
+        expire_tick = current_tick_ + 1;
+    }
+    uint64_t delta = expire_tick - current_tick_;
+
+    int level = 0;
+    while (level < LEVEL_NUMBER - 1 && delta >= ((uint64_t)1 << (LEVEL_BITS * (level + 1)))) {
+        ++level;
+    }
+    uint64_t max_delta = ((uint64_t)1 << (LEVEL_BITS * LEVEL_NUMBER)) - 1;
+    if (delta > max_delta) {
+        expire_tick = current_tick_ + max_delta;
+    }
+    int index = (expire_tick >> (LEVEL_BITS * level)) & (SLOT_NUMBER - 1);
+
+    TimerNode *head = &slots_[level][index];
+    node->prev = head->prev;
+    node->next = head;
+    head->prev->next = node;
+    head->prev = node;
+}
+
+// 把上层一个槽位中的节点按各自的deadline重新分配到下层
+void TimerWheel::cascade(int level, int index) {
+    TimerNode *head = &slots_[level][index];
+    TimerNode *node = head->next;
+    head->prev = head->next = head;
+
+    while (node != head) {
+        TimerNode *next = node->next;
+        link(node, expireTick(node->deadline.load(std::memory_order_relaxed)));
+        node = next;
+    }
+}
+
+void TimerWheel::advance(uint64_t now, Callback callback, void *arg) {
+    uint64_t target_tick = now / TICK_MS;
+    while (current_tick_ < target_tick) {
+        ++current_tick_;
+
+        // 第0层转完一圈时，从上层依次把下一个槽位的节点分配下来
+        for (int level = 1; level < LEVEL_NUMBER; ++level) {
+            if ((current_tick_ & (((uint64_t)1 << (LEVEL_BITS * level)) - 1)) != 0) {
+                break;
+            }
+            cascade(level, (current_tick_ >> (LEVEL_BITS * level)) & (SLOT_NUMBER - 1));
+        }
+
+        // 取下第0层当前槽位的整条链表再逐个处理，回调中移除节点不会影响遍历
+        TimerNode *head = &slots_[0][current_tick_ & (SLOT_NUMBER - 1)];
+        TimerNode *node = head->next;
+        head->prev = head->next = head;
+        while (node != head) {
+            TimerNode *next = node->next;
+            uint64_t deadline = node->deadline.load(std::memory_order_acquire);
+            if (deadline <= now) {
+                node->prev = node->next = NULL;
+                --size_;
+                callback(node, arg);
+            } else {
+                // deadline在加入之后被推后了，或者还在等待重新设置，重新放进对应的槽位
+                link(node, expireTick(deadline));
+            }
+            node = next;
+        }
+    }
+}
+
+void TimerWheel::forEach(Callback callback, void *arg) {
+    for (int level = 0; level < LEVEL_NUMBER; ++level) {
+        for (int i = 0; i < SLOT_NUMBER; ++i) {
+            TimerNode *head = &slots_[level][i];
+            TimerNode *node = head->next;
+            while (node != head) {
+                TimerNode *next = node->next;
+                callback(node, arg);
+                node = next;
+            }
+        }
+    }
+}
+
+int TimerWheel::timeout(uint64_t now) const {
+    if (size_ == 0) {
+        return -1;
+    }
+    uint64_t next_tick_time = (current_tick_ + 1) * TICK_MS;
+    return next_tick_time > now ? next_tick_time - now : 0;
+}
@@ -0,0 +1,70 @@
+#ifndef TIMERWHEEL_H
+#define TIMERWHEEL_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+// 定时器节点，嵌入在拥有它的对象(比如HttpConnection)中，加入和移出时间轮都只是链表操作，不需要分配内存
+struct TimerNode {
+    TimerNode() : prev(NULL), next(NULL), data(NULL), deadline(NO_DEADLINE) {}
+
+    static const uint64_t NO_DEADLINE = UINT64_MAX;  // 永不超时
+    // 节点交给其他线程处理，之后会由那个线程设置新的超时时刻，可能比原来的早。时间轮每个tick检查一次这样的节点，
+    // 新的时刻最多晚一个tick生效；在这之前不会超时
+    static const uint64_t REARM_PENDING = UINT64_MAX - 1;
+
+    TimerNode *prev;  // 所在槽位的链表，只由时间轮所属的loop线程修改
+    TimerNode *next;
+    void *data;       // 超时回调的参数
+
+    // 超时的时刻(毫秒，TimerWheel::now()的时间)。刷新定时器只需要修改它，可以在任何线程中进行：
+    // 节点所在的槽位到期时，如果发现deadline已经推后，就把节点重新放进对应的槽位，而不是触发超时
+    std::atomic<uint64_t> deadline;
+};
+
+// 分层时间轮，由epoll循环驱动，只在所属的loop线程中使用。每层64个槽位，第0层每个槽位是一个tick，
+// 上一层的每个槽位覆盖下一层一整圈，4层共覆盖64^4个tick。加入、移除和刷新都是O(1)，
+// 上层槽位到期时把其中的节点重新分配到下层(cascade)
+class TimerWheel {
+   public:
+    static const int TICK_MS = 100;      // 一个tick的毫秒数
+    static const int LEVEL_BITS = 6;     // 每层槽位数的位数
+    static const int SLOT_NUMBER = 1 << LEVEL_BITS;
+    static const int LEVEL_NUMBER = 4;
+
+    typedef void (*Callback)(TimerNode *node, void *arg);
+
+   public:
+    TimerWheel();
+
+   public:
+    // 按node->deadline把节点放进对应的槽位，节点不能已经在时间轮中
+    void add(TimerNode *node);
+    // 把节点移出时间轮，不在时间轮中时什么也不做
+    void remove(TimerNode *node);
+    // 处理到now为止到期的槽位，对每个真正超时的节点先移出时间轮再调用callback(node, arg)
+    void advance(uint64_t now, Callback callback, void *arg);
+    // epoll_wait的超时时间：距离下一个tick的毫秒数，时间轮为空时返回-1
+    int timeout(uint64_t now) const;
+    // 对时间轮中的每个节点调用callback(node, arg)，callback中可以移除当前节点
+    void forEach(Callback callback, void *arg);
+
+    bool empty() const { return size_ == 0; }
+    int size() const { return size_; }
+
+    // 单调时钟的当前时刻(毫秒)，用CLOCK_MONOTONIC_COARSE，开销很小
+    static uint64_t now();
+
+   private:
+    void link(TimerNode *node, uint64_t expire_tick);
+    uint64_t expireTick(uint64_t deadline) const;  // 节点应该在哪个tick到期
+    void cascade(int level, int index);
+
+   private:
+    TimerNode slots_[LEVEL_NUMBER][SLOT_NUMBER];  // 每个槽位一个带哨兵的双向循环链表
+    uint64_t current_tick_;                       // 已经处理过的tick
+    int size_;                                    // 时间轮中的节点数
+};
+
+#endif
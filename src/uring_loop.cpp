@@ -0,0 +1,247 @@
+#include "uring_loop.h"
+
+#include <poll.h>
+
+#include <cstring>
+
+#include "log.h"
+
+UringLoop::UringLoop(HttpConnection *users)
+    : EventLoop(users), ring_(NULL), generations_(new uint32_t[max_fd_]()), pending_ops_(new uint8_t[max_fd_]()) {}
+
+UringLoop::~UringLoop() {
+    delete ring_;
+    delete[] generations_;
+    delete[] pending_ops_;
+}
+
+// 连接关闭之后它还没有完成的请求都作废，shutdown会让它们很快完成
+void UringLoop::connectionClosed(int sockfd) {
+    ++generations_[sockfd];
+    pending_ops_[sockfd] = 0;
+    EventLoop::connectionClosed(sockfd);
+}
+
+void UringLoop::loop() {
+    // 只有创建io_uring的线程能向它提交请求
+    try {
+        ring_ = new IoUring(RING_ENTRIES);
+    } catch (...) {
+        LOG_ERROR("io_uring setup failed");
+        return;
+    }
+    if (!ring_->setupBuffers(BUFFER_GROUP, BUFFER_NUMBER, BUFFER_SIZE)) {
+        LOG_ERROR("io_uring buffer ring setup failed");
+        return;
+    }
+
+    submitWakeup();
+    if (listenfd_ != -1) {
+        submitAccept();
+    }
+
+    while (true) {
+        if (draining_.load(std::memory_order_relaxed)) {
+            if (!drain_started_) {
+                cancelAccept();
+                startDrain();
+            }
+            if (connection_count_.load(std::memory_order_relaxed) == 0) {
+                break;
+            }
+        }
+
+        // 提交上一轮产生的所有请求，同时等待新的完成事件，有连接时最多等到时间轮的下一个tick
+        if (ring_->submitAndWait(1, timers_.timeout(TimerWheel::now())) < 0) {
+            LOG_ERROR("io_uring failure, errno is: %d", errno);
+            break;
+        }
+
+        // 处理完成事件时可能提交新的请求，先复制出来再归还CQE
+        struct io_uring_cqe *cqe = NULL;
+        while ((cqe = ring_->peekCqe()) != NULL) {
+            struct io_uring_cqe event = *cqe;
+            ring_->cqeSeen();
+            handleCompletion(event);
+        }
+
+        timers_.advance(TimerWheel::now(), handleTimeout, this);
+    }
+}
+
+void UringLoop::handleCompletion(const struct io_uring_cqe &cqe) {
+    OPERATION op = (OPERATION)(cqe.user_data >> 56);
+    int fd = (int)(uint32_t)cqe.user_data;
+    uint32_t generation = (cqe.user_data >> 32) & 0xffffff;
+
+    if (op == ACCEPT) {
+        handleAccept(cqe);
+    } else if (op == WAKEUP) {
+        // 其他线程投递了新连接或者要求排空，多次poll结束时重新提交
+        handlePending();
+        if (!(cqe.flags & IORING_CQE_F_MORE)) {
+            submitWakeup();
+        }
+    } else if (op == RECV || op == SEND) {
+        if (generation != (generations_[fd] & 0xffffff)) {
+            // 连接已经关闭，recv取走的缓冲区还要还回去
+            if (cqe.flags & IORING_CQE_F_BUFFER) {
+                ring_->recycleBuffer(cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+            }
+            return;
+        }
+        if (op == RECV) {
+            handleRecv(fd, cqe);
+        } else {
+            handleSend(fd, cqe);
+        }
+    }
+}
+
+// 多次accept每接受一个连接产生一个完成事件，直到出错或者被取消时才结束
+void UringLoop::handleAccept(const struct io_uring_cqe &cqe) {
+    if (cqe.res >= 0) {
+        accept_count_.fetch_add(1, std::memory_order_relaxed);
+        Metrics::add(Metrics::ACCEPTS);
+        if (cqe.res >= max_fd_ || HttpConnection::user_count_ >= max_fd_) {
+            close(cqe.res);
+        } else {
+            // 多次accept的所有完成事件共用一个地址，拿不到对方的地址
+            struct sockaddr_in client_address;
+            memset(&client_address, 0, sizeof(client_address));
+            addConnection(cqe.res, client_address);
+        }
+    } else if (cqe.res != -ECANCELED) {
+        LOG_ERROR("accept failed, errno is: %d", -cqe.res);
+    }
+    if (!(cqe.flags & IORING_CQE_F_MORE) && listenfd_ != -1) {
+        submitAccept();
+    }
+}
+
+void UringLoop::addConnection(int connfd, const sockaddr_in &addr) {
+    uint32_t generation = generations_[connfd];
+    EventLoop::addConnection(connfd, addr);
+    // 排空期间加入的连接可能已经被关闭
+    if (generations_[connfd] == generation) {
+        submitRecv(connfd);
+    }
+}
+
+void UringLoop::handleRecv(int fd, const struct io_uring_cqe &cqe) {
+    pending_ops_[fd] &= ~RECV_PENDING;
+    HttpConnection &connection = users_[fd];
+    if (cqe.res == -ENOBUFS) {
+        // 缓冲区暂时用完了，本轮完成事件处理过程中会归还，重新提交
+        update(fd);
+        return;
+    }
+    if (cqe.res <= 0 || !(cqe.flags & IORING_CQE_F_BUFFER)) {
+        // 对方关闭连接或者出错
+        connection.closeConnection();
+        return;
+    }
+
+    unsigned bid = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+    bool ok = connection.receive(ring_->buffer(bid), cqe.res);
+    ring_->recycleBuffer(bid);
+    if (!ok) {
+        connection.closeConnection();
+        return;
+    }
+    if (pending_ops_[fd] & SEND_PENDING) {
+        // 链接在sendmsg之后的recv在响应发送完之前就完成了，数据先留在读缓冲中，发送完毕后再处理
+        return;
+    }
+    connection.process();
+    update(fd);
+}
+
+void UringLoop::handleSend(int fd, const struct io_uring_cqe &cqe) {
+    pending_ops_[fd] &= ~SEND_PENDING;
+    HttpConnection &connection = users_[fd];
+    if (cqe.res < 0 || !connection.sent(cqe.res)) {
+        // 出错时链接在后面的recv被内核取消
+        connection.closeConnection();
+        return;
+    }
+    update(fd);
+}
+
+// 按连接等待的下一件事提交请求，已经有同样的请求在进行时不重复提交
+void UringLoop::update(int fd) {
+    HttpConnection &connection = users_[fd];
+    switch (connection.ioWait()) {
+        case HttpConnection::WAIT_READ:
+            if (!(pending_ops_[fd] & RECV_PENDING)) {
+                submitRecv(fd);
+            }
+            break;
+        case HttpConnection::WAIT_WRITE:
+            if (!(pending_ops_[fd] & SEND_PENDING)) {
+                submitSend(fd, connection.readAfterWrite() && !(pending_ops_[fd] & RECV_PENDING));
+            }
+            break;
+        case HttpConnection::WAIT_CLOSE:
+            connection.closeConnection();
+            break;
+    }
+}
+
+void UringLoop::submitAccept() {
+    struct io_uring_sqe *sqe = ring_->getSqe();
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = listenfd_;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;  // 和epoll后端一样，closeIfIdle等直接调用的recv不会阻塞
+    sqe->user_data = (uint64_t)ACCEPT << 56;
+}
+
+// 排空时先取消多次accept，它持有监听socket的引用，只close监听socket不会让它结束
+void UringLoop::cancelAccept() {
+    if (listenfd_ == -1) {
+        return;
+    }
+    struct io_uring_sqe *sqe = ring_->getSqe();
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = (uint64_t)ACCEPT << 56;
+    sqe->user_data = (uint64_t)CANCEL << 56;
+}
+
+// 在eventfd上多次poll，queueConnection和drain写eventfd时唤醒本loop
+void UringLoop::submitWakeup() {
+    struct io_uring_sqe *sqe = ring_->getSqe();
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = wakeup_fd_;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->poll32_events = POLLIN;
+    sqe->user_data = (uint64_t)WAKEUP << 56;
+}
+
+void UringLoop::submitRecv(int fd) {
+    struct io_uring_sqe *sqe = ring_->getSqe();
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->len = BUFFER_SIZE;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = BUFFER_GROUP;
+    sqe->user_data = userData(RECV, fd);
+    pending_ops_[fd] |= RECV_PENDING;
+}
+
+// link_recv为true时把等待下一个请求的recv链接在sendmsg之后，两者在同一次io_uring_enter中提交。
+// sendmsg只发送了一部分时recv照样开始，出错时recv被取消
+void UringLoop::submitSend(int fd, bool link_recv) {
+    struct io_uring_sqe *sqe = ring_->getSqe();
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)users_[fd].sendMessage();
+    sqe->len = 1;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = userData(SEND, fd);
+    pending_ops_[fd] |= SEND_PENDING;
+    if (link_recv) {
+        sqe->flags |= IOSQE_IO_LINK;
+        submitRecv(fd);
+    }
+}
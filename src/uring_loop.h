@@ -0,0 +1,64 @@
+#ifndef URINGLOOP_H
+#define URINGLOOP_H
+
+#include <cstdint>
+
+#include "event_loop.h"
+#include "io_uring.h"
+
+// 基于io_uring的事件循环，和EventLoop一样one loop per thread，连接的请求在loop线程中直接处理。
+// epoll告诉loop哪个socket可读可写，读写还要各自一次系统调用，每次之后还要epoll_ctl重新注册；
+// io_uring直接完成读写，loop只需要在一次io_uring_enter中提交新的请求并取回完成的结果：
+//   监听socket上提交一次多次accept(multishot)，之后每个新连接都产生一个完成事件，不用重新提交
+//   recv不带缓冲区，数据到达时内核从loop注册的一组缓冲区中取一个(provided buffer)，
+//   等待请求的空闲连接不占用缓冲区
+//   长连接的响应和等待下一个请求的recv链接在一起提交(IOSQE_IO_LINK)，发送完成后内核接着recv
+// 连接上的状态机仍然是HttpConnection，loop把recv收到的数据交给receive，把sendmsg的结果交给sent，
+// 再按ioWait()提交下一个请求
+class UringLoop : public EventLoop {
+   public:
+    static const unsigned RING_ENTRIES = 4096;   // 提交队列的大小
+    static const int BUFFER_GROUP = 0;           // recv使用的缓冲区组
+    static const unsigned BUFFER_NUMBER = 1024;  // 缓冲区的个数，所有连接共享
+    static const unsigned BUFFER_SIZE = 4096;    // 一个缓冲区的大小，也是一次recv最多读取的字节数
+
+   public:
+    explicit UringLoop(HttpConnection *users);
+    ~UringLoop();
+
+   public:
+    // io_uring在loop线程中创建，失败时打印错误并返回
+    void loop();
+    void connectionClosed(int sockfd);
+
+   private:
+    // 完成事件的user_data：高8位是操作，中间24位是提交时连接的代数，低32位是fd
+    enum OPERATION { ACCEPT = 1, WAKEUP, RECV, SEND, CANCEL };
+    // 每个fd上正在进行的操作
+    enum { RECV_PENDING = 1, SEND_PENDING = 2 };
+
+    uint64_t userData(OPERATION op, int fd) const {
+        return ((uint64_t)op << 56) | ((uint64_t)(generations_[fd] & 0xffffff) << 32) | (uint32_t)fd;
+    }
+
+    void addConnection(int connfd, const sockaddr_in &addr);
+    void submitAccept();
+    void cancelAccept();
+    void submitWakeup();
+    void submitRecv(int fd);
+    void submitSend(int fd, bool link_recv);
+    void update(int fd);
+    void handleCompletion(const struct io_uring_cqe &cqe);
+    void handleAccept(const struct io_uring_cqe &cqe);
+    void handleRecv(int fd, const struct io_uring_cqe &cqe);
+    void handleSend(int fd, const struct io_uring_cqe &cqe);
+
+   private:
+    IoUring *ring_;
+    // 以fd为下标，连接在本loop上关闭时加一。完成事件中的代数和当前不同，说明提交它的连接已经关闭，
+    // fd可能已经属于另一个loop上的新连接，忽略这个完成事件，也不能再访问users_[fd]
+    uint32_t *generations_;
+    uint8_t *pending_ops_;  // 以fd为下标，RECV_PENDING和SEND_PENDING的组合
+};
+
+#endif
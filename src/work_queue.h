@@ -0,0 +1,211 @@
+#ifndef WORKQUEUE_H
+#define WORKQUEUE_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <list>
+
+#include "locker.h"
+
+// 线程池的请求队列策略。每种策略提供两个操作：
+//   bool push(T *task);  添加任务，队列已满时返回false
+//   T *pop();            取出一个任务，队列为空时阻塞，可能返回NULL，调用者需要重新pop
+//   size_t size();       队列中的任务数，近似值
+//   int idle();          阻塞在队列上等待任务的线程数，近似值
+
+// 互斥锁 + 信号量保护的链表，每个任务一次堆分配，每次push和pop都要加锁，空闲的工作线程阻塞在信号量上
+template <typename T>
+class LockedQueue {
+   public:
+    explicit LockedQueue(int max_request) : max_request_(max_request), waiters_(0) {}
+
+    bool push(T *task) {
+        queue_locker_.lock();
+        if ((int)work_queue_.size() > max_request_) {
+            queue_locker_.unlock();
+            return false;
+        }
+
+        work_queue_.push_back(task);
+        queue_locker_.unlock();
+        queue_status_.post();
+
+        return true;
+    }
+
+    T *pop() {
+        // 判断有没有任务去执行，如果信号量有值就不阻塞，没有值就阻塞在这
+        waiters_.fetch_add(1, std::memory_order_relaxed);
+        queue_status_.wait();
+        waiters_.fetch_sub(1, std::memory_order_relaxed);
+        // 到这里说明有任务，上锁，开始执行
+        queue_locker_.lock();
+        if (work_queue_.empty()) {
+            queue_locker_.unlock();
+            return NULL;
+        }
+        // 到这里说明有数据
+        T *task = work_queue_.front();
+        work_queue_.pop_front();
+        queue_locker_.unlock();
+
+        return task;
+    }
+
+    size_t size() {
+        queue_locker_.lock();
+        size_t size = work_queue_.size();
+        queue_locker_.unlock();
+        return size;
+    }
+
+    int idle() const { return waiters_.load(std::memory_order_relaxed); }
+
+   private:
+    int max_request_;            // 请求队列中最多允许的，等待处理的请求数量
+    std::list<T *> work_queue_;  // 请求队列
+    Locker queue_locker_;        // 互斥锁
+    Semaphore queue_status_;     // 信号量来判断是否有任务需要处理
+    std::atomic<int> waiters_;   // 阻塞在信号量上的线程数
+};
+
+// 有界无锁多生产者多消费者环形队列(Dmitry Vyukov的算法)。每个槽位带一个序号，生产者和消费者各自用CAS
+// 抢占位置，再通过序号交接槽位中的数据，push和pop都不加锁，也没有堆分配。
+// 队列为空时工作线程先自旋一小段时间，仍然没有任务才登记为睡眠并阻塞在信号量上，
+// 生产者只在有线程睡眠时才post，负载高时几乎不会进入内核
+template <typename T>
+class LockFreeQueue {
+   public:
+    static const int SPIN_COUNT = 2000;  // 阻塞前自旋尝试的次数
+
+    explicit LockFreeQueue(int max_request) : enqueue_pos_(0), dequeue_pos_(0), sleepers_(0) {
+        // 容量向上取整到2的幂，用位与代替取模
+        size_t capacity = 2;
+        while (capacity < (size_t)max_request) {
+            capacity <<= 1;
+        }
+        mask_ = capacity - 1;
+        cells_ = new Cell[capacity];
+        for (size_t i = 0; i < capacity; ++i) {
+            cells_[i].sequence.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    ~LockFreeQueue() { delete[] cells_; }
+
+    bool push(T *task) {
+        if (!tryPush(task)) {
+            return false;
+        }
+        // 和pop中登记睡眠的顺序配对：要么这里看到睡眠的线程并唤醒它，要么它登记后能取到这个任务
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (sleepers_.load(std::memory_order_relaxed) > 0) {
+            queue_status_.post();
+        }
+        return true;
+    }
+
+    T *pop() {
+        T *task = NULL;
+        for (int i = 0; i < SPIN_COUNT; ++i) {
+            if (tryPop(&task)) {
+                return task;
+            }
+            pause();
+        }
+
+        sleepers_.fetch_add(1, std::memory_order_seq_cst);
+        if (tryPop(&task)) {
+            sleepers_.fetch_sub(1, std::memory_order_relaxed);
+            return task;
+        }
+        queue_status_.wait();
+        sleepers_.fetch_sub(1, std::memory_order_relaxed);
+
+        // 多余的post只会让某个线程多醒一次，返回NULL后重新pop即可
+        return tryPop(&task) ? task : NULL;
+    }
+
+    // 不阻塞的push，队列已满时返回false
+    bool tryPush(T *task) {
+        size_t pos = enqueue_pos_.load(std::memory_order_relaxed);
+        while (true) {
+            Cell &cell = cells_[pos & mask_];
+            size_t sequence = cell.sequence.load(std::memory_order_acquire);
+            intptr_t diff = (intptr_t)sequence - (intptr_t)pos;
+            if (diff == 0) {
+                if (enqueue_pos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    cell.data = task;
+                    cell.sequence.store(pos + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if (diff < 0) {
+                // 槽位还没有被消费，队列已满
+                return false;
+            } else {
+                pos = enqueue_pos_.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    // 不阻塞的pop，队列为空时返回false
+    bool tryPop(T **task) {
+        size_t pos = dequeue_pos_.load(std::memory_order_relaxed);
+        while (true) {
+            Cell &cell = cells_[pos & mask_];
+            size_t sequence = cell.sequence.load(std::memory_order_acquire);
+            intptr_t diff = (intptr_t)sequence - (intptr_t)(pos + 1);
+            if (diff == 0) {
+                if (dequeue_pos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    *task = cell.data;
+                    cell.sequence.store(pos + mask_ + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if (diff < 0) {
+                // 槽位还没有写入，队列为空
+                return false;
+            } else {
+                pos = dequeue_pos_.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    // 队列中的任务数，并发修改时只是一个近似值
+    size_t size() const {
+        size_t enqueue_pos = enqueue_pos_.load(std::memory_order_relaxed);
+        size_t dequeue_pos = dequeue_pos_.load(std::memory_order_relaxed);
+        return enqueue_pos > dequeue_pos ? enqueue_pos - dequeue_pos : 0;
+    }
+
+    // 阻塞在信号量上的线程数，不含正在自旋的线程
+    int idle() const { return sleepers_.load(std::memory_order_relaxed); }
+
+    static void pause() {
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_ia32_pause();
+#endif
+    }
+
+   private:
+    struct Cell {
+        std::atomic<size_t> sequence;  // 等于位置时可写入，等于位置 + 1时可读出
+        T *data;
+    };
+
+    static const size_t CACHE_LINE_SIZE = 64;
+
+    // 生产者和消费者的位置放在不同的缓存行，避免伪共享
+    Cell *cells_;
+    size_t mask_;
+    char pad0_[CACHE_LINE_SIZE];
+    std::atomic<size_t> enqueue_pos_;
+    char pad1_[CACHE_LINE_SIZE - sizeof(std::atomic<size_t>)];
+    std::atomic<size_t> dequeue_pos_;
+    char pad2_[CACHE_LINE_SIZE - sizeof(std::atomic<size_t>)];
+    std::atomic<int> sleepers_;  // 阻塞在信号量上的工作线程数
+    Semaphore queue_status_;
+};
+
+#endif
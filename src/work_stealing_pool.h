@@ -0,0 +1,238 @@
+#ifndef WORKSTEALINGPOOL_H
+#define WORKSTEALINGPOOL_H
+
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <exception>
+#include <vector>
+
+#include "locker.h"
+#include "log.h"
+#include "threadpool.h"
+#include "work_queue.h"
+
+// 工作窃取线程池。每个工作线程有自己的任务队列，一个连接的任务优先交给上一次处理它的线程，
+// 连接的状态和缓冲区留在同一个核的缓存中；自己的队列空了的线程去其他线程的队列中窃取任务。
+// 任务类T除了process()之外还需要提供：
+//   int worker();            上一次处理这个任务的工作线程编号，没有时为-1
+//   void setWorker(int id);  记录处理这个任务的工作线程编号
+// 工作线程可以绑定到指定的CPU集合上(比如一个CPU或者一个NUMA节点的所有CPU)
+template <typename T>
+class WorkStealingPool : public Executor<T> {
+   public:
+    static const int SPIN_COUNT = 2000;  // 没有任务时阻塞前自旋尝试的次数
+
+    // affinity[i % affinity.size()]是第i个工作线程可以运行的CPU，为空时不绑定。
+    // max_request是每个工作线程的队列容量
+    WorkStealingPool(int thread_number = 8, int max_request = 10000,
+                     const std::vector<std::vector<int> > &affinity = std::vector<std::vector<int> >());
+
+    // 通知所有线程退出并等待它们结束，调用前不能再有新任务
+    ~WorkStealingPool();
+
+    bool addTask(T *task);
+
+    int workerNumber() const { return thread_number_; }
+    size_t depth(int i) const { return workers_[i]->queue.size(); }  // 第i个工作线程的队列中等待的任务数
+    uint64_t steals(int i) const { return workers_[i]->steals.load(std::memory_order_relaxed); }  // 窃取的任务数
+    uint64_t processed(int i) const { return workers_[i]->processed.load(std::memory_order_relaxed); }  // 处理的任务数
+
+   private:
+    struct Worker {
+        explicit Worker(int max_request) : queue(max_request), sleeping(false), steals(0), processed(0) {}
+
+        WorkStealingPool *pool;
+        int index;
+        pthread_t thread;
+        LockFreeQueue<T> queue;           // 自己的任务队列，其他线程也可以从中窃取
+        Semaphore wakeup;                 // 没有任务时阻塞在这里
+        std::atomic<bool> sleeping;       // 是否已经或者即将阻塞
+        std::atomic<uint64_t> steals;     // 从其他线程窃取的任务数
+        std::atomic<uint64_t> processed;  // 处理的任务数
+    };
+
+    static void *worker(void *arg);
+
+    void run(Worker *self);
+    T *take(int index);        // 先取自己队列中的任务，没有时窃取
+    void wake(Worker *target);  // 任务放进了target的队列，必要时唤醒线程
+
+   private:
+    // 线程的数量
+    int thread_number_;
+
+    // 工作线程，大小为thread_number_
+    std::vector<Worker *> workers_;
+
+    // 没有处理过的任务轮流分给各个线程
+    std::atomic<unsigned int> next_worker_;
+
+    // 正在自旋找任务的线程数，最多max_spinning_个(CPU数的一半)，其余空闲线程直接阻塞，不和干活的线程抢CPU
+    std::atomic<int> spinning_;
+    int max_spinning_;
+
+    // 是否结束线程
+    std::atomic<bool> stop_;
+};
+
+template <typename T>
+WorkStealingPool<T>::WorkStealingPool(int thread_number, int max_request,
+                                      const std::vector<std::vector<int> > &affinity)
+    : thread_number_(thread_number), next_worker_(0), spinning_(0), stop_(false) {
+    if (thread_number <= 0 || max_request <= 0) {
+        throw std::exception();
+    }
+    max_spinning_ = sysconf(_SC_NPROCESSORS_ONLN) / 2;
+    if (max_spinning_ < 1) {
+        max_spinning_ = 1;
+    }
+
+    for (int i = 0; i < thread_number_; ++i) {
+        Worker *worker = new Worker(max_request);
+        worker->pool = this;
+        worker->index = i;
+        workers_.push_back(worker);
+    }
+
+    // 创建thread_number_个线程，按配置绑定CPU，析构时等待它们结束
+    for (int i = 0; i < thread_number_; ++i) {
+        LOG_INFO("正在创建第%d个线程", i);
+
+        Worker *worker = workers_[i];
+        if (pthread_create(&worker->thread, NULL, WorkStealingPool::worker, worker) != 0) {
+            throw std::exception();
+        }
+
+        if (!affinity.empty()) {
+            const std::vector<int> &cpus = affinity[i % affinity.size()];
+            cpu_set_t cpu_set;
+            CPU_ZERO(&cpu_set);
+            for (size_t j = 0; j < cpus.size(); ++j) {
+                CPU_SET(cpus[j], &cpu_set);
+            }
+            if (pthread_setaffinity_np(worker->thread, sizeof(cpu_set), &cpu_set) != 0) {
+                LOG_WARN("第%d个线程绑定CPU失败", i);
+            }
+        }
+    }
+}
+
+template <typename T>
+WorkStealingPool<T>::~WorkStealingPool() {
+    stop_ = true;
+    // 唤醒所有线程，醒来的线程在循环开头看到stop_后退出；没有睡眠的线程多出的post不会被用到
+    for (int i = 0; i < thread_number_; ++i) {
+        workers_[i]->wakeup.post();
+    }
+    for (int i = 0; i < thread_number_; ++i) {
+        pthread_join(workers_[i]->thread, NULL);
+        delete workers_[i];
+    }
+}
+
+// 任务放进上一次处理它的线程的队列，没有处理过的轮流分配，目标队列已满时依次尝试下一个线程
+template <typename T>
+bool WorkStealingPool<T>::addTask(T *task) {
+    int index = task->worker();
+    if (index < 0 || index >= thread_number_) {
+        index = next_worker_.fetch_add(1, std::memory_order_relaxed) % thread_number_;
+    }
+
+    for (int i = 0; i < thread_number_; ++i) {
+        Worker *target = workers_[(index + i) % thread_number_];
+        if (target->queue.tryPush(task)) {
+            wake(target);
+            return true;
+        }
+    }
+    return false;
+}
+
+// target睡眠时唤醒它；target醒着但队列中已经积压了任务时，唤醒一个睡眠的线程来窃取
+template <typename T>
+void WorkStealingPool<T>::wake(Worker *target) {
+    // 和run中登记睡眠的顺序配对：要么这里看到target在睡眠并唤醒它，要么它登记后能取到这个任务
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (target->sleeping.exchange(false, std::memory_order_relaxed)) {
+        target->wakeup.post();
+        return;
+    }
+
+    if (target->queue.size() > 1) {
+        for (int i = 1; i < thread_number_; ++i) {
+            Worker *thief = workers_[(target->index + i) % thread_number_];
+            bool sleeping = true;
+            if (thief->sleeping.compare_exchange_strong(sleeping, false, std::memory_order_relaxed)) {
+                thief->wakeup.post();
+                return;
+            }
+        }
+    }
+}
+
+template <typename T>
+void *WorkStealingPool<T>::worker(void *arg) {
+    Worker *worker = (Worker *)arg;
+    worker->pool->run(worker);
+
+    return worker;
+}
+
+template <typename T>
+T *WorkStealingPool<T>::take(int index) {
+    T *task = NULL;
+    if (workers_[index]->queue.tryPop(&task)) {
+        return task;
+    }
+
+    // 从下一个线程开始依次窃取，避免所有空闲线程都去窃取同一个队列
+    for (int i = 1; i < thread_number_; ++i) {
+        if (workers_[(index + i) % thread_number_]->queue.tryPop(&task)) {
+            workers_[index]->steals.fetch_add(1, std::memory_order_relaxed);
+            return task;
+        }
+    }
+    return NULL;
+}
+
+template <typename T>
+void WorkStealingPool<T>::run(Worker *self) {
+    while (!stop_) {
+        T *task = take(self->index);
+
+        // 没有任务时先自旋，仍然没有才登记睡眠，登记之后再检查一次，避免错过登记前放进来的任务
+        if (!task) {
+            if (spinning_.fetch_add(1, std::memory_order_relaxed) < max_spinning_) {
+                for (int i = 0; !task && i < SPIN_COUNT; ++i) {
+                    LockFreeQueue<T>::pause();
+                    if (i % 64 == 63) {
+                        task = take(self->index);
+                    }
+                }
+            }
+            spinning_.fetch_sub(1, std::memory_order_relaxed);
+        }
+        if (!task) {
+            self->sleeping.store(true, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            task = take(self->index);
+            if (!task) {
+                self->wakeup.wait();
+                continue;
+            }
+            // 取到了任务，撤销登记；如果已经被唤醒过，信号量多出的一次post只会让下次wait立即返回
+            self->sleeping.store(false, std::memory_order_relaxed);
+        }
+
+        task->setWorker(self->index);
+        self->processed.fetch_add(1, std::memory_order_relaxed);
+        task->process();
+    }
+}
+
+#endif
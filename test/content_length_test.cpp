@@ -0,0 +1,134 @@
+// Content-Length的测试：装不进读缓冲的长度、超出int和long long范围的长度以及不是数字的长度都回复400
+// 并关闭连接，服务器继续正常工作；合法的消息体被跳过，后面的流水线请求照常处理
+//
+// 编译运行(在test目录下，先在src目录下编译出服务器)：
+//   g++ -O2 content_length_test.cpp -o content_length_test
+//   ./content_length_test ../src/a.out [port]
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+static int failures = 0;
+static int port = 9016;
+
+#define CHECK(condition)                                                         \
+    do {                                                                         \
+        if (!(condition)) {                                                      \
+            printf("%s:%d: CHECK failed: %s\n", __FILE__, __LINE__, #condition); \
+            ++failures;                                                          \
+        }                                                                        \
+    } while (0)
+
+static int connectServer() {
+    int sockfd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    inet_pton(AF_INET, "127.0.0.1", &address.sin_addr);
+    if (connect(sockfd, (struct sockaddr *)&address, sizeof(address)) < 0) {
+        close(sockfd);
+        return -1;
+    }
+    return sockfd;
+}
+
+// 发送request，读到服务器关闭连接或者超时为止，返回收到的所有数据
+static std::string exchange(const std::string &request) {
+    int sockfd = connectServer();
+    if (sockfd < 0) {
+        return "";
+    }
+    struct timeval timeout = {2, 0};
+    setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    send(sockfd, request.data(), request.size(), MSG_NOSIGNAL);
+    std::string response;
+    char buffer[4096];
+    ssize_t len;
+    while ((len = recv(sockfd, buffer, sizeof(buffer), 0)) > 0) {
+        response.append(buffer, len);
+    }
+    close(sockfd);
+    return response;
+}
+
+static int countResponses(const std::string &response, const char *status) {
+    int count = 0;
+    for (size_t pos = response.find(status); pos != std::string::npos; pos = response.find(status, pos + 1)) {
+        ++count;
+    }
+    return count;
+}
+
+static std::string withLength(const char *length) {
+    return std::string("GET /index.html HTTP/1.1\r\nHost: x\r\nContent-Length: ") + length + "\r\n\r\n";
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        printf("usage: %s server [port]\n", argv[0]);
+        return 1;
+    }
+    if (argc > 2) {
+        port = atoi(argv[2]);
+    }
+
+    char port_text[16];
+    snprintf(port_text, sizeof(port_text), "%d", port);
+    pid_t pid = fork();
+    if (pid == 0) {
+        freopen("/dev/null", "w", stdout);
+        execl(argv[1], argv[1], port_text, "-D", "../resources", (char *)NULL);
+        _exit(127);
+    }
+    int sockfd = -1;
+    for (int i = 0; i < 200 && (sockfd = connectServer()) < 0; ++i) {
+        usleep(10000);
+    }
+    if (sockfd < 0) {
+        printf("server did not start on port %d\n", port);
+        kill(pid, SIGKILL);
+        waitpid(pid, NULL, 0);
+        return 1;
+    }
+    close(sockfd);
+
+    // 装得进int，但远超读缓冲的上限；加上请求头的长度后超出int
+    const char *rejected[] = {"2147483637", "1073741824", "99999999999999999999", "-1", "12abc", ""};
+    for (size_t i = 0; i < sizeof(rejected) / sizeof(rejected[0]); ++i) {
+        std::string response = exchange(withLength(rejected[i]));
+        if (response.compare(0, 24, "HTTP/1.1 400 Bad Request") != 0) {
+            printf("Content-Length: \"%s\" got \"%.40s\"\n", rejected[i], response.c_str());
+        }
+        CHECK(response.compare(0, 24, "HTTP/1.1 400 Bad Request") == 0);
+        CHECK(countResponses(response, "HTTP/1.1 ") == 1);
+    }
+
+    // 消息体被跳过，它后面的请求正常处理
+    std::string pipelined = "GET /index.html HTTP/1.1\r\nHost: x\r\nContent-Length: 5\r\n\r\nhello"
+                            "GET /index.html HTTP/1.1\r\nHost: x\r\nConnection: close\r\n\r\n";
+    CHECK(countResponses(exchange(pipelined), "HTTP/1.1 200 OK") == 2);
+
+    // 服务器仍然存活
+    std::string response = exchange("GET /index.html HTTP/1.1\r\nHost: x\r\nConnection: close\r\n\r\n");
+    CHECK(response.compare(0, 15, "HTTP/1.1 200 OK") == 0);
+    CHECK(waitpid(pid, NULL, WNOHANG) == 0);
+
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+    if (failures) {
+        printf("%d check(s) failed\n", failures);
+        return 1;
+    }
+    printf("OK\n");
+    return 0;
+}
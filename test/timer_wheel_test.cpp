@@ -0,0 +1,91 @@
+// 时间轮的测试：节点在等待重新设置超时(REARM_PENDING)时所在的槽位到期，之后被设置了一个比原来早的超时时刻，
+// 必须按新的时刻超时，而不是被放到最高层最远的槽位
+//
+// 编译运行(在test目录下)：
+//   g++ -O2 -I../src timer_wheel_test.cpp ../src/timer_wheel.cpp -o timer_wheel_test
+//   ./timer_wheel_test
+
+#include <cstdio>
+#include <cstdlib>
+
+#include "timer_wheel.h"
+
+static int failures = 0;
+
+#define CHECK(condition)                                                         \
+    do {                                                                         \
+        if (!(condition)) {                                                      \
+            printf("%s:%d: CHECK failed: %s\n", __FILE__, __LINE__, #condition); \
+            ++failures;                                                          \
+        }                                                                        \
+    } while (0)
+
+static void countExpired(TimerNode *node, void *arg) { ++*(int *)arg; }
+
+// 槽位在REARM_PENDING期间到期，然后重新设置60秒的超时
+static void testFireWhilePending() {
+    TimerWheel wheel;
+    uint64_t base = TimerWheel::now();
+    TimerNode node;
+    node.deadline.store(base + 1000);
+    wheel.add(&node);
+
+    // 交给工作线程处理，原来的槽位到期时不能超时
+    node.deadline.store(TimerNode::REARM_PENDING);
+    int expired = 0;
+    wheel.advance(base + 5000, countExpired, &expired);
+    CHECK(expired == 0);
+    CHECK(wheel.size() == 1);
+
+    // 工作线程设置了空闲超时
+    uint64_t deadline = base + 5000 + 60 * 1000;
+    node.deadline.store(deadline);
+    wheel.advance(deadline - TimerWheel::TICK_MS, countExpired, &expired);
+    CHECK(expired == 0);
+    wheel.advance(deadline + TimerWheel::TICK_MS, countExpired, &expired);
+    CHECK(expired == 1);
+    CHECK(wheel.empty());
+}
+
+// 节点在较晚的槽位(空闲超时)时被重新加入为REARM_PENDING，之后设置了更早的时刻(请求头超时)
+static void testRearmEarlier() {
+    TimerWheel wheel;
+    uint64_t base = TimerWheel::now();
+    TimerNode node;
+    node.deadline.store(base + 60 * 1000);
+    wheel.add(&node);
+
+    wheel.remove(&node);
+    node.deadline.store(TimerNode::REARM_PENDING);
+    wheel.add(&node);
+    int expired = 0;
+    wheel.advance(base + 1000, countExpired, &expired);
+    node.deadline.store(base + 2000);
+    wheel.advance(base + 2000 + TimerWheel::TICK_MS, countExpired, &expired);
+    CHECK(expired == 1);
+}
+
+// 没有超时限制的节点不会超时，也不会每个tick被检查(仍然在时间轮中)
+static void testNoDeadline() {
+    TimerWheel wheel;
+    uint64_t base = TimerWheel::now();
+    TimerNode node;
+    wheel.add(&node);
+    int expired = 0;
+    wheel.advance(base + 3600 * 1000, countExpired, &expired);
+    CHECK(expired == 0);
+    CHECK(wheel.size() == 1);
+    wheel.remove(&node);
+}
+
+int main() {
+    testFireWhilePending();
+    testRearmEarlier();
+    testNoDeadline();
+    if (failures) {
+        printf("%d check(s) failed\n", failures);
+        return 1;
+    }
+    printf("OK\n");
+    return 0;
+}